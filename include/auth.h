@@ -4,8 +4,17 @@
 #include "thread_safe_data.h"
 #include <stdbool.h>
 
+// Longest username signup accepts; tokens and data file names grow with it
+#define AUTH_USERNAME_MAX 64
+
 bool auth_signup(ThreadSafeData* tsd, const char* username, const char* password);
+
+// Returns a token naming username, signed with the server's key, or NULL.
 char* auth_login(ThreadSafeData* tsd, const char* username, const char* password);
-bool auth_verify_token(const char* token, ThreadSafeData* tsd);
+
+// Checks the signature of a token, with or without a "Bearer " prefix, and
+// copies the username it was issued to into username, which must hold
+// AUTH_USERNAME_MAX + 1 bytes.
+bool auth_verify_token(const char* token, ThreadSafeData* tsd, char* username);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include "http_parser.h"
+#include "profiled_mutex.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Requests waiting for the writer beyond this are dropped, not queued
+#define CAPTURE_MAX_PENDING 4096
+
+typedef struct CaptureEntry {
+    struct CaptureEntry* next;
+    uint64_t arrival_us;          // CLOCK_REALTIME microseconds
+    size_t header_count;
+    char fields[];                // method, path, each name and value, body; all NUL-terminated
+} CaptureEntry;
+
+// Records sampled requests to a JSONL file, one object per line with ts_us,
+// method, path, headers (as [name, value] pairs, in order) and body. The
+// serving threads copy the fields of the request they already parsed into
+// one block; a background thread formats and writes them.
+typedef struct {
+    FILE* file;
+    unsigned sample_every;        // Record one request in this many
+    atomic_ulong seen;
+    ProfiledMutex mutex;
+    pthread_cond_t cond;
+    CaptureEntry* head;
+    CaptureEntry* tail;
+    size_t pending;
+    unsigned long written;
+    unsigned long dropped;
+    bool stopping;
+    pthread_t writer;
+} Capture;
+
+// Opens path for appending and starts the writer thread.
+bool capture_start(Capture* capture, const char* path, unsigned sample_every);
+
+// Hands one parsed request to the writer if it is sampled. Never blocks
+// on the file; drops the request when the writer has fallen behind.
+void capture_record(Capture* capture, const HttpRequest* request);
+
+// Writes out everything still queued, then stops the writer and closes the file.
+void capture_stop(Capture* capture);
+
+#endif // CAPTURE_H
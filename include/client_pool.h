@@ -0,0 +1,83 @@
+#ifndef CLIENT_POOL_H
+#define CLIENT_POOL_H
+
+#include "http_client.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CLIENT_POOL_MAX_CONNECTIONS 64
+// Requests that may wait for a free connection
+#define CLIENT_POOL_QUEUE_SIZE 1024
+#define CLIENT_POOL_HOST_SIZE 64
+
+typedef struct {
+    const char* ip;              // NULL for HTTP_CLIENT_DEFAULT_IP
+    int port;                    // 0 for HTTP_CLIENT_DEFAULT_PORT
+    unsigned connections;        // Persistent connections; 0 for 4
+    unsigned timeout_ms;         // Per send or receive; 0 waits forever
+} ClientPoolConfig;
+
+// Called on a pool thread once the request is answered or has failed. The
+// callback owns response when ok is true and frees it with
+// http_client_response_free.
+typedef void (*ClientPoolCallback)(bool ok, HttpClientResponse* response, void* ctx);
+
+typedef struct {
+    char* request;
+    size_t length;
+    ClientPoolCallback callback;
+    void* ctx;
+} ClientPoolJob;
+
+struct ClientPool;
+
+// One persistent connection and the thread that drives it. Bytes read past
+// the end of a response stay in buffer for the next one.
+typedef struct {
+    struct ClientPool* pool;
+    pthread_t thread;
+    int fd;                      // -1 until the first request, or after a close
+    char* buffer;
+    size_t length;
+    size_t capacity;
+} ClientPoolWorker;
+
+// Keep-alive connections to one server, shared by any number of threads.
+// Requests are queued without blocking and sent on whichever connection is
+// free. A connection is opened on first use and kept until the server
+// closes it; a request that finds its reused connection closed by the
+// server before any response is retried once on a new one.
+typedef struct ClientPool {
+    char ip[CLIENT_POOL_HOST_SIZE];
+    int port;
+    char host[CLIENT_POOL_HOST_SIZE];   // Host header value, "ip:port"
+    unsigned timeout_ms;
+
+    ClientPoolJob jobs[CLIENT_POOL_QUEUE_SIZE];
+    size_t front;
+    size_t size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stopping;
+
+    ClientPoolWorker workers[CLIENT_POOL_MAX_CONNECTIONS];
+    unsigned worker_count;
+    atomic_ulong connects;       // Connections opened, to see how well they are reused
+} ClientPool;
+
+bool client_pool_init(ClientPool* pool, const ClientPoolConfig* config);
+// Answers every queued request, then closes the connections.
+void client_pool_destroy(ClientPool* pool);
+
+// Queues a copy of request and returns at once. False if the queue is full
+// or the pool is shutting down; the callback is not called then.
+bool client_pool_submit(ClientPool* pool, const char* request, size_t length,
+                        ClientPoolCallback callback, void* ctx);
+
+// Sends request and waits for its response.
+bool client_pool_request(ClientPool* pool, const char* request, size_t length,
+                         HttpClientResponse* response);
+
+#endif // CLIENT_POOL_H
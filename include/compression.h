@@ -0,0 +1,29 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bodies smaller than this are sent as-is; the framing would outweigh the gain
+#define COMPRESSION_MIN_SIZE 256
+
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+} ContentEncoding;
+
+// Picks the encoding to answer an Accept-Encoding header with, honouring
+// q-values and "*". Prefers gzip, then deflate, on equal weight. NULL means
+// the client did not ask for compression.
+ContentEncoding compression_negotiate(const char* accept_encoding);
+
+// Content-Encoding token for encoding, or NULL for identity.
+const char* compression_encoding_name(ContentEncoding encoding);
+
+// Compresses data into a new malloc'd buffer. Returns false on failure.
+bool compression_encode(ContentEncoding encoding, const char* data, size_t length,
+                        char** out, size_t* out_length);
+
+#endif // COMPRESSION_H
@@ -2,13 +2,171 @@
 #define CONNECTION_HANDLER_H
 
 #include "message_queue.h"
+#include "message_processor.h"
+#include "capture.h"
+#include "response_batch.h"
+#include "rate_limit.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define CONNECTION_MAX_IOVECS 64
+// How long a draining server still waits on an idle connection, for a
+// request the client sent before it could see the drain
+#define CONNECTION_DRAIN_GRACE_MS 500
+// How often the threads engine closes parked connections that ran out of time
+#define CONNECTION_PARK_SWEEP_MS 100
+
+// Per-phase limits, in milliseconds
+typedef struct {
+    unsigned header_ms;   // From a request's first byte until its headers are in
+    unsigned body_ms;     // From the end of the headers until the body is in
+    unsigned idle_ms;     // Between requests on a kept-alive connection
+    unsigned write_ms;    // For a response the client is not reading
+    unsigned deadline_ms; // From queuing a request until a processor starts it;
+                          // X-Request-Timeout may shorten it
+} ConnectionTimeouts;
+
+// Where requests are answered
+typedef enum {
+    DISPATCH_QUEUE,          // Handed to the processor threads
+    DISPATCH_INLINE,         // Run to completion on the connection's thread
+    DISPATCH_INLINE_FAST,    // Inline, except auth requests, which hash passwords
+} DispatchMode;
+
+struct Connection;
+
+typedef struct {
+    struct Connection* conn;      // NULL when the slot is free
+    uint32_t generation;          // Bumped on every take, so stale events miss
+} ParkedConnection;
+
+// Connections of the threads engine that wait for their next request. They
+// sit in an epoll set instead of each holding a worker, and any worker that
+// sees the set readable picks one up. A slot's index and generation are the
+// epoll cookie, so an event for a connection that was meanwhile expired is
+// recognised and dropped.
+typedef struct {
+    int epoll_fd;                 // -1 when unavailable; workers then block per connection
+    ProfiledMutex mutex;
+    ParkedConnection* slots;
+    size_t capacity;
+    size_t* free_slots;
+    size_t free_count;
+    atomic_size_t count;
+    atomic_ullong swept_ms;
+} ConnectionPark;
 
 typedef struct {
     MessageQueue* queue;
+    DispatchMode dispatch_mode;
+    MessageProcessor* processor;  // Answers inline requests; needed unless DISPATCH_QUEUE
+    ConnectionTimeouts timeouts;
+    Capture* capture;             // Sampled request recording, NULL when off
+    RateLimiter* rate_limiter;    // Per-address limits, NULL when off
+    atomic_bool draining;         // Set once the server stops taking new work
+    uint64_t drain_started_ms;    // Written before draining is set
+    int drain_fd;                 // eventfd, readable from then on
+    ConnectionPark park;          // Idle connections of the threads engine
 } ConnectionHandler;
 
+typedef enum {
+    CONNECTION_READING_HEADERS,
+    CONNECTION_READING_BODY,
+    CONNECTION_IDLE,
+    CONNECTION_PROCESSING,        // Waiting on processors; no read deadline
+} ConnectionPhase;
+
+// Request/response state of one client connection. Both I/O engines drive
+// it: bytes go in with connection_reserve/connection_received, requests are
+// queued by connection_handler_dispatch, and completed responses come back
+// out, in request order, through connection_ready_responses.
+typedef struct Connection {
+    int fd;
+    char* buffer;                 // Received bytes not yet queued
+    size_t length;
+    size_t capacity;
+    ResponseBatch batch;
+    size_t next_response;         // First slot not yet handed out for sending
+    bool after_write;             // Last queued request was not a GET
+    bool keep_alive;              // Cleared once no further requests are read
+    bool failed;                  // A response was lost or a send failed
+    bool closing;                 // A response that ends the connection was handed out
+    const char* final_response;   // Canned error sent after the queued responses
+    bool served;                  // At least one request has been queued
+    ConnectionPhase phase;
+    uint64_t phase_started_ms;
+    RateLimitEntry* rate_entry;   // Client's rate limit slot, NULL when untracked
+    uint64_t accepted_ns;         // Start of a traced first request's accept span
+    uint64_t send_started_ns;     // When the responses being sent were handed out
+} Connection;
+
 void connection_handler_init(ConnectionHandler* handler, MessageQueue* queue);
-bool connection_handler_handle(ConnectionHandler* handler, int client_fd);
+void connection_handler_destroy(ConnectionHandler* handler);
+
+// Starts a graceful shutdown. Every request read from then on is answered
+// with "Connection: close", and idle connections are closed once the drain
+// grace period passes. Connections that have not sent a request yet still
+// get their first one.
+void connection_handler_drain(ConnectionHandler* handler);
+bool connection_handler_draining(const ConnectionHandler* handler);
+
+// Applies the per-address limits to a newly accepted connection from addr
+// (IPv4, network order). A refused client is answered 429 and closed;
+// otherwise *entry is to be stored in the connection's rate_entry.
+bool connection_handler_admit(ConnectionHandler* handler, int client_fd, uint32_t addr,
+                              uint64_t now_ms, RateLimitEntry** entry);
+
+// Serves a connection on the calling thread until it closes, or until it
+// waits for its next request, when it is parked instead.
+bool connection_handler_handle(ConnectionHandler* handler, int client_fd, uint32_t addr);
+
+// Threads engine: a worker polls the park's epoll fd (-1 when there is no
+// park) and calls connection_handler_resume when it is readable, which
+// serves one parked connection that has input. connection_handler_expire
+// closes parked connections past their deadline, at most once per
+// CONNECTION_PARK_SWEEP_MS however many workers call it.
+int connection_handler_park_fd(const ConnectionHandler* handler);
+void connection_handler_resume(ConnectionHandler* handler);
+void connection_handler_expire(ConnectionHandler* handler, uint64_t now_ms);
+size_t connection_handler_parked(const ConnectionHandler* handler);
+
+// Queues every complete request that may run now, or answers it on the
+// calling thread when the dispatch mode runs it inline. Consecutive GETs
+// run concurrently on the processors, but any other method waits for the
+// requests before it and holds back the ones after it, so pipelined writes
+// take effect in the order they were sent.
+void connection_handler_dispatch(ConnectionHandler* handler, Connection* conn);
+
+bool connection_init(Connection* conn, int fd);
+// Waits for outstanding responses, then frees the buffers and gives up the
+// rate limit slot. Does not close fd.
+void connection_destroy(Connection* conn);
+
+// Returns space for at least one more byte of input and its size, or NULL
+// (with final_response set) once the connection buffers too much.
+char* connection_reserve(Connection* conn, size_t* available);
+void connection_received(Connection* conn, size_t bytes);
+
+// Fills iov with the responses that are complete and next in order, without
+// blocking. Returns how many were added; pass the same count to
+// connection_responses_sent once they have been written. A response marked
+// close is the last one handed out: it clears keep_alive, and the slots
+// behind it are drained without being sent.
+int connection_ready_responses(Connection* conn, struct iovec* iov, int max_iov);
+void connection_responses_sent(Connection* conn, int count);
+
+// True while queued requests still have responses to send.
+bool connection_has_outstanding(const Connection* conn);
+
+// Works out the phase the connection is in and returns the CLOCK_MONOTONIC
+// millisecond deadline for leaving it, or 0 when there is none.
+uint64_t connection_read_deadline(const ConnectionHandler* handler, Connection* conn,
+                                  uint64_t now_ms);
+// Gives up on the connection after its read deadline passed, answering a
+// half-received request with 408.
+void connection_expire(Connection* conn);
 
-#endif // CONNECTION_HANDLER_H
\ No newline at end of file
+#endif // CONNECTION_HANDLER_H
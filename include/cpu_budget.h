@@ -0,0 +1,17 @@
+#ifndef CPU_BUDGET_H
+#define CPU_BUDGET_H
+
+// How much CPU this process may use, for sizing thread pools
+typedef struct {
+    unsigned online;     // CPUs in the affinity mask (the online count if that fails)
+    double quota;        // cgroup CPU limit in CPUs; 0 when there is none
+    unsigned cpus;       // The smaller of the two, rounded up; always at least 1
+} CpuBudget;
+
+// Reads the affinity mask and the cgroup CPU limit. The limit is the
+// tightest cpu.max on the path from the process's cgroup v2 group up to the
+// mount root; without cgroup v2, cpu.cfs_quota_us of the v1 cpu controller
+// is used instead.
+void cpu_budget_detect(CpuBudget* budget);
+
+#endif // CPU_BUDGET_H
@@ -1,6 +1,8 @@
 #ifndef CRASH_HANDLER_H
 #define CRASH_HANDLER_H
 
-void install_crash_handler();
+// Fatal signals print a backtrace and the flight recorder before the
+// process dies of them; SIGUSR1 prints the flight recorder and carries on.
+void install_crash_handler(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,36 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events each thread keeps; older ones are overwritten
+#define FLIGHT_RECORDER_EVENTS 1024
+#define FLIGHT_DETAIL_SIZE 32
+
+typedef enum {
+    FLIGHT_REQUEST_START,   // value: request bytes; detail: request line
+    FLIGHT_REQUEST_END,     // value: response bytes; detail: status
+    FLIGHT_QUEUE_PUSH,      // value: messages queued, this one included
+    FLIGHT_QUEUE_POP,       // value: nanoseconds the message waited
+    FLIGHT_LOCK_WAIT,       // value: profiled_mutex ticks waited; detail: lock name
+    FLIGHT_EVENT_TYPES
+} FlightEventType;
+
+// The last FLIGHT_RECORDER_EVENTS events of every thread, always on, for
+// the crash handler to print. Each thread writes a ring of its own with no
+// lock or atomic read-modify-write, so an event costs a timestamp and a few
+// stores. A thread that exits leaves its ring, and the history in it, to
+// the next thread that records.
+
+// Records an event on the calling thread's ring. fd is the client socket,
+// or -1; detail is copied, up to FLIGHT_DETAIL_SIZE bytes of it.
+void flight_record(FlightEventType type, int fd, uint64_t value, const char* detail,
+                   size_t detail_length);
+
+// Writes every ring to fd, oldest event first, with times relative to now.
+// Uses only async-signal-safe calls, so a signal handler may call it; rings
+// still being written may show a torn event.
+void flight_recorder_dump(int fd);
+
+#endif // FLIGHT_RECORDER_H
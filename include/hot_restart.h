@@ -0,0 +1,44 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <pthread.h>
+#include "profiled_mutex.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Hands the listening socket from a running server to its replacement over
+// a UNIX socket with SCM_RIGHTS. The replacement connects, receives the
+// descriptor, starts accepting on it and confirms; only then does the old
+// server stop accepting and drain. The socket is never closed in between, so
+// clients are not refused during a deploy.
+typedef struct {
+    char* path;
+    int unix_fd;             // Where successors connect, -1 between listeners
+    ProfiledMutex mutex;     // Guards unix_fd against hot_restart_stop
+    int server_fd;           // Listening TCP socket to hand over
+    int notify_fd;           // Written once a successor has confirmed
+    atomic_bool stopping;
+    atomic_bool handed_off;
+    pthread_t thread;
+} HotRestart;
+
+// Asks the server listening on path for its listening socket. Returns the
+// descriptor and leaves *handoff_fd open for hot_restart_confirm, or returns
+// -1 when no server answers there.
+int hot_restart_takeover(const char* path, int* handoff_fd);
+
+// Tells the previous server that this one is accepting, so it may drain.
+bool hot_restart_confirm(int handoff_fd);
+
+// Waits on path for a successor and hands it server_fd. Writes to notify_fd
+// once the handoff is confirmed; a successor that fails before confirming
+// is forgotten and the next one may try.
+bool hot_restart_listen(HotRestart* hr, const char* path, int server_fd, int notify_fd);
+
+// Stops waiting for successors and removes path if it is still ours. Safe
+// on a zeroed HotRestart that was never started.
+void hot_restart_stop(HotRestart* hr);
+
+bool hot_restart_handed_off(HotRestart* hr);
+
+#endif // HOT_RESTART_H
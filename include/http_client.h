@@ -0,0 +1,45 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HTTP_CLIENT_DEFAULT_IP "127.0.0.1"
+#define HTTP_CLIENT_DEFAULT_PORT 8080
+
+typedef struct {
+    int status;
+    char* body;          // NUL-terminated copy of the body
+    size_t body_length;
+    bool keep_alive;     // false when the server sent "Connection: close"
+} HttpClientResponse;
+
+int http_client_connect(const char* ip, int port);
+
+// Request builders write a complete HTTP/1.1 request into buffer and return
+// its length, or -1 if it did not fit.
+int http_client_build_get_users(char* buffer, size_t size, const char* host,
+                                const char* token, bool keep_alive);
+int http_client_build_post_users(char* buffer, size_t size, const char* host,
+                                 const char* token, const char* text, bool keep_alive);
+// ndjson holds one JSON record per line, for POST /users/batch.
+int http_client_build_post_batch(char* buffer, size_t size, const char* host,
+                                 const char* token, const char* ndjson, bool keep_alive);
+int http_client_build_signup(char* buffer, size_t size, const char* host,
+                             const char* username, const char* password, bool keep_alive);
+int http_client_build_login(char* buffer, size_t size, const char* host,
+                            const char* username, const char* password, bool keep_alive);
+
+bool http_client_send_all(int fd, const char* data, size_t length);
+
+// Parses a response held in data. Returns the number of bytes it occupies,
+// 0 if more bytes are needed, or -1 if the response is malformed. When
+// at_eof is set, a response without Content-Length ends at the end of data.
+long http_client_parse_response(const char* data, size_t length, bool at_eof,
+                                HttpClientResponse* response);
+
+// Reads one complete response from fd, honouring Content-Length.
+bool http_client_read_response(int fd, HttpClientResponse* response);
+void http_client_response_free(HttpClientResponse* response);
+
+#endif // HTTP_CLIENT_H
@@ -9,12 +9,31 @@
 #endif
 #include <string.h>
 
+// Headers the server reads itself. The parser files each under its slot
+// as it goes, so handlers find them without comparing names.
+typedef enum {
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_REQUEST_TIMEOUT,
+    HTTP_HEADER_KNOWN_COUNT,
+    HTTP_HEADER_UNKNOWN = HTTP_HEADER_KNOWN_COUNT
+} HttpKnownHeader;
+
 typedef struct {
     char* method;
     char* path;
+    char* version;
     char** header_keys;
     char** header_values;
     size_t header_count;
+    // First value of each known header, pointing into header_values
+    const char* known_headers[HTTP_HEADER_KNOWN_COUNT];
     char* body;
 } HttpRequest;
 
@@ -29,4 +48,30 @@ void http_request_free(HttpRequest* req);
 
 HttpParseResult http_parse_request(const char* raw_request);
 
+// Returns the size of the request line and headers, including the empty
+// line that ends them, or 0 if they are not complete yet.
+size_t http_header_length(const char* data, size_t length);
+
+// Returns the size of the first complete request in data (headers plus
+// Content-Length body), 0 if more bytes are needed, or -1 if it can never
+// be framed (bad Content-Length or a Transfer-Encoding we do not support).
+long http_request_length(const char* data, size_t length);
+
+// Which known header name is (case-insensitive, length bytes), or
+// HTTP_HEADER_UNKNOWN.
+HttpKnownHeader http_header_classify(const char* name, size_t length);
+
+// Value of the first header of a known kind, or NULL.
+static inline const char* http_request_known_header(const HttpRequest* req, HttpKnownHeader header) {
+    return req->known_headers[header];
+}
+
+// Value of the first header called name (case-insensitive), or NULL. Known
+// names are answered from their slot; others are searched for.
+const char* http_request_header(const HttpRequest* req, const char* name);
+
+// HTTP/1.1 connections persist unless the client sends "Connection: close";
+// HTTP/1.0 connections persist only with "Connection: keep-alive".
+bool http_request_keep_alive(const HttpRequest* req);
+
 #endif // HTTP_PARSER_H
\ No newline at end of file
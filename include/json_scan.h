@@ -0,0 +1,34 @@
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Deepest nesting the scanner steps over before deferring to cJSON
+#define JSON_SCAN_MAX_DEPTH 32
+
+// A top-level string member to extract. value receives the unescaped,
+// NUL-terminated string when found.
+typedef struct {
+    const char* name;
+    char* value;
+    size_t size;
+    bool found;
+} JsonField;
+
+typedef enum {
+    JSON_SCAN_OK,            // A valid object; every wanted member found is a string
+    JSON_SCAN_INVALID,       // Not a JSON object
+    JSON_SCAN_UNSUPPORTED    // Valid as far as read, but needs cJSON's handling
+} JsonScanResult;
+
+// Reads the top-level members of the object in json without allocating,
+// copying the wanted string members into their buffers. Input the scanner
+// does not reproduce exactly as cJSON would read it is reported as
+// unsupported: a wanted member that is not a string, does not fit its
+// buffer or contains \u0000, a key matching a wanted name only when case
+// is ignored or that contains escapes, or nesting deeper than
+// JSON_SCAN_MAX_DEPTH. The first of duplicate members wins, as in cJSON.
+JsonScanResult json_scan_strings(const char* json, JsonField* fields, size_t count);
+
+#endif // JSON_SCAN_H
@@ -4,16 +4,38 @@
 #include "message_queue.h"
 #include "thread_safe_data.h"
 #include "http_parser.h"
+#include <stdatomic.h>
 #include <stdbool.h>
 
+// Most messages a processor takes from the queue at once
+#define MESSAGE_PROCESSOR_BATCH 16
+
 typedef struct {
     MessageQueue* queue;
     ThreadSafeData* shared_data;
     bool running;
+    const atomic_bool* draining;   // Once true, responses ask clients to close; may be NULL
+    atomic_ulong expired;          // Messages dropped because their deadline had passed
 } MessageProcessor;
 
 void message_processor_init(MessageProcessor* mp, MessageQueue* queue, ThreadSafeData* data);
 void message_processor_start(MessageProcessor* mp);
 void message_processor_stop(MessageProcessor* mp);
 
+// Answers messages already taken from the queue, at most
+// MESSAGE_PROCESSOR_BATCH of them, and frees them. A message whose
+// deadline has passed is not run; it gets a canned 503 instead. message_processor_start
+// does this in a loop; thread pools that pop for themselves call it directly.
+void message_processor_handle_batch(MessageProcessor* mp, Message* messages, size_t count);
+
+// The queue lane a request belongs in, by route.
+MessageClass message_processor_classify(const HttpRequest* request);
+
+// Answers a parsed request on the calling thread, as a processor would.
+// keep_alive selects the Connection header. Returns the response, which is
+// *response_length bytes and freed by the caller, or NULL if none could be
+// built.
+char* message_processor_respond(MessageProcessor* mp, HttpRequest* request, bool keep_alive,
+                                size_t* response_length);
+
 #endif // MESSAGE_PROCESSOR_H
\ No newline at end of file
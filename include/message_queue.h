@@ -4,32 +4,84 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include "response_batch.h"
+#include "profiled_mutex.h"
+
+// Traffic classes, each queued in its own lane
+typedef enum {
+    MESSAGE_CLASS_READ,     // GETs: cheap and latency sensitive
+    MESSAGE_CLASS_WRITE,    // Data writes
+    MESSAGE_CLASS_AUTH,     // Signup and login: password hashing
+    MESSAGE_CLASS_COUNT
+} MessageClass;
 
 typedef struct {
     int client_fd;
     char* message;
+    ResponseBatch* batch;   // Where to deliver the response; NULL to send it on client_fd
+    size_t slot;
+    uint64_t queued_ns;     // CLOCK_MONOTONIC time of the push
+    uint64_t deadline_ns;   // When the client stops caring, same clock; 0 for never
+    uint64_t trace_id;      // Sampled request id for trace_span; 0 when untraced
 } Message;
 
+typedef struct {
+    size_t capacity;
+    unsigned weight;        // Share of pops while other lanes also have work
+} MessageLaneConfig;
+
 typedef struct {
     Message* messages;
     size_t capacity;
     size_t front;
     size_t rear;
     size_t size;
-    
-    pthread_mutex_t mutex;
+    unsigned weight;
+    long credit;            // Smooth weighted round robin state
+} MessageLane;
+
+// One ring per traffic class. Pops are work conserving: an idle lane's
+// share goes to the others, and busy lanes are served in proportion to
+// their weights, interleaved rather than in runs. A full lane refuses
+// pushes without taking space from the others.
+typedef struct {
+    MessageLane lanes[MESSAGE_CLASS_COUNT];
+    size_t size;            // Across all lanes
+    unsigned waiting;       // Consumers blocked in a pop
+    uint64_t popped;        // Messages taken so far, and their total time queued
+    uint64_t wait_ns;
+
+    ProfiledMutex mutex;
     pthread_cond_t cond;
     bool shutdown_flag;
 } MessageQueue;
 
+// Every lane gets capacity slots and the same weight.
 void message_queue_init(MessageQueue* mq, size_t capacity);
+void message_queue_init_lanes(MessageQueue* mq, const MessageLaneConfig lanes[MESSAGE_CLASS_COUNT]);
 
 void message_queue_destroy(MessageQueue* mq);
 
-bool message_queue_push(MessageQueue* mq, int client_fd, const char* message);
+bool message_queue_push(MessageQueue* mq, MessageClass message_class, int client_fd,
+                        const char* message, ResponseBatch* batch, size_t slot,
+                        uint64_t deadline_ns, uint64_t trace_id);
+
+bool message_queue_pop(MessageQueue* mq, Message* out);
+
+// Waits for a message, then takes up to max in lane order. Other blocked
+// consumers are left their share of what is queued. Returns how many were
+// taken, or 0 once the queue is shut down.
+size_t message_queue_pop_batch(MessageQueue* mq, Message* out, size_t max);
+// As message_queue_pop_batch, but gives up with 0 after timeout_ms without
+// a message. A timeout of 0 waits forever.
+size_t message_queue_pop_batch_timed(MessageQueue* mq, Message* out, size_t max,
+                                     unsigned timeout_ms);
 
-bool message_queue_pop(MessageQueue* mq, int* client_fd, char** message);
+// Messages popped since init, the total time they spent queued, and how
+// many wait now.
+void message_queue_stats(MessageQueue* mq, uint64_t* popped, uint64_t* wait_ns, size_t* queued);
 
 void message_queue_shutdown(MessageQueue* mq);
 
-#endif // MESSAGE_QUEUE_H
\ No newline at end of file
+#endif // MESSAGE_QUEUE_H
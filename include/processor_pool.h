@@ -0,0 +1,66 @@
+#ifndef PROCESSOR_POOL_H
+#define PROCESSOR_POOL_H
+
+#include "message_processor.h"
+#include "profiled_mutex.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROCESSOR_POOL_MAX_THREADS 256
+
+typedef struct {
+    unsigned min_threads;        // 0 for 1
+    unsigned max_threads;        // Capped at PROCESSOR_POOL_MAX_THREADS
+    unsigned interval_ms;        // Between sizing decisions; 0 for 100
+    unsigned grow_wait_us;       // Mean queue wait that calls for another thread; 0 for 1000
+} ProcessorPoolConfig;
+
+struct ProcessorPool;
+
+typedef struct {
+    struct ProcessorPool* pool;
+    unsigned index;
+    pthread_t thread;
+} ProcessorSlot;
+
+// Processor threads that follow the load. Every interval the pool looks at
+// how long popped messages waited in the queue and how busy its threads
+// were: it adds a thread while messages wait and the threads are busy, and
+// retires one after a run of mostly idle intervals. Thread i runs while
+// i < target, so retiring the last thread never disturbs the others.
+typedef struct ProcessorPool {
+    MessageProcessor* processor;
+    ProcessorPoolConfig config;
+    ProcessorSlot slots[PROCESSOR_POOL_MAX_THREADS];
+    unsigned threads;            // Running; changed only by the controller
+    atomic_uint target;
+    atomic_ullong busy_ns;       // Time spent answering messages, all threads
+
+    pthread_t controller;
+    ProfiledMutex mutex;         // Guards stopping
+    pthread_cond_t cond;
+    bool stopping;
+
+    uint64_t last_popped;        // Controller state from the previous interval
+    uint64_t last_wait_ns;
+    uint64_t last_busy_ns;
+    unsigned idle_intervals;
+    atomic_ulong grown;
+    atomic_ulong shrunk;
+} ProcessorPool;
+
+// Starts min_threads processors for processor's queue, and the thread that
+// resizes the pool. Nothing is left running when it fails.
+bool processor_pool_start(ProcessorPool* pool, MessageProcessor* processor,
+                          const ProcessorPoolConfig* config);
+
+// Stops resizing and joins every processor. Call once the processor has
+// been stopped or its queue shut down.
+void processor_pool_stop(ProcessorPool* pool);
+
+// Threads currently answering messages.
+unsigned processor_pool_size(const ProcessorPool* pool);
+
+#endif // PROCESSOR_POOL_H
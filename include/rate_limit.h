@@ -0,0 +1,64 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Slots in the client table; a power of two
+#define RATE_LIMIT_TABLE_SIZE 16384
+// Slots examined for one address before giving up on tracking it
+#define RATE_LIMIT_MAX_PROBE 32
+
+// Zero disables a limit
+typedef struct {
+    unsigned requests_per_sec;    // Token refill rate per client address
+    unsigned burst;               // Bucket size; defaults to requests_per_sec
+    unsigned max_connections;     // Concurrent connections per client address
+} RateLimitConfig;
+
+// One client address. owner packs the address, an in-use bit and the open
+// connection count, so a slot changes hands and gains a connection with a
+// single compare-and-swap. bucket packs the last refill time (milliseconds
+// since the limiter started) and the tokens left, in thousandths.
+typedef struct {
+    atomic_ullong owner;
+    atomic_ullong bucket;
+} RateLimitEntry;
+
+// Per-address token buckets and connection counts in a fixed open-addressing
+// table, shared by every I/O thread without locks. Slots are never freed:
+// a slot whose client has no connections and a full bucket carries no
+// information, so the next new address that probes past it takes it over.
+// When every probed slot is live the address goes untracked and unlimited.
+typedef struct {
+    RateLimitConfig config;
+    uint64_t epoch_ms;
+    RateLimitEntry* table;
+    atomic_ullong rejected_connections;
+    atomic_ullong rejected_requests;
+    atomic_ullong untracked;
+} RateLimiter;
+
+typedef enum {
+    RATE_LIMIT_ALLOWED,
+    RATE_LIMIT_TOO_MANY_CONNECTIONS,
+    RATE_LIMIT_TOO_MANY_REQUESTS
+} RateLimitResult;
+
+bool rate_limiter_init(RateLimiter* limiter, const RateLimitConfig* config, uint64_t now_ms);
+void rate_limiter_destroy(RateLimiter* limiter);
+
+// Admits a new connection from addr (an IPv4 address in network order).
+// A client at its connection limit or out of tokens is refused. On success
+// *entry is the slot to pass to rate_limiter_take and rate_limiter_disconnect;
+// it is NULL when the address is not tracked.
+RateLimitResult rate_limiter_connect(RateLimiter* limiter, uint32_t addr, uint64_t now_ms,
+                                     RateLimitEntry** entry);
+void rate_limiter_disconnect(RateLimitEntry* entry);
+
+// Spends one token for a request on a connection admitted with entry.
+bool rate_limiter_take(RateLimiter* limiter, RateLimitEntry* entry, uint64_t now_ms);
+
+#endif // RATE_LIMIT_H
@@ -0,0 +1,68 @@
+#ifndef RESPONSE_BATCH_H
+#define RESPONSE_BATCH_H
+
+#include <pthread.h>
+#include "profiled_mutex.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Responses for the requests pipelined on one connection. The connection
+// thread reserves one slot per request it queues, processors fill slots in
+// any order, and the connection thread sends them back in request order.
+typedef struct {
+    char* data;         // NULL if the request could not be answered
+    size_t length;
+    bool ready;
+    bool close;         // The connection ends once this response is sent
+    uint64_t trace_id;  // Sampled request id, 0 when untraced; owned by the connection thread
+    uint64_t trace_start_ns;
+} PendingResponse;
+
+// Wakes an event-loop thread through an eventfd when a response it owns is
+// completed. The flag collapses bursts of completions into one write.
+typedef struct {
+    int event_fd;
+    atomic_bool signalled;
+} ResponseNotifier;
+
+typedef struct {
+    PendingResponse* responses;
+    size_t count;
+    size_t capacity;
+    ProfiledMutex mutex;
+    pthread_cond_t cond;
+    ResponseNotifier* notifier;   // NULL when the owner blocks in response_batch_wait
+} ResponseBatch;
+
+void response_batch_init(ResponseBatch* batch);
+void response_batch_destroy(ResponseBatch* batch);
+
+// Frees the previous batch's responses so the slots can be reused.
+void response_batch_reset(ResponseBatch* batch);
+
+// Returns the slot for the next request, or -1 if the slot array could not grow.
+long response_batch_reserve(ResponseBatch* batch);
+
+// Takes ownership of data.
+void response_batch_complete(ResponseBatch* batch, size_t slot, char* data, size_t length);
+// Completes count slots under one lock, waking the owner once. closes marks
+// the responses after which the connection must end, and may be NULL.
+void response_batch_complete_many(ResponseBatch* batch, const size_t* slots, char* const* data,
+                                  const size_t* lengths, const bool* closes, size_t count);
+
+// Blocks until slot `from` is ready, then returns how many consecutive slots
+// starting at `from` are ready.
+size_t response_batch_wait(ResponseBatch* batch, size_t from);
+
+// Non-blocking variant: how many consecutive slots from `from` are ready.
+size_t response_batch_ready(ResponseBatch* batch, size_t from);
+
+int response_notifier_init(ResponseNotifier* notifier);
+void response_notifier_destroy(ResponseNotifier* notifier);
+void response_notifier_signal(ResponseNotifier* notifier);
+// Re-arms the notifier; call before scanning for completed responses.
+void response_notifier_clear(ResponseNotifier* notifier);
+
+#endif // RESPONSE_BATCH_H
@@ -0,0 +1,30 @@
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Delimiter searches used by the HTTP parser. Each has a scalar version
+// and, on x86, SSE2 and AVX2 versions that test 16 or 32 bytes per step;
+// the widest the CPU supports is picked when the program starts.
+typedef enum {
+    SIMD_SCAN_SCALAR,
+    SIMD_SCAN_SSE2,
+    SIMD_SCAN_AVX2
+} SimdScanKernel;
+
+// Offset of the first c in data[0, length), or length if there is none.
+size_t simd_scan_byte(const char* data, size_t length, char c);
+
+// Offset just past the empty line that ends the headers ("\n\n" or
+// "\n\r\n"), or 0 if data does not contain one yet.
+size_t simd_scan_header_end(const char* data, size_t length);
+
+SimdScanKernel simd_scan_kernel(void);
+const char* simd_scan_kernel_name(SimdScanKernel kernel);
+
+// Switches every search to kernel, for benchmarks. False if this CPU or
+// build cannot run it; the current kernel is kept then.
+bool simd_scan_select(SimdScanKernel kernel);
+
+#endif // SIMD_SCAN_H
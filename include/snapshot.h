@@ -0,0 +1,67 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "OSUSERS1"
+#define SNAPSHOT_VERSION 1
+
+// On-disk layout of a user directory snapshot, in host byte order:
+//   SnapshotHeader
+//   SnapshotEntry[user_count], sorted bytewise by username
+//   string table: "username\0password_hash\0" for each entry, in order
+// crc is the CRC-32 of everything after the header. The file is mapped and
+// searched in place, so opening it costs one checksum pass and no parsing.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t user_count;
+    uint64_t strings_size;
+    uint32_t crc;
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t offset;            // Of the username in the string table
+    uint32_t username_length;
+    uint32_t hash_length;       // The hash starts after the username's NUL
+} SnapshotEntry;
+
+typedef struct {
+    const char* username;
+    const char* password_hash;
+} SnapshotUser;
+
+typedef enum {
+    SNAPSHOT_OK,
+    SNAPSHOT_MISSING,
+    SNAPSHOT_INVALID            // Unreadable, wrong version or bad checksum
+} SnapshotStatus;
+
+// A read-only mapping of a snapshot file; all zero when empty
+typedef struct {
+    void* map;
+    size_t map_size;
+    const SnapshotEntry* entries;
+    const char* strings;
+    size_t count;
+} Snapshot;
+
+// Maps path and verifies it. On anything but SNAPSHOT_OK the snapshot is
+// left empty and usable.
+SnapshotStatus snapshot_open(Snapshot* snapshot, const char* path);
+void snapshot_close(Snapshot* snapshot);
+
+// Index of username, or -1 when it is not in the snapshot.
+long snapshot_find(const Snapshot* snapshot, const char* username);
+SnapshotUser snapshot_user(const Snapshot* snapshot, size_t index);
+
+// Writes users, which must be sorted bytewise by username and unique, to a
+// temporary file and renames it over path, so a crash leaves either the old
+// snapshot or the new one.
+bool snapshot_write(const char* path, const SnapshotUser* users, size_t count);
+
+#endif // SNAPSHOT_H
@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 
@@ -19,14 +20,19 @@ typedef struct {
 int socket_init(Socket* sock, int domain, int type, int protocol);
 int socket_init_from_fd(Socket* sock, int fd);
 void socket_destroy(Socket* sock);
+// Closes this process's descriptor without shutting the socket down, for a
+// listening socket that another process has taken over.
+void socket_release(Socket* sock);
 
 int socket_bind(Socket* sock, int port, const char* ip);
 int socket_listen(Socket* sock, int backlog);
-int socket_accept(Socket* sock, int* client_fd, char* client_ip);
+// client_ip (INET_ADDRSTRLEN bytes) and client_addr (network order) may be NULL
+int socket_accept(Socket* sock, int* client_fd, char* client_ip, uint32_t* client_addr);
 int socket_connect(Socket* sock, const char* ip, int port);
 
 int socket_set_receive_timeout(Socket* sock, int seconds);
 int socket_set_reuse_addr(Socket* sock, bool enable);
+int socket_set_nonblocking(Socket* sock, bool enable);
 
 int socket_get_fd(const Socket* sock);
 
@@ -3,23 +3,108 @@
 
 #include <pthread.h>
 #include "cJSON.h"
+#include "compression.h"
+#include "user_directory.h"
+#include "profiled_mutex.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 
+// Text data in one content encoding, as of one generation
 typedef struct {
-    char* auth_filename;
-    char* data_filename;
-    pthread_mutex_t mutex;
-    cJSON* auth_data;    // For storing authentication data (username/password)
+    unsigned long generation;   // 0 until first filled
+    char* data;                 // NULL when the encoding does not pay off
+    size_t length;
+} EncodedText;
+
+#define TSD_TOKEN_KEY_SIZE 32
+
+// Partitions kept in memory, and bytes of compressed text they may cache
+// between them, before idle ones are evicted. Their files stay on disk.
+#define TSD_MAX_PARTITIONS 4096
+#define TSD_MAX_CACHED_BYTES (64u << 20)
+
+// One user's text data, with its own file, lock, generation and cache, so
+// users never wait for each other
+typedef struct DataPartition {
+    struct DataPartition* next;      // Hash chain
+    char* owner;
+    char* filename;
+    ProfiledMutex mutex;             // Guards the file and generation
+    unsigned long generation;        // Taken from the generation clock by every write
+    ProfiledMutex cache_mutex;       // Serialises refills of encoded_text
+    EncodedText encoded_text[ENCODING_COUNT];
+    atomic_uint refs;                // Callers using it; only idle partitions are evicted
+    atomic_bool referenced;          // Used since the eviction sweep last passed
+} DataPartition;
+
+typedef struct {
+    char* auth_filename;    // JSON user list, imported once if no snapshot exists
+    char* data_directory;   // Holds one text file per user
+    ProfiledMutex mutex;    // Guards users
+    UserDirectory users;    // Usernames and password hashes
+    unsigned char token_key[TSD_TOKEN_KEY_SIZE];   // Signs login tokens
+    unsigned long text_epoch;        // Distinguishes generations across restarts
+    ProfiledRwlock partitions_lock;     // Guards the table, not the partitions
+    DataPartition** partitions;
+    size_t partition_buckets;
+    size_t partition_count;
+    size_t evict_bucket;             // Where the eviction sweep resumes
+    atomic_ulong generation_clock;   // Never reused, so an evicted partition's ETags stay stale
+    atomic_size_t cached_bytes;      // Compressed text held across all partitions
 } ThreadSafeData;
 
 void tsd_init(ThreadSafeData* tsd);
 void tsd_destroy(ThreadSafeData* tsd);
-cJSON* tsd_read_auth(ThreadSafeData* tsd);
-bool tsd_write_auth(ThreadSafeData* tsd, cJSON* value);
-bool save_to_file_unlocked(ThreadSafeData* tsd);
 
-// Text data functions
-char* tsd_read_text(ThreadSafeData* tsd);
-bool tsd_write_text(ThreadSafeData* tsd, const char* text);
+// User directory functions
+
+// Copies the password hash stored for username into hash. False when the
+// user is unknown or the hash does not fit.
+bool tsd_find_user(ThreadSafeData* tsd, const char* username, char* hash, size_t size);
+UserAddResult tsd_add_user(ThreadSafeData* tsd, const char* username, const char* password_hash);
+
+// Writes all users to the snapshot so the next start replays no journal.
+bool tsd_checkpoint_users(ThreadSafeData* tsd);
+
+// JSON import and export, as {"users":[{"username":..,"password_hash":..}]}.
+// Importing skips users that already exist, and reports and skips names
+// longer than AUTH_USERNAME_MAX, then checkpoints.
+bool tsd_import_users(ThreadSafeData* tsd, const char* path, size_t* imported);
+bool tsd_export_users(ThreadSafeData* tsd, const char* path);
+
+// Shared by every user before text data was partitioned
+#define TSD_LEGACY_DATA_FILENAME "data.txt"
+
+// Appends TSD_LEGACY_DATA_FILENAME, which no request reads any more, to
+// owner's text data and renames it with an ".imported" suffix, so the
+// split is done once. owner must be a known user.
+bool tsd_import_legacy_text(ThreadSafeData* tsd, const char* owner, size_t* bytes);
+
+// Text data functions. Each owner, the authenticated username, has a
+// partition of its own; nothing here touches another owner's data.
+// Partitions are loaded on first use, and idle ones that have not been
+// used lately are dropped once there are more than TSD_MAX_PARTITIONS or their
+// caches exceed TSD_MAX_CACHED_BYTES.
+char* tsd_read_text(ThreadSafeData* tsd, const char* owner);
+bool tsd_write_text(ThreadSafeData* tsd, const char* owner, const char* text);
+
+// Appends count records, one per line, with a single open and write of the
+// owner's file, so readers see either none of the batch or all of it.
+bool tsd_write_text_batch(ThreadSafeData* tsd, const char* owner,
+                          const char* const* records, size_t count);
+
+// As tsd_read_text, also reporting the generation the text belongs to.
+char* tsd_read_text_version(ThreadSafeData* tsd, const char* owner, unsigned long* generation);
+
+// Current generation of the owner's text data; never touches the file.
+unsigned long tsd_text_generation(ThreadSafeData* tsd, const char* owner);
+
+// Copies the owner's text data, compressed with encoding, into a new
+// buffer. The compressed form is made once per generation and shared by
+// every reader. Returns false when it is unavailable or no smaller than
+// the plain text. With data NULL, only reports whether it is available.
+bool tsd_read_text_encoded(ThreadSafeData* tsd, const char* owner, ContentEncoding encoding,
+                           char** data, size_t* length, unsigned long* generation);
 
 #endif 
\ No newline at end of file
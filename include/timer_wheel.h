@@ -0,0 +1,55 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel: four levels of 64 slots, so with a 10ms tick
+// it covers deadlines up to about 46 hours (later ones are clamped).
+// Scheduling and cancelling are O(1); entries on the upper levels are
+// redistributed downwards as time reaches their slot. A wheel belongs to a
+// single thread and does no locking.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+// Embedded in the object that owns the deadline.
+typedef struct TimerEntry {
+    struct TimerEntry* next;
+    struct TimerEntry* prev;
+    uint64_t expires;   // Absolute wheel tick
+    void* data;
+} TimerEntry;
+
+typedef void (*TimerCallback)(TimerEntry* entry, void* arg);
+
+typedef struct {
+    TimerEntry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];   // List heads
+    uint64_t now;         // Current tick
+    uint64_t origin_ms;   // Time of tick 0
+    unsigned tick_ms;
+    size_t count;
+} TimerWheel;
+
+// Milliseconds on CLOCK_MONOTONIC, the clock every deadline is expressed in.
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(TimerWheel* wheel, unsigned tick_ms, uint64_t now_ms);
+
+void timer_entry_init(TimerEntry* entry, void* data);
+bool timer_entry_pending(const TimerEntry* entry);
+
+// Arms (or re-arms) entry to fire at deadline_ms. Deadlines are rounded up
+// to the next tick, so a timer never fires early.
+void timer_wheel_schedule(TimerWheel* wheel, TimerEntry* entry, uint64_t deadline_ms);
+void timer_wheel_cancel(TimerWheel* wheel, TimerEntry* entry);
+
+// Moves the wheel to now_ms and calls callback for each expired entry, which
+// is already unlinked and may be rescheduled. Returns the number fired.
+size_t timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms, TimerCallback callback, void* arg);
+
+// Milliseconds until the wheel next needs advancing, or -1 when it is empty.
+long timer_wheel_next_timeout(const TimerWheel* wheel, uint64_t now_ms);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Spans each thread keeps; older ones are overwritten
+#define TRACE_BUFFER_SPANS 8192
+
+// Sampled per-request tracing. A sampled request gets an id, and each
+// stage it passes through (accept, parse, queue, handle, send) records a
+// span under that id: CLOCK_MONOTONIC start and end, the recording thread
+// and, for stages that run on one thread, its CPU time. Spans go into a
+// ring owned by the recording thread, so tracing takes no lock; a thread
+// that exits leaves its ring to the next thread that needs one.
+
+// Traces one request in every sample_every; 0 turns tracing off.
+void trace_configure(unsigned sample_every);
+
+// The id for the next request, or 0 when it is not sampled. Costs one
+// load while tracing is off.
+uint64_t trace_sample(void);
+
+uint64_t trace_now_ns(void);
+// CPU time the calling thread has used
+uint64_t trace_thread_cpu_ns(void);
+
+// Records a stage of request between two trace_now_ns times. cpu_ns is the
+// thread CPU time spent in it, or 0 when the stage does not run on one thread.
+void trace_span(uint64_t request, const char* name, uint64_t start_ns, uint64_t end_ns,
+                uint64_t cpu_ns);
+
+// Every span still held, in Chrome trace event format: each request is an
+// async track of nested spans. The caller frees the result.
+char* trace_json(void);
+
+#endif // TRACE_H
@@ -0,0 +1,37 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include "connection_handler.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Event-driven alternative to the blocking worker threads, built on io_uring
+// (Linux 6.0+, liburing 2.4+, enabled with `make IO_URING=1`). Each I/O
+// thread owns a ring holding a multishot accept on the shared listening
+// socket and a multishot receive per connection that draws from a provided
+// buffer ring. Requests go through the same Connection state and message
+// queue as the blocking path, and every send produced while handling one
+// batch of completions is submitted with a single io_uring_enter.
+
+typedef struct UringWorker UringWorker;
+
+typedef struct {
+    UringWorker* workers;
+    unsigned count;
+    atomic_bool stopping;
+} UringEngine;
+
+// False when the server was built without io_uring support.
+bool uring_engine_available(void);
+
+bool uring_engine_start(UringEngine* engine, ConnectionHandler* handler,
+                        int listen_fd, unsigned threads);
+// Stops and joins the I/O threads once the message queue has been shut down.
+void uring_engine_stop(UringEngine* engine);
+// After connection_handler_drain: waits for the I/O threads to finish their
+// open connections and exit. Use instead of uring_engine_stop.
+void uring_engine_drain(UringEngine* engine);
+// Releases the rings' wakeup descriptors; call after the processors have exited.
+void uring_engine_destroy(UringEngine* engine);
+
+#endif // URING_ENGINE_H
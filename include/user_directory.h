@@ -0,0 +1,67 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include "snapshot.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A checkpoint is written once this many users, or a quarter of the
+// snapshot if more, have been added since the last one
+#define USER_DIRECTORY_CHECKPOINT_MIN 4096
+
+typedef struct UserRecord {
+    struct UserRecord* next;
+    char* username;
+    char* password_hash;
+} UserRecord;
+
+// Usernames and password hashes, kept as a mapped snapshot plus a journal
+// of users added since. Adding a user appends one record to the journal;
+// a checkpoint merges the two into a new snapshot and empties the journal.
+// Not thread safe; the owner serialises access.
+typedef struct {
+    char* snapshot_path;
+    char* journal_path;
+    Snapshot snapshot;
+    int journal_fd;
+    off_t journal_offset;       // Journal bytes already applied
+    UserRecord** buckets;       // Users added since the snapshot
+    size_t bucket_count;
+    size_t added;
+} UserDirectory;
+
+typedef enum {
+    USER_ADDED,
+    USER_EXISTS,
+    USER_ADD_FAILED
+} UserAddResult;
+
+// Maps the snapshot and replays the journal. Fails only when the snapshot
+// exists but is damaged or the journal cannot be opened.
+bool user_directory_open(UserDirectory* directory, const char* snapshot_path,
+                         const char* journal_path);
+void user_directory_close(UserDirectory* directory);
+
+// True when neither a snapshot nor any journaled user was found.
+bool user_directory_empty(const UserDirectory* directory);
+size_t user_directory_count(const UserDirectory* directory);
+
+// Password hash stored for username, or NULL. Valid until the next add.
+const char* user_directory_find(const UserDirectory* directory, const char* username);
+
+// Journals a new user, checkpointing when enough have accumulated.
+UserAddResult user_directory_add(UserDirectory* directory, const char* username,
+                                 const char* password_hash);
+
+// Writes every user to a new snapshot and empties the journal. Records
+// appended to the journal by another process are applied first.
+bool user_directory_checkpoint(UserDirectory* directory);
+
+// Calls visit for every user, snapshot first; stops early if it returns false.
+void user_directory_for_each(const UserDirectory* directory,
+                             bool (*visit)(const char* username, const char* password_hash,
+                                           void* ctx),
+                             void* ctx);
+
+#endif // USER_DIRECTORY_H
@@ -2,6 +2,9 @@
 #include "thread_safe_data.h"
 #include "debug_macros.h"
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
@@ -10,7 +13,8 @@
 #define SALT_LENGTH 16
 #define HASH_LENGTH (SHA256_DIGEST_LENGTH * 2)
 #define STORED_HASH_LENGTH (SALT_LENGTH * 2 + HASH_LENGTH + 1)
-#define TOKEN_LENGTH 32
+#define TOKEN_NONCE_LENGTH 8
+#define TOKEN_MAC_LENGTH 16
 
 // Initialize random number generator once
 __attribute__((constructor)) 
@@ -33,22 +37,77 @@ static void hash_password(const char* password, const char* salt, char* output_h
     output_hash[HASH_LENGTH] = '\0';
 }
 
-static char* generate_token() {
-    const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-    char* token = malloc(TOKEN_LENGTH + 1);
-    if (!token) return NULL;
+static void hex_encode(const unsigned char* data, size_t length, char* out) {
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        *out++ = HEX[data[i] >> 4];
+        *out++ = HEX[data[i] & 0x0f];
+    }
+    *out = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Decodes exactly length hex digits; false on anything else
+static bool hex_decode(const char* hex, size_t length, unsigned char* out) {
+    if (length % 2 != 0) return false;
+    for (size_t i = 0; i < length; i += 2) {
+        int high = hex_value(hex[i]);
+        int low = hex_value(hex[i + 1]);
+        if (high < 0 || low < 0) return false;
+        *out++ = (unsigned char)(high << 4 | low);
+    }
+    return true;
+}
 
-    for (int i = 0; i < TOKEN_LENGTH; i++) {
-        token[i] = charset[rand() % (sizeof(charset) - 1)];
+// MAC over the username and the nonce, truncated to TOKEN_MAC_LENGTH
+static void sign_token(ThreadSafeData* tsd, const char* username, size_t username_length,
+                       const unsigned char* nonce, unsigned char* mac) {
+    unsigned char message[AUTH_USERNAME_MAX + TOKEN_NONCE_LENGTH];
+    memcpy(message, username, username_length);
+    memcpy(message + username_length, nonce, TOKEN_NONCE_LENGTH);
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    HMAC(EVP_sha256(), tsd->token_key, sizeof(tsd->token_key), message,
+         username_length + TOKEN_NONCE_LENGTH, digest, &digest_length);
+    memcpy(mac, digest, TOKEN_MAC_LENGTH);
+}
+
+// Token: hex(username) "." hex(nonce) "." hex(mac). The server keeps no
+// session state; the username is read back out of a token whose MAC checks.
+static char* generate_token(ThreadSafeData* tsd, const char* username) {
+    size_t username_length = strlen(username);
+    unsigned char nonce[TOKEN_NONCE_LENGTH];
+    for (int i = 0; i < TOKEN_NONCE_LENGTH; i++) {
+        nonce[i] = rand() % 256;
     }
-    token[TOKEN_LENGTH] = '\0';
+    unsigned char mac[TOKEN_MAC_LENGTH];
+    sign_token(tsd, username, username_length, nonce, mac);
+
+    char* token = malloc(username_length * 2 + TOKEN_NONCE_LENGTH * 2 + TOKEN_MAC_LENGTH * 2 + 3);
+    if (!token) return NULL;
+
+    char* out = token;
+    hex_encode((const unsigned char*)username, username_length, out);
+    out += username_length * 2;
+    *out++ = '.';
+    hex_encode(nonce, TOKEN_NONCE_LENGTH, out);
+    out += TOKEN_NONCE_LENGTH * 2;
+    *out++ = '.';
+    hex_encode(mac, TOKEN_MAC_LENGTH, out);
     return token;
 }
 
 bool auth_signup(ThreadSafeData* tsd, const char* username, const char* password) {
     DEBUG_PRINT("Attempting signup for: %s\n", username);
     
-    if (!username || !password || strlen(username) == 0 || strlen(password) == 0) {
+    if (!username || !password || strlen(username) == 0 || strlen(password) == 0 ||
+        strlen(username) > AUTH_USERNAME_MAX) {
         DEBUG_PRINT("Invalid username or password\n");
         return false;
     }
@@ -74,144 +133,63 @@ bool auth_signup(ThreadSafeData* tsd, const char* username, const char* password
     char stored_hash[STORED_HASH_LENGTH];
     snprintf(stored_hash, sizeof(stored_hash), "%s%s", salt_hex, hashed_password);
 
-    pthread_mutex_lock(&tsd->mutex);
-    DEBUG_PRINT("Mutex locked for signup\n");
-    
-    // Ensure data structure exists
-    if (!tsd->auth_data) {
-        DEBUG_PRINT("Creating new data structure\n");
-        tsd->auth_data = cJSON_CreateObject();
-        if (!tsd->auth_data) {
-            DEBUG_PRINT("Failed to create data object\n");
-            pthread_mutex_unlock(&tsd->mutex);
-            return false;
-        }
-    }
-
-    cJSON* users = cJSON_GetObjectItem(tsd->auth_data, "users");
-    if (!users) {
-        DEBUG_PRINT("Creating users array\n");
-        users = cJSON_AddArrayToObject(tsd->auth_data, "users");
-        if (!users) {
-            DEBUG_PRINT("Failed to create users array\n");
-            pthread_mutex_unlock(&tsd->mutex);
-            return false;
-        }
-    }
-    
-    // Check if username exists
-    cJSON* user;
-    cJSON_ArrayForEach(user, users) {
-        cJSON* existing = cJSON_GetObjectItem(user, "username");
-        if (existing && existing->valuestring && strcmp(existing->valuestring, username) == 0) {
-            DEBUG_PRINT("Username %s already exists\n", username);
-            pthread_mutex_unlock(&tsd->mutex);
-            return false;
-        }
-    }
-    
-    // Create new user
-    cJSON* new_user = cJSON_CreateObject();
-    if (!new_user) {
-        DEBUG_PRINT("Failed to create user object\n");
-        pthread_mutex_unlock(&tsd->mutex);
-        return false;
-    }
-
-    if (!cJSON_AddStringToObject(new_user, "username", username) ||
-        !cJSON_AddStringToObject(new_user, "password_hash", stored_hash)) {
-        DEBUG_PRINT("Failed to add user fields\n");
-        cJSON_Delete(new_user);
-        pthread_mutex_unlock(&tsd->mutex);
-        return false;
-    }
-    
-    if (!cJSON_AddItemToArray(users, new_user)) {
-        DEBUG_PRINT("Failed to add user to array\n");
-        cJSON_Delete(new_user);
-        pthread_mutex_unlock(&tsd->mutex);
-        return false;
+    UserAddResult result = tsd_add_user(tsd, username, stored_hash);
+    if (result == USER_EXISTS) {
+        DEBUG_PRINT("Username %s already exists\n", username);
     }
     
-    // Save changes
-    bool result = save_to_file_unlocked(tsd);
-    pthread_mutex_unlock(&tsd->mutex);
-    
-    DEBUG_PRINT("Signup result for user %s: %s\n", username, result ? "success" : "failure");
-    return result;
+    DEBUG_PRINT("Signup result for user %s: %s\n", username, result == USER_ADDED ? "success" : "failure");
+    return result == USER_ADDED;
 }
 
 char* auth_login(ThreadSafeData* tsd, const char* username, const char* password) {
     DEBUG_PRINT("Attempting login for: %s\n", username);
     
-    if (!username || !password || strlen(username) == 0 || strlen(password) == 0) {
+    // Longer names cannot be signed into a token, and signup never made one
+    if (!username || !password || strlen(username) == 0 || strlen(password) == 0 ||
+        strlen(username) > AUTH_USERNAME_MAX) {
         DEBUG_PRINT("Invalid username or password\n");
         return NULL;
     }
 
-    pthread_mutex_lock(&tsd->mutex);
-    char* token = NULL;
-    
-    if (!tsd->auth_data) {
-        DEBUG_PRINT("No data structure exists\n");
-        pthread_mutex_unlock(&tsd->mutex);
+    // Copied out so the hashing below runs without holding the lock
+    char stored_hash[STORED_HASH_LENGTH];
+    if (!tsd_find_user(tsd, username, stored_hash, sizeof(stored_hash))) {
+        DEBUG_PRINT("No user %s\n", username);
         return NULL;
     }
-
-    cJSON* users = cJSON_GetObjectItem(tsd->auth_data, "users");
-    if (!users) {
-        DEBUG_PRINT("No users array found\n");
-        pthread_mutex_unlock(&tsd->mutex);
+    if (strlen(stored_hash) != (SALT_LENGTH * 2 + HASH_LENGTH)) {
+        DEBUG_PRINT("Invalid stored hash format\n");
         return NULL;
     }
 
-    cJSON* user;
-    cJSON_ArrayForEach(user, users) {
-        cJSON* json_username = cJSON_GetObjectItem(user, "username");
-        cJSON* stored_hash_json = cJSON_GetObjectItem(user, "password_hash");
-        
-        if (json_username && stored_hash_json && 
-            strcmp(json_username->valuestring, username) == 0) {
-            
-            const char* stored_hash = stored_hash_json->valuestring;
-            if (!stored_hash || strlen(stored_hash) != (SALT_LENGTH * 2 + HASH_LENGTH)) {
-                DEBUG_PRINT("Invalid stored hash format\n");
-                continue;
-            }
-
-            // Extract salt from stored hash
-            char salt_hex[SALT_LENGTH * 2 + 1];
-            strncpy(salt_hex, stored_hash, SALT_LENGTH * 2);
-            salt_hex[SALT_LENGTH * 2] = '\0';
-
-            // Convert hex salt back to bytes
-            unsigned char salt[SALT_LENGTH];
-            for (int i = 0; i < SALT_LENGTH; i++) {
-                sscanf(salt_hex + (i * 2), "%02hhx", &salt[i]);
-            }
-
-            // Hash the provided password with the stored salt
-            char test_hash[HASH_LENGTH + 1];
-            hash_password(password, (char*)salt, test_hash);
-
-            // Compare with stored hash
-            if (strcmp(stored_hash + (SALT_LENGTH * 2), test_hash) == 0) {
-                token = generate_token();
-                DEBUG_PRINT("Login successful for user %s\n", username);
-                break;
-            } else {
-                DEBUG_PRINT("Password verification failed for user %s\n", username);
-            }
-        }
+    // Extract salt from stored hash
+    char salt_hex[SALT_LENGTH * 2 + 1];
+    strncpy(salt_hex, stored_hash, SALT_LENGTH * 2);
+    salt_hex[SALT_LENGTH * 2] = '\0';
+
+    // Convert hex salt back to bytes
+    unsigned char salt[SALT_LENGTH];
+    for (int i = 0; i < SALT_LENGTH; i++) {
+        sscanf(salt_hex + (i * 2), "%02hhx", &salt[i]);
+    }
+
+    // Hash the provided password with the stored salt
+    char test_hash[HASH_LENGTH + 1];
+    hash_password(password, (char*)salt, test_hash);
+
+    // Compare with stored hash
+    char* token = NULL;
+    if (strcmp(stored_hash + (SALT_LENGTH * 2), test_hash) == 0) {
+        token = generate_token(tsd, username);
+        DEBUG_PRINT("Login successful for user %s\n", username);
+    } else {
+        DEBUG_PRINT("Password verification failed for user %s\n", username);
     }
-    
-    pthread_mutex_unlock(&tsd->mutex);
     return token;
 }
 
-bool auth_verify_token(const char* token_header, ThreadSafeData* tsd) {
-    (void)tsd; // Mark as unused to suppress warning
-    
+bool auth_verify_token(const char* token_header, ThreadSafeData* tsd, char* username) {
     if (!token_header) {
         DEBUG_PRINT("No token provided\n");
         return false;
@@ -227,11 +205,39 @@ bool auth_verify_token(const char* token_header, ThreadSafeData* tsd) {
         token += prefix_len;
     }
     
-    if (strlen(token) != TOKEN_LENGTH) {
-        DEBUG_PRINT("Invalid token length: %zu (expected %d)\n", strlen(token), TOKEN_LENGTH);
+    const char* nonce_hex = strchr(token, '.');
+    const char* mac_hex = nonce_hex ? strchr(nonce_hex + 1, '.') : NULL;
+    if (!mac_hex) {
+        DEBUG_PRINT("Malformed token\n");
+        return false;
+    }
+    nonce_hex++;
+    mac_hex++;
+    
+    size_t username_hex_length = (size_t)(nonce_hex - 1 - token);
+    unsigned char nonce[TOKEN_NONCE_LENGTH];
+    unsigned char mac[TOKEN_MAC_LENGTH];
+    if (username_hex_length == 0 || username_hex_length > AUTH_USERNAME_MAX * 2 ||
+        !hex_decode(token, username_hex_length, (unsigned char*)username) ||
+        (size_t)(mac_hex - 1 - nonce_hex) != TOKEN_NONCE_LENGTH * 2 ||
+        !hex_decode(nonce_hex, TOKEN_NONCE_LENGTH * 2, nonce) ||
+        strlen(mac_hex) != TOKEN_MAC_LENGTH * 2 ||
+        !hex_decode(mac_hex, TOKEN_MAC_LENGTH * 2, mac)) {
+        DEBUG_PRINT("Malformed token\n");
+        return false;
+    }
+    size_t username_length = username_hex_length / 2;
+    username[username_length] = '\0';
+    
+    unsigned char expected[TOKEN_MAC_LENGTH];
+    sign_token(tsd, username, username_length, nonce, expected);
+    if (CRYPTO_memcmp(mac, expected, TOKEN_MAC_LENGTH) != 0 ||
+        memchr(username, '\0', username_length)) {
+        DEBUG_PRINT("Token signature mismatch\n");
+        username[0] = '\0';
         return false;
     }
     
-    DEBUG_PRINT("Token verified successfully\n");
+    DEBUG_PRINT("Token verified for user %s\n", username);
     return true;
-}
\ No newline at end of file
+}
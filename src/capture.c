@@ -0,0 +1,186 @@
+#include "capture.h"
+#include "cJSON.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+LOCK_STATS_DEFINE(capture_lock_stats, "capture");
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Returns the field after field in an entry's block
+static const char* next_field(const char* field) {
+    return field + strlen(field) + 1;
+}
+
+// Formats one captured request as a JSON line, or returns NULL.
+static char* format_entry(const CaptureEntry* entry) {
+    const char* method = entry->fields;
+    const char* path = next_field(method);
+    const char* field = next_field(path);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "ts_us", (double)entry->arrival_us);
+    cJSON_AddStringToObject(json, "method", method);
+    cJSON_AddStringToObject(json, "path", path);
+    cJSON* headers = cJSON_AddArrayToObject(json, "headers");
+    for (size_t i = 0; i < entry->header_count; i++) {
+        const char* value = next_field(field);
+        cJSON* pair = cJSON_CreateArray();
+        cJSON_AddItemToArray(pair, cJSON_CreateString(field));
+        cJSON_AddItemToArray(pair, cJSON_CreateString(value));
+        cJSON_AddItemToArray(headers, pair);
+        field = next_field(value);
+    }
+    cJSON_AddStringToObject(json, "body", field);
+
+    char* line = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return line;
+}
+
+static void write_entries(Capture* capture, CaptureEntry* entry) {
+    unsigned long written = 0;
+    while (entry) {
+        CaptureEntry* next = entry->next;
+        char* line = format_entry(entry);
+        if (line) {
+            fputs(line, capture->file);
+            fputc('\n', capture->file);
+            free(line);
+            written++;
+        }
+        free(entry);
+        entry = next;
+    }
+    // Flushed per batch so a capture is usable while the server still runs
+    fflush(capture->file);
+
+    profiled_mutex_lock(&capture->mutex);
+    capture->written += written;
+    profiled_mutex_unlock(&capture->mutex);
+}
+
+static void* writer_thread(void* arg) {
+    Capture* capture = (Capture*)arg;
+
+    profiled_mutex_lock(&capture->mutex);
+    for (;;) {
+        while (!capture->head && !capture->stopping) {
+            profiled_cond_wait(&capture->cond, &capture->mutex);
+        }
+        if (!capture->head) break;
+
+        // Take the whole list so the serving threads never wait on the file
+        CaptureEntry* entries = capture->head;
+        capture->head = NULL;
+        capture->tail = NULL;
+        capture->pending = 0;
+        profiled_mutex_unlock(&capture->mutex);
+
+        write_entries(capture, entries);
+
+        profiled_mutex_lock(&capture->mutex);
+    }
+    profiled_mutex_unlock(&capture->mutex);
+    return NULL;
+}
+
+bool capture_start(Capture* capture, const char* path, unsigned sample_every) {
+    capture->file = fopen(path, "a");
+    if (!capture->file) {
+        perror("Failed to open capture file");
+        return false;
+    }
+
+    capture->sample_every = sample_every ? sample_every : 1;
+    atomic_init(&capture->seen, 0);
+    profiled_mutex_init(&capture->mutex, &capture_lock_stats);
+    pthread_cond_init(&capture->cond, NULL);
+    capture->head = NULL;
+    capture->tail = NULL;
+    capture->pending = 0;
+    capture->written = 0;
+    capture->dropped = 0;
+    capture->stopping = false;
+
+    if (pthread_create(&capture->writer, NULL, writer_thread, capture) != 0) {
+        perror("Failed to create capture writer thread");
+        profiled_mutex_destroy(&capture->mutex);
+        pthread_cond_destroy(&capture->cond);
+        fclose(capture->file);
+        capture->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+static char* append_field(char* out, const char* field) {
+    size_t length = strlen(field) + 1;
+    memcpy(out, field, length);
+    return out + length;
+}
+
+void capture_record(Capture* capture, const HttpRequest* request) {
+    if (atomic_fetch_add_explicit(&capture->seen, 1, memory_order_relaxed) %
+            capture->sample_every != 0) {
+        return;
+    }
+
+    const char* body = request->body ? request->body : "";
+    size_t length = strlen(request->method) + strlen(request->path) + strlen(body) + 3;
+    for (size_t i = 0; i < request->header_count; i++) {
+        length += strlen(request->header_keys[i]) + strlen(request->header_values[i]) + 2;
+    }
+
+    CaptureEntry* entry = (CaptureEntry*)malloc(sizeof(CaptureEntry) + length);
+    if (entry) {
+        entry->next = NULL;
+        entry->arrival_us = now_us();
+        entry->header_count = request->header_count;
+        char* out = append_field(entry->fields, request->method);
+        out = append_field(out, request->path);
+        for (size_t i = 0; i < request->header_count; i++) {
+            out = append_field(out, request->header_keys[i]);
+            out = append_field(out, request->header_values[i]);
+        }
+        append_field(out, body);
+    }
+
+    profiled_mutex_lock(&capture->mutex);
+    if (!entry || capture->stopping || capture->pending >= CAPTURE_MAX_PENDING) {
+        capture->dropped++;
+        profiled_mutex_unlock(&capture->mutex);
+        free(entry);
+        return;
+    }
+    if (capture->tail) {
+        capture->tail->next = entry;
+    } else {
+        capture->head = entry;
+    }
+    capture->tail = entry;
+    capture->pending++;
+    pthread_cond_signal(&capture->cond);
+    profiled_mutex_unlock(&capture->mutex);
+}
+
+void capture_stop(Capture* capture) {
+    if (!capture->file) return;
+
+    profiled_mutex_lock(&capture->mutex);
+    capture->stopping = true;
+    pthread_cond_signal(&capture->cond);
+    profiled_mutex_unlock(&capture->mutex);
+    pthread_join(capture->writer, NULL);
+
+    printf("Capture: %lu requests written, %lu dropped\n", capture->written, capture->dropped);
+    fclose(capture->file);
+    capture->file = NULL;
+    profiled_mutex_destroy(&capture->mutex);
+    pthread_cond_destroy(&capture->cond);
+}
@@ -1,15 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <stdbool.h>
 #include "cJSON.h"
 #include "debug_macros.h"
+#include "http_client.h"
+#include "client_pool.h"
+#include <getopt.h>
 
-#define SERVER_HOST "127.0.0.1:8080"
+// Every command goes over the same kept-alive connection
+static ClientPool pool;
 
 void print_help() {
     printf("\nAvailable commands:\n");
@@ -21,54 +21,32 @@ void print_help() {
     printf("6. Exit - Quit the program\n\n");
 }
 
-int connect_to_server() {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("Error creating socket: %s\n", strerror(errno));
-        return -1;
-    }
-    
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8080);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        printf("Error connecting to server: %s\n", strerror(errno));
-        close(sockfd);
-        return -1;
+static bool send_and_print(const char* request, HttpClientResponse* response) {
+    printf("Sending request:\n%s---\n\n", request);
+
+    if (!client_pool_request(&pool, request, strlen(request), response)) {
+        printf("Request to %s failed\n", pool.host);
+        return false;
     }
-    
-    return sockfd;
+
+    printf("Server response (%d):\n%s\n", response->status, response->body);
+    return true;
 }
 
-void handle_get_users(int server_fd, const char* token) {
+void handle_get_users(const char* token) {
     char request[1024];
-    snprintf(request, sizeof(request),
-        "GET /users HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Content-Type: text/plain\r\n"
-        "Authorization: Bearer %s\r\n"
-        "Connection: close\r\n\r\n",
-        SERVER_HOST, token);
-    
-    printf("Sending request:\n%s---\n\n", request);
-    
-    if (send(server_fd, request, strlen(request), 0) == -1) {
-        printf("Error sending request: %s\n", strerror(errno));
+    if (http_client_build_get_users(request, sizeof(request), pool.host, token, true) < 0) {
+        printf("Request too large\n");
         return;
     }
-    
-    char response[4096];
-    int bytes_received = recv(server_fd, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        printf("Server response:\n%s\n", response);
+
+    HttpClientResponse response;
+    if (send_and_print(request, &response)) {
+        http_client_response_free(&response);
     }
 }
 
-void handle_post_users(int server_fd, const char* token) {
+void handle_post_users(const char* token) {
     char text_data[1024];
     printf("Enter text to save: ");
     if (fgets(text_data, sizeof(text_data), stdin) == NULL) {
@@ -80,131 +58,102 @@ void handle_post_users(int server_fd, const char* token) {
     text_data[strcspn(text_data, "\n")] = 0;
     
     char request[2048];
-    snprintf(request, sizeof(request),
-        "POST /users HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Content-Type: text/plain\r\n"
-        "Authorization: Bearer %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n\r\n"
-        "%s",
-        SERVER_HOST, token, strlen(text_data), text_data);
-    
-    printf("Sending request:\n%s---\n\n", request);
-    
-    if (send(server_fd, request, strlen(request), 0) == -1) {
-        printf("Error sending request: %s\n", strerror(errno));
+    if (http_client_build_post_users(request, sizeof(request), pool.host, token, text_data, true) < 0) {
+        printf("Request too large\n");
         return;
     }
-    
-    char response[4096];
-    int bytes_received = recv(server_fd, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        printf("Server response:\n%s\n", response);
+
+    HttpClientResponse response;
+    if (send_and_print(request, &response)) {
+        http_client_response_free(&response);
     }
 }
 
-void handle_signup(int server_fd) {
-    char username[128], password[128];
+static bool read_credentials(char* username, size_t username_size, char* password, size_t password_size) {
     printf("Enter username: ");
-    if (fgets(username, sizeof(username), stdin) == NULL) return;
+    if (fgets(username, username_size, stdin) == NULL) return false;
     username[strcspn(username, "\n")] = 0;
     
     printf("Enter password: ");
-    if (fgets(password, sizeof(password), stdin) == NULL) return;
+    if (fgets(password, password_size, stdin) == NULL) return false;
     password[strcspn(password, "\n")] = 0;
-    
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "username", username);
-    cJSON_AddStringToObject(json, "password", password);
-    char* json_str = cJSON_Print(json);
-    cJSON_Delete(json);
+    return true;
+}
+
+void handle_signup(void) {
+    char username[128], password[128];
+    if (!read_credentials(username, sizeof(username), password, sizeof(password))) return;
     
     char request[2048];
-    snprintf(request, sizeof(request),
-        "POST /signup HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Content-Type: application/json\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n\r\n"
-        "%s",
-        SERVER_HOST, strlen(json_str), json_str);
-    
-    free(json_str);
-    
-    printf("Sending request:\n%s---\n\n", request);
-    
-    if (send(server_fd, request, strlen(request), 0) == -1) {
-        printf("Error sending request: %s\n", strerror(errno));
+    if (http_client_build_signup(request, sizeof(request), pool.host, username, password, true) < 0) {
+        printf("Request too large\n");
         return;
     }
-    
-    char response[4096];
-    int bytes_received = recv(server_fd, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        printf("Server response:\n%s\n", response);
+
+    HttpClientResponse response;
+    if (send_and_print(request, &response)) {
+        http_client_response_free(&response);
     }
 }
 
-char* handle_login(int server_fd) {
+char* handle_login(void) {
     char username[128], password[128];
-    printf("Enter username: ");
-    if (fgets(username, sizeof(username), stdin) == NULL) return NULL;
-    username[strcspn(username, "\n")] = 0;
-    
-    printf("Enter password: ");
-    if (fgets(password, sizeof(password), stdin) == NULL) return NULL;
-    password[strcspn(password, "\n")] = 0;
-    
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "username", username);
-    cJSON_AddStringToObject(json, "password", password);
-    char* json_str = cJSON_Print(json);
-    cJSON_Delete(json);
+    if (!read_credentials(username, sizeof(username), password, sizeof(password))) return NULL;
     
     char request[2048];
-    snprintf(request, sizeof(request),
-        "POST /login HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Content-Type: application/json\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n\r\n"
-        "%s",
-        SERVER_HOST, strlen(json_str), json_str);
-    
-    free(json_str);
-    
-    printf("Sending request:\n%s---\n\n", request);
-    
-    if (send(server_fd, request, strlen(request), 0) == -1) {
-        printf("Error sending request: %s\n", strerror(errno));
+    if (http_client_build_login(request, sizeof(request), pool.host, username, password, true) < 0) {
+        printf("Request too large\n");
         return NULL;
     }
-    
-    char response[4096];
-    int bytes_received = recv(server_fd, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        printf("Server response:\n%s\n", response);
-        
-        // Parse response to get token
-        cJSON* json = cJSON_Parse(strstr(response, "\r\n\r\n") + 4);
-        if (json) {
-            cJSON* token_obj = cJSON_GetObjectItem(json, "token");
-            if (token_obj && token_obj->valuestring) {
-                char* token = strdup(token_obj->valuestring);
-                cJSON_Delete(json);
-                return token;
-            }
-            cJSON_Delete(json);
+
+    HttpClientResponse response;
+    if (!send_and_print(request, &response)) {
+        return NULL;
+    }
+
+    // Parse response to get token
+    char* token = NULL;
+    cJSON* json = cJSON_Parse(response.body);
+    if (json) {
+        cJSON* token_obj = cJSON_GetObjectItem(json, "token");
+        if (token_obj && token_obj->valuestring) {
+            token = strdup(token_obj->valuestring);
         }
+        cJSON_Delete(json);
     }
-    return NULL;
+    http_client_response_free(&response);
+    return token;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a IP        server address (default %s)\n"
+            "  -p PORT      server port (default %d)\n",
+            program, HTTP_CLIENT_DEFAULT_IP, HTTP_CLIENT_DEFAULT_PORT);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    ClientPoolConfig config = {NULL, 0, 1, 10000};
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                config.ip = optarg;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!client_pool_init(&pool, &config)) {
+        printf("Failed to start the client\n");
+        return 1;
+    }
+
     char* token = NULL;
     print_help();
     
@@ -212,6 +161,7 @@ int main() {
         printf("\nEnter command (1-6): ");
         int choice;
         if (scanf("%d", &choice) != 1) {
+            if (feof(stdin)) break;
             while (getchar() != '\n'); // Clear input buffer
             printf("Invalid input. Please enter a number between 1 and 6.\n");
             continue;
@@ -220,7 +170,6 @@ int main() {
         
         if (choice == 6) {
             printf("Exiting...\n");
-            free(token);
             break;
         }
         
@@ -229,34 +178,26 @@ int main() {
             continue;
         }
         
-        int server_fd = connect_to_server();
-        if (server_fd == -1) {
-            printf("Failed to connect to server\n");
-            continue;
-        }
-        
         switch (choice) {
             case 1:
                 if (!token) {
                     printf("Please login first\n");
-                    close(server_fd);
                     continue;
                 }
-                handle_get_users(server_fd, token);
+                handle_get_users(token);
                 break;
             case 2:
                 if (!token) {
                     printf("Please login first\n");
-                    close(server_fd);
                     continue;
                 }
-                handle_post_users(server_fd, token);
+                handle_post_users(token);
                 break;
             case 3:
-                handle_signup(server_fd);
+                handle_signup();
                 break;
             case 4: {
-                char* new_token = handle_login(server_fd);
+                char* new_token = handle_login();
                 if (new_token) {
                     free(token);
                     token = new_token;
@@ -267,9 +208,9 @@ int main() {
                 printf("Invalid choice\n");
                 break;
         }
-        
-        close(server_fd);
     }
     
+    free(token);
+    client_pool_destroy(&pool);
     return 0;
-}
\ No newline at end of file
+}
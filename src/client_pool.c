@@ -0,0 +1,244 @@
+#include "client_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define DEFAULT_CONNECTIONS 4
+#define INITIAL_BUFFER_SIZE 4096
+
+// Waits for the callback of a client_pool_request
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    bool ok;
+    HttpClientResponse* response;
+} RequestWaiter;
+
+static void close_connection(ClientPoolWorker* worker) {
+    if (worker->fd >= 0) close(worker->fd);
+    worker->fd = -1;
+    worker->length = 0;
+}
+
+static bool open_connection(ClientPoolWorker* worker) {
+    ClientPool* pool = worker->pool;
+    worker->fd = http_client_connect(pool->ip, pool->port);
+    if (worker->fd < 0) return false;
+
+    if (pool->timeout_ms) {
+        struct timeval timeout = {pool->timeout_ms / 1000, (pool->timeout_ms % 1000) * 1000};
+        setsockopt(worker->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(worker->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    worker->length = 0;
+    atomic_fetch_add(&pool->connects, 1);
+    return true;
+}
+
+// Reads until buffer holds a whole response, which is then removed from it.
+// *received tells whether the server sent anything at all.
+static bool read_response(ClientPoolWorker* worker, HttpClientResponse* response, bool* received) {
+    *received = worker->length > 0;
+    bool at_eof = false;
+
+    for (;;) {
+        long parsed = worker->length == 0 && !at_eof
+                      ? 0
+                      : http_client_parse_response(worker->buffer, worker->length, at_eof, response);
+        if (parsed > 0) {
+            worker->length -= (size_t)parsed;
+            memmove(worker->buffer, worker->buffer + parsed, worker->length);
+            return true;
+        }
+        if (parsed < 0 || at_eof) return false;
+
+        if (worker->capacity - worker->length < INITIAL_BUFFER_SIZE) {
+            char* grown = (char*)realloc(worker->buffer, worker->capacity * 2);
+            if (!grown) return false;
+            worker->buffer = grown;
+            worker->capacity *= 2;
+        }
+
+        ssize_t n = recv(worker->fd, worker->buffer + worker->length,
+                         worker->capacity - worker->length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) {
+            at_eof = true;
+        } else {
+            worker->length += (size_t)n;
+            *received = true;
+        }
+    }
+}
+
+static bool exchange(ClientPoolWorker* worker, const ClientPoolJob* job,
+                     HttpClientResponse* response) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = worker->fd >= 0;
+        if (!reused && !open_connection(worker)) return false;
+
+        bool received = false;
+        if (http_client_send_all(worker->fd, job->request, job->length) &&
+            read_response(worker, response, &received)) {
+            if (!response->keep_alive) close_connection(worker);
+            return true;
+        }
+        close_connection(worker);
+
+        // Only a kept-alive connection that the server closed while idle
+        // is worth another try; anything else would repeat a real failure
+        if (!reused || received) return false;
+    }
+    return false;
+}
+
+static void* worker_main(void* arg) {
+    ClientPoolWorker* worker = (ClientPoolWorker*)arg;
+    ClientPool* pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->size == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->size == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        ClientPoolJob job = pool->jobs[pool->front];
+        pool->front = (pool->front + 1) % CLIENT_POOL_QUEUE_SIZE;
+        pool->size--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        HttpClientResponse response;
+        memset(&response, 0, sizeof(response));
+        bool ok = exchange(worker, &job, &response);
+        free(job.request);
+        if (!ok) http_client_response_free(&response);
+        job.callback(ok, ok ? &response : NULL, job.ctx);
+    }
+
+    close_connection(worker);
+    return NULL;
+}
+
+bool client_pool_init(ClientPool* pool, const ClientPoolConfig* config) {
+    const char* ip = config->ip ? config->ip : HTTP_CLIENT_DEFAULT_IP;
+    pool->port = config->port ? config->port : HTTP_CLIENT_DEFAULT_PORT;
+    snprintf(pool->ip, sizeof(pool->ip), "%s", ip);
+    snprintf(pool->host, sizeof(pool->host), "%s:%d", ip, pool->port);
+    pool->timeout_ms = config->timeout_ms;
+
+    pool->front = 0;
+    pool->size = 0;
+    pool->stopping = false;
+    atomic_init(&pool->connects, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    unsigned count = config->connections ? config->connections : DEFAULT_CONNECTIONS;
+    if (count > CLIENT_POOL_MAX_CONNECTIONS) count = CLIENT_POOL_MAX_CONNECTIONS;
+
+    pool->worker_count = 0;
+    for (unsigned i = 0; i < count; i++) {
+        ClientPoolWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->fd = -1;
+        worker->length = 0;
+        worker->capacity = INITIAL_BUFFER_SIZE;
+        worker->buffer = (char*)malloc(worker->capacity);
+        if (!worker->buffer || pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start client pool connection %u\n", i);
+            free(worker->buffer);
+            break;
+        }
+        pool->worker_count++;
+    }
+
+    if (pool->worker_count == 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->cond);
+        return false;
+    }
+    return true;
+}
+
+void client_pool_destroy(ClientPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].buffer);
+    }
+    pool->worker_count = 0;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+bool client_pool_submit(ClientPool* pool, const char* request, size_t length,
+                        ClientPoolCallback callback, void* ctx) {
+    // Copied before taking the lock; freed again if there is no room
+    char* copy = (char*)malloc(length);
+    if (!copy) return false;
+    memcpy(copy, request, length);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->stopping || pool->size == CLIENT_POOL_QUEUE_SIZE) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(copy);
+        return false;
+    }
+    ClientPoolJob* job = &pool->jobs[(pool->front + pool->size) % CLIENT_POOL_QUEUE_SIZE];
+    job->request = copy;
+    job->length = length;
+    job->callback = callback;
+    job->ctx = ctx;
+    pool->size++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+static void wake_waiter(bool ok, HttpClientResponse* response, void* ctx) {
+    RequestWaiter* waiter = (RequestWaiter*)ctx;
+    pthread_mutex_lock(&waiter->mutex);
+    if (ok) *waiter->response = *response;
+    waiter->ok = ok;
+    waiter->done = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+}
+
+bool client_pool_request(ClientPool* pool, const char* request, size_t length,
+                         HttpClientResponse* response) {
+    RequestWaiter waiter;
+    pthread_mutex_init(&waiter.mutex, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.done = false;
+    waiter.ok = false;
+    waiter.response = response;
+    memset(response, 0, sizeof(*response));
+
+    bool ok = client_pool_submit(pool, request, length, wake_waiter, &waiter);
+    if (ok) {
+        pthread_mutex_lock(&waiter.mutex);
+        while (!waiter.done) {
+            pthread_cond_wait(&waiter.cond, &waiter.mutex);
+        }
+        ok = waiter.ok;
+        pthread_mutex_unlock(&waiter.mutex);
+    }
+
+    pthread_mutex_destroy(&waiter.mutex);
+    pthread_cond_destroy(&waiter.cond);
+    return ok;
+}
@@ -0,0 +1,107 @@
+#include "compression.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <zlib.h>
+
+// zlib window bits: +16 selects the gzip wrapper
+#define GZIP_WINDOW_BITS (15 + 16)
+#define DEFLATE_WINDOW_BITS 15
+#define MEMORY_LEVEL 8
+
+// Parses the q parameter of one Accept-Encoding item, default 1.
+static double parse_quality(const char* params, const char* end) {
+    while (params < end) {
+        while (params < end && (*params == ';' || isspace((unsigned char)*params))) params++;
+        if (end - params >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+            return strtod(params + 2, NULL);
+        }
+        while (params < end && *params != ';') params++;
+    }
+    return 1.0;
+}
+
+ContentEncoding compression_negotiate(const char* accept_encoding) {
+    if (!accept_encoding) return ENCODING_IDENTITY;
+
+    double gzip_q = -1, deflate_q = -1, any_q = -1;
+    const char* item = accept_encoding;
+
+    while (*item) {
+        while (*item == ',' || isspace((unsigned char)*item)) item++;
+        if (!*item) break;
+
+        const char* end = item + strcspn(item, ",");
+        size_t token_length = strcspn(item, ";, \t");
+        if (item + token_length > end) token_length = (size_t)(end - item);
+        double q = parse_quality(item + token_length, end);
+
+        if ((token_length == 4 && strncasecmp(item, "gzip", 4) == 0) ||
+            (token_length == 6 && strncasecmp(item, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (token_length == 7 && strncasecmp(item, "deflate", 7) == 0) {
+            deflate_q = q;
+        } else if (token_length == 1 && *item == '*') {
+            any_q = q;
+        }
+        item = end;
+    }
+
+    // An encoding not named explicitly takes the weight of "*"
+    if (gzip_q < 0) gzip_q = any_q;
+    if (deflate_q < 0) deflate_q = any_q;
+
+    if (gzip_q > 0 && gzip_q >= deflate_q) return ENCODING_GZIP;
+    if (deflate_q > 0) return ENCODING_DEFLATE;
+    return ENCODING_IDENTITY;
+}
+
+const char* compression_encoding_name(ContentEncoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP: return "gzip";
+        case ENCODING_DEFLATE: return "deflate";
+        default: return NULL;
+    }
+}
+
+bool compression_encode(ContentEncoding encoding, const char* data, size_t length,
+                        char** out, size_t* out_length) {
+    if (encoding != ENCODING_GZIP && encoding != ENCODING_DEFLATE) return false;
+    if (length > UINT_MAX) return false;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int window_bits = encoding == ENCODING_GZIP ? GZIP_WINDOW_BITS : DEFLATE_WINDOW_BITS;
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits,
+                     MEMORY_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    // deflateBound covers the wrapper, so one call always finishes
+    size_t capacity = deflateBound(&stream, (uLong)length);
+    char* buffer = (char*)malloc(capacity);
+    if (!buffer) {
+        deflateEnd(&stream);
+        return false;
+    }
+
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = (Bytef*)buffer;
+    stream.avail_out = (uInt)capacity;
+
+    int result = deflate(&stream, Z_FINISH);
+    size_t produced = stream.total_out;
+    deflateEnd(&stream);
+
+    if (result != Z_STREAM_END) {
+        free(buffer);
+        return false;
+    }
+
+    *out = buffer;
+    *out_length = produced;
+    return true;
+}
@@ -1,63 +1,779 @@
 #include "connection_handler.h"
 #include "http_parser.h"
+#include "message_processor.h"
+#include "response_batch.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "flight_recorder.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <errno.h>
+#include <ctype.h>
+
+#define INITIAL_BUFFER_SIZE 4096
+#define MAX_REQUEST_SIZE (1024 * 1024)
+// Everything a connection may hold while requests wait behind a write
+#define MAX_BUFFERED_SIZE (4 * MAX_REQUEST_SIZE)
+
+static const char BAD_REQUEST_RESPONSE[] =
+    "HTTP/1.1 400 Bad Request\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 11\r\n"
+    "Connection: close\r\n\r\n"
+    "Bad Request";
+
+static const char TOO_LARGE_RESPONSE[] =
+    "HTTP/1.1 413 Payload Too Large\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 17\r\n"
+    "Connection: close\r\n\r\n"
+    "Payload Too Large";
+
+static const char TIMEOUT_RESPONSE[] =
+    "HTTP/1.1 408 Request Timeout\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 15\r\n"
+    "Connection: close\r\n\r\n"
+    "Request Timeout";
+
+static const char UNAVAILABLE_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "Connection: close\r\n\r\n"
+    "Service Unavailable";
+
+static const char TOO_MANY_REQUESTS_RESPONSE[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 17\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n\r\n"
+    "Too Many Requests";
+
+LOCK_STATS_DEFINE(park_lock_stats, "connection_park");
+
+static bool send_iovecs(int client_fd, struct iovec* iov, int iovcnt, unsigned timeout_ms);
+static int wait_readable(int client_fd, uint64_t deadline_ms, int wake_fd);
+static bool serve_connection(ConnectionHandler* handler, Connection* conn);
+static void park_init(ConnectionPark* park);
+static void park_destroy(ConnectionPark* park);
 
 void connection_handler_init(ConnectionHandler* handler, MessageQueue* queue) {
     handler->queue = queue;
+    handler->dispatch_mode = DISPATCH_QUEUE;
+    handler->processor = NULL;
+    handler->timeouts.header_ms = 10000;
+    handler->timeouts.body_ms = 30000;
+    handler->timeouts.idle_ms = 10000;
+    handler->timeouts.write_ms = 10000;
+    handler->timeouts.deadline_ms = 10000;
+    handler->capture = NULL;
+    handler->rate_limiter = NULL;
+    atomic_init(&handler->draining, false);
+    handler->drain_started_ms = 0;
+    handler->drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (handler->drain_fd < 0) {
+        // Idle connections then notice a drain only at their idle deadline
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+    }
+    park_init(&handler->park);
 }
 
-bool connection_handler_handle(ConnectionHandler* handler, int client_fd) {
-    struct timeval timeout = {.tv_sec = 10, .tv_usec = 0};
-    if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        fprintf(stderr, "Failed to set socket timeout: %s\n", strerror(errno));
-        close(client_fd);
-        return false;
+void connection_handler_destroy(ConnectionHandler* handler) {
+    park_destroy(&handler->park);
+    if (handler->drain_fd >= 0) close(handler->drain_fd);
+    handler->drain_fd = -1;
+}
+
+void connection_handler_drain(ConnectionHandler* handler) {
+    if (atomic_load(&handler->draining)) return;
+    handler->drain_started_ms = timer_now_ms();
+    atomic_store(&handler->draining, true);
+    if (handler->drain_fd >= 0) {
+        // Never read back, so every later poll sees it too
+        uint64_t one = 1;
+        ssize_t written = write(handler->drain_fd, &one, sizeof(one));
+        (void)written;
     }
+}
 
-    char buffer[4096] = {0};
-    ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+bool connection_handler_draining(const ConnectionHandler* handler) {
+    return atomic_load(&handler->draining);
+}
 
-    if (bytes_read <= 0) {
-        if (bytes_read == 0) {
-            fprintf(stderr, "Client disconnected\n");
-        } else {
-            fprintf(stderr, "Receive error: %s\n", strerror(errno));
-        }
-        close(client_fd);
-        return false;
+bool connection_handler_admit(ConnectionHandler* handler, int client_fd, uint32_t addr,
+                              uint64_t now_ms, RateLimitEntry** entry) {
+    *entry = NULL;
+    if (!handler->rate_limiter) return true;
+    if (rate_limiter_connect(handler->rate_limiter, addr, now_ms, entry) == RATE_LIMIT_ALLOWED) {
+        return true;
     }
 
-    buffer[bytes_read] = '\0';
-    printf("Received request:\n%s\n---\n", buffer);
+    // Refused before reading anything: one non-blocking send and a close
+    ssize_t sent = send(client_fd, TOO_MANY_REQUESTS_RESPONSE,
+                        sizeof(TOO_MANY_REQUESTS_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)sent;
+    close(client_fd);
+    return false;
+}
 
-    HttpParseResult parse_result = http_parse_request(buffer);
-    if (!parse_result.success) {
-        const char* response = 
-            "HTTP/1.1 400 Bad Request\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: 11\r\n"
-            "Connection: close\r\n\r\n"
-            "Bad Request";
-        
-        send(client_fd, response, strlen(response), 0);
-        close(client_fd);
-        http_request_free(&parse_result.request);
+bool connection_handler_handle(ConnectionHandler* handler, int client_fd, uint32_t addr) {
+    RateLimitEntry* rate_entry;
+    if (!connection_handler_admit(handler, client_fd, addr, timer_now_ms(), &rate_entry)) {
         return false;
     }
 
-    if (!message_queue_push(handler->queue, client_fd, buffer)) {
-        fprintf(stderr, "Failed to push message to queue\n");
+    // On the heap, since it outlives this call when it is parked
+    Connection* conn = (Connection*)malloc(sizeof(Connection));
+    if (!conn || !connection_init(conn, client_fd)) {
+        free(conn);
+        rate_limiter_disconnect(rate_entry);
         close(client_fd);
-        http_request_free(&parse_result.request);
         return false;
     }
+    conn->rate_entry = rate_entry;
+    return serve_connection(handler, conn);
+}
+
+static void close_connection(Connection* conn) {
+    int client_fd = conn->fd;
+    connection_destroy(conn);
+    free(conn);
+    shutdown(client_fd, SHUT_RDWR);
+    close(client_fd);
+}
+
+// ---- Parked connections (threads engine) ----
+
+static void park_init(ConnectionPark* park) {
+    park->slots = NULL;
+    park->capacity = 0;
+    park->free_slots = NULL;
+    park->free_count = 0;
+    atomic_init(&park->count, 0);
+    atomic_init(&park->swept_ms, 0);
+    profiled_mutex_init(&park->mutex, &park_lock_stats);
+    park->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (park->epoll_fd < 0) {
+        // Idle connections then hold a worker each, as they always did
+        fprintf(stderr, "Failed to create epoll set: %s\n", strerror(errno));
+    }
+}
+
+static void park_destroy(ConnectionPark* park) {
+    for (size_t i = 0; i < park->capacity; i++) {
+        if (park->slots[i].conn) close_connection(park->slots[i].conn);
+    }
+    free(park->slots);
+    free(park->free_slots);
+    park->slots = NULL;
+    park->free_slots = NULL;
+    park->capacity = 0;
+    if (park->epoll_fd >= 0) close(park->epoll_fd);
+    park->epoll_fd = -1;
+    profiled_mutex_destroy(&park->mutex);
+}
+
+static bool park_grow(ConnectionPark* park) {
+    size_t capacity = park->capacity ? park->capacity * 2 : 64;
+    ParkedConnection* slots = (ParkedConnection*)realloc(park->slots, capacity * sizeof(*slots));
+    if (!slots) return false;
+    park->slots = slots;
+    size_t* free_slots = (size_t*)realloc(park->free_slots, capacity * sizeof(*free_slots));
+    if (!free_slots) return false;
+    park->free_slots = free_slots;
+
+    // Lowest index on top, so slots are reused from the front
+    for (size_t i = capacity; i > park->capacity; i--) {
+        slots[i - 1].conn = NULL;
+        slots[i - 1].generation = 0;
+        free_slots[park->free_count++] = i - 1;
+    }
+    park->capacity = capacity;
+    return true;
+}
+
+// Hands an idle connection to the park. False when it cannot be parked
+// and the caller has to keep serving it.
+static bool park_connection(ConnectionHandler* handler, Connection* conn) {
+    ConnectionPark* park = &handler->park;
+    if (park->epoll_fd < 0) return false;
+    // Deadlines run from here
+    connection_read_deadline(handler, conn, timer_now_ms());
+
+    profiled_mutex_lock(&park->mutex);
+    if (park->free_count == 0 && !park_grow(park)) {
+        profiled_mutex_unlock(&park->mutex);
+        return false;
+    }
+    size_t index = park->free_slots[--park->free_count];
+    ParkedConnection* slot = &park->slots[index];
+    slot->conn = conn;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.u64 = (uint64_t)index << 32 | slot->generation;
+    if (epoll_ctl(park->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+        slot->conn = NULL;
+        park->free_slots[park->free_count++] = index;
+        profiled_mutex_unlock(&park->mutex);
+        return false;
+    }
+    atomic_fetch_add(&park->count, 1);
+    profiled_mutex_unlock(&park->mutex);
+    return true;
+}
+
+// Takes a connection out of its slot. Caller holds the park mutex.
+static Connection* unpark(ConnectionPark* park, size_t index) {
+    ParkedConnection* slot = &park->slots[index];
+    Connection* conn = slot->conn;
+    epoll_ctl(park->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    slot->conn = NULL;
+    slot->generation++;
+    park->free_slots[park->free_count++] = index;
+    atomic_fetch_sub(&park->count, 1);
+    return conn;
+}
+
+int connection_handler_park_fd(const ConnectionHandler* handler) {
+    return handler->park.epoll_fd;
+}
+
+size_t connection_handler_parked(const ConnectionHandler* handler) {
+    return atomic_load(&handler->park.count);
+}
+
+void connection_handler_resume(ConnectionHandler* handler) {
+    ConnectionPark* park = &handler->park;
+    struct epoll_event event;
+    // One-shot registration: only one worker gets each event
+    if (park->epoll_fd < 0 || epoll_wait(park->epoll_fd, &event, 1, 0) != 1) return;
+
+    size_t index = (size_t)(event.data.u64 >> 32);
+    uint32_t generation = (uint32_t)event.data.u64;
+    profiled_mutex_lock(&park->mutex);
+    Connection* conn = NULL;
+    if (index < park->capacity && park->slots[index].conn &&
+        park->slots[index].generation == generation) {
+        conn = unpark(park, index);
+    }
+    profiled_mutex_unlock(&park->mutex);
+
+    if (conn) serve_connection(handler, conn);
+}
+
+void connection_handler_expire(ConnectionHandler* handler, uint64_t now_ms) {
+    ConnectionPark* park = &handler->park;
+    unsigned long long swept = atomic_load(&park->swept_ms);
+    if (atomic_load(&park->count) == 0 || now_ms < swept + CONNECTION_PARK_SWEEP_MS ||
+        !atomic_compare_exchange_strong(&park->swept_ms, &swept, now_ms)) {
+        return;
+    }
+
+    profiled_mutex_lock(&park->mutex);
+    for (size_t i = 0; i < park->capacity; i++) {
+        Connection* conn = park->slots[i].conn;
+        if (conn && now_ms >= connection_read_deadline(handler, conn, now_ms)) {
+            close_connection(unpark(park, i));
+        }
+    }
+    profiled_mutex_unlock(&park->mutex);
+}
+
+// Runs a connection until it closes or waits for its next request with
+// nothing buffered, when it is parked. Returns false if it ended in error.
+static bool serve_connection(ConnectionHandler* handler, Connection* conn) {
+    int client_fd = conn->fd;
+    unsigned write_ms = handler->timeouts.write_ms;
+    bool ok = true;
+
+    for (;;) {
+        connection_handler_dispatch(handler, conn);
+
+        // Answer everything queued so far; each send may release requests
+        // that were waiting behind a write
+        while (connection_has_outstanding(conn)) {
+            response_batch_wait(&conn->batch, conn->next_response);
+
+            struct iovec iov[CONNECTION_MAX_IOVECS];
+            int iovcnt = connection_ready_responses(conn, iov, CONNECTION_MAX_IOVECS);
+            if (iovcnt > 0 && !send_iovecs(client_fd, iov, iovcnt, write_ms)) {
+                fprintf(stderr, "Send failed: %s\n", strerror(errno));
+                conn->failed = true;
+            }
+            connection_responses_sent(conn, iovcnt);
+            connection_handler_dispatch(handler, conn);
+        }
+
+        if (!conn->keep_alive || conn->failed) break;
+
+        size_t available;
+        char* space = connection_reserve(conn, &available);
+        if (!space) break;
+
+        ssize_t bytes_read = -1;
+        if (conn->length == 0) {
+            // Between requests: take what has arrived, and otherwise give
+            // the worker back instead of waiting on the client
+            bytes_read = recv(client_fd, space, available, MSG_DONTWAIT);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                park_connection(handler, conn)) {
+                return true;
+            }
+        }
+
+        if (bytes_read < 0) {
+            // A drain shortens the idle deadline, so an idle wait also watches for it
+            uint64_t deadline = connection_read_deadline(handler, conn, timer_now_ms());
+            bool wake_on_drain = conn->phase == CONNECTION_IDLE && !connection_handler_draining(handler);
+            int readable = wait_readable(client_fd, deadline, wake_on_drain ? handler->drain_fd : -1);
+            if (readable == 2) continue;
+            if (readable <= 0) {
+                if (readable == 0) {
+                    connection_expire(conn);
+                } else {
+                    fprintf(stderr, "Poll error: %s\n", strerror(errno));
+                    ok = false;
+                }
+                break;
+            }
+            bytes_read = recv(client_fd, space, available, 0);
+        }
+
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                fprintf(stderr, "Client disconnected\n");
+            } else {
+                fprintf(stderr, "Receive error: %s\n", strerror(errno));
+                ok = false;
+            }
+            break;
+        }
+        connection_received(conn, (size_t)bytes_read);
+    }
+
+    if (conn->final_response) {
+        ok = false;
+        if (!conn->failed) {
+            struct iovec iov = {(void*)conn->final_response, strlen(conn->final_response)};
+            send_iovecs(client_fd, &iov, 1, write_ms);
+        }
+    }
+    if (conn->failed) ok = false;
+
+    close_connection(conn);
+    return ok;
+}
+
+bool connection_init(Connection* conn, int fd) {
+    conn->fd = fd;
+    conn->capacity = INITIAL_BUFFER_SIZE;
+    conn->length = 0;
+    conn->buffer = (char*)malloc(conn->capacity + 1);
+    if (!conn->buffer) return false;
+
+    response_batch_init(&conn->batch);
+    conn->next_response = 0;
+    conn->after_write = false;
+    conn->keep_alive = true;
+    conn->failed = false;
+    conn->closing = false;
+    conn->final_response = NULL;
+    conn->served = false;
+    conn->phase = CONNECTION_READING_HEADERS;
+    conn->phase_started_ms = timer_now_ms();
+    conn->rate_entry = NULL;
+    conn->accepted_ns = trace_now_ns();
+    conn->send_started_ns = 0;
+    return true;
+}
+
+void connection_destroy(Connection* conn) {
+    // Processors still hold pointers into the batch until every slot is done
+    for (size_t slot = conn->next_response; slot < conn->batch.count; slot++) {
+        response_batch_wait(&conn->batch, slot);
+    }
+    response_batch_destroy(&conn->batch);
+    free(conn->buffer);
+    conn->buffer = NULL;
+    rate_limiter_disconnect(conn->rate_entry);
+    conn->rate_entry = NULL;
+}
+
+char* connection_reserve(Connection* conn, size_t* available) {
+    if (conn->length == conn->capacity) {
+        if (conn->capacity >= MAX_BUFFERED_SIZE) {
+            conn->final_response = TOO_LARGE_RESPONSE;
+            conn->keep_alive = false;
+            return NULL;
+        }
+        size_t new_capacity = conn->capacity * 2;
+        char* grown = (char*)realloc(conn->buffer, new_capacity + 1);
+        if (!grown) {
+            conn->keep_alive = false;
+            return NULL;
+        }
+        conn->buffer = grown;
+        conn->capacity = new_capacity;
+    }
+
+    *available = conn->capacity - conn->length;
+    return conn->buffer + conn->length;
+}
+
+void connection_received(Connection* conn, size_t bytes) {
+    conn->buffer[conn->length + bytes] = '\0';
+    printf("Received request:\n%s\n---\n", conn->buffer + conn->length);
+    conn->length += bytes;
+}
+
+bool connection_has_outstanding(const Connection* conn) {
+    return conn->next_response < conn->batch.count;
+}
+
+uint64_t connection_read_deadline(const ConnectionHandler* handler, Connection* conn,
+                                  uint64_t now_ms) {
+    ConnectionPhase phase;
+    if (connection_has_outstanding(conn)) {
+        phase = CONNECTION_PROCESSING;
+    } else if (conn->length == 0) {
+        // A fresh connection owes us a request as promptly as a partial one
+        phase = conn->served ? CONNECTION_IDLE : CONNECTION_READING_HEADERS;
+    } else if (http_header_length(conn->buffer, conn->length) == 0) {
+        phase = CONNECTION_READING_HEADERS;
+    } else {
+        phase = CONNECTION_READING_BODY;
+    }
+
+    // Deadlines run from entering a phase, so trickling bytes cannot extend them
+    if (phase != conn->phase) {
+        conn->phase = phase;
+        conn->phase_started_ms = now_ms;
+    }
+
+    switch (phase) {
+        case CONNECTION_READING_HEADERS:
+            return conn->phase_started_ms + handler->timeouts.header_ms;
+        case CONNECTION_READING_BODY:
+            return conn->phase_started_ms + handler->timeouts.body_ms;
+        case CONNECTION_IDLE: {
+            uint64_t deadline = conn->phase_started_ms + handler->timeouts.idle_ms;
+            if (connection_handler_draining(handler)) {
+                uint64_t grace_end = handler->drain_started_ms + CONNECTION_DRAIN_GRACE_MS;
+                if (grace_end < deadline) deadline = grace_end;
+            }
+            return deadline;
+        }
+        default:
+            return 0;
+    }
+}
+
+void connection_expire(Connection* conn) {
+    if (conn->phase == CONNECTION_READING_HEADERS || conn->phase == CONNECTION_READING_BODY) {
+        if (conn->length > 0 && !conn->final_response) {
+            conn->final_response = TIMEOUT_RESPONSE;
+        }
+    }
+    conn->keep_alive = false;
+    conn->length = 0;
+}
+
+// The request's queue deadline: the server's, or the client's own
+// X-Request-Timeout in milliseconds when that is sooner
+static uint64_t request_deadline_ns(const ConnectionHandler* handler, const HttpRequest* request) {
+    uint64_t deadline_ms = handler->timeouts.deadline_ms;
+    const char* timeout = http_request_known_header(request, HTTP_HEADER_REQUEST_TIMEOUT);
+    if (timeout && isdigit((unsigned char)*timeout)) {
+        char* end;
+        unsigned long long client_ms = strtoull(timeout, &end, 10);
+        if (*end == '\0' && client_ms < deadline_ms) deadline_ms = client_ms;
+    }
+    return (timer_now_ms() + deadline_ms) * 1000000ULL;
+}
+
+static bool runs_inline(const ConnectionHandler* handler, MessageClass message_class) {
+    switch (handler->dispatch_mode) {
+        case DISPATCH_INLINE: return true;
+        case DISPATCH_INLINE_FAST: return message_class != MESSAGE_CLASS_AUTH;
+        default: return false;
+    }
+}
+
+void connection_handler_dispatch(ConnectionHandler* handler, Connection* conn) {
+    size_t offset = 0;
+
+    while (offset < conn->length && conn->keep_alive && !conn->failed) {
+        char* request = conn->buffer + offset;
+        size_t available = conn->length - offset;
+
+        long request_length = http_request_length(request, available);
+        if (request_length == 0) {
+            if (available >= MAX_REQUEST_SIZE) {
+                conn->final_response = TOO_LARGE_RESPONSE;
+                conn->keep_alive = false;
+            }
+            break;
+        }
+        if (request_length < 0) {
+            conn->final_response = BAD_REQUEST_RESPONSE;
+            conn->keep_alive = false;
+            break;
+        }
+
+        // Only the method is needed to decide whether to wait
+        bool is_write = !(available > 4 && memcmp(request, "GET ", 4) == 0);
+        if ((is_write || conn->after_write) && connection_has_outstanding(conn)) break;
+
+        // Charged once a request is complete and about to run, before it is
+        // parsed or takes a queue slot
+        if (handler->rate_limiter &&
+            !rate_limiter_take(handler->rate_limiter, conn->rate_entry, timer_now_ms())) {
+            conn->final_response = TOO_MANY_REQUESTS_RESPONSE;
+            conn->keep_alive = false;
+            break;
+        }
+
+        // Terminate the request in place so it can be parsed and queued
+        // without another copy
+        char saved = request[request_length];
+        request[request_length] = '\0';
+        flight_record(FLIGHT_REQUEST_START, conn->fd, (uint64_t)request_length, request,
+                      strcspn(request, "\r\n"));
+
+        uint64_t trace_id = trace_sample();
+        uint64_t trace_start_ns = trace_id ? trace_now_ns() : 0;
+        uint64_t parse_cpu_ns = trace_id ? trace_thread_cpu_ns() : 0;
+
+        HttpParseResult parse_result = http_parse_request(request);
+        if (trace_id) {
+            trace_span(trace_id, "parse", trace_start_ns, trace_now_ns(),
+                       trace_thread_cpu_ns() - parse_cpu_ns);
+            // A connection's first request also shows the wait for it to arrive
+            if (!conn->served) {
+                trace_span(trace_id, "accept", conn->accepted_ns, trace_start_ns, 0);
+                trace_start_ns = conn->accepted_ns;
+            }
+        }
+        if (!parse_result.success) {
+            request[request_length] = saved;
+            http_request_free(&parse_result.request);
+            conn->final_response = BAD_REQUEST_RESPONSE;
+            conn->keep_alive = false;
+            break;
+        }
+        // A draining server answers what it has read and then closes
+        conn->keep_alive = http_request_keep_alive(&parse_result.request) &&
+                           !connection_handler_draining(handler);
+        if (handler->capture) {
+            capture_record(handler->capture, &parse_result.request);
+        }
+        MessageClass message_class = message_processor_classify(&parse_result.request);
+        bool run_inline = runs_inline(handler, message_class);
+        uint64_t deadline_ns = run_inline ? 0 : request_deadline_ns(handler, &parse_result.request);
+        if (!run_inline) http_request_free(&parse_result.request);
+        conn->after_write = is_write;
+        conn->served = true;
+
+        // Every earlier response has been sent, so the slots can be reused
+        if (!connection_has_outstanding(conn) && conn->batch.count > 0) {
+            response_batch_reset(&conn->batch);
+            conn->next_response = 0;
+        }
+
+        long slot = response_batch_reserve(&conn->batch);
+        if (slot >= 0) {
+            conn->batch.responses[slot].trace_id = trace_id;
+            conn->batch.responses[slot].trace_start_ns = trace_start_ns;
+        }
+        if (run_inline) {
+            // Answered with the request already parsed, and slotted behind
+            // any queued GETs so responses still go out in order
+            request[request_length] = saved;
+            if (slot < 0) {
+                http_request_free(&parse_result.request);
+                conn->final_response = UNAVAILABLE_RESPONSE;
+                conn->keep_alive = false;
+                break;
+            }
+            size_t response_length = 0;
+            uint64_t handle_start_ns = trace_id ? trace_now_ns() : 0;
+            uint64_t handle_cpu_ns = trace_id ? trace_thread_cpu_ns() : 0;
+            char* response = message_processor_respond(handler->processor, &parse_result.request,
+                                                       conn->keep_alive, &response_length);
+            http_request_free(&parse_result.request);
+            if (trace_id) {
+                trace_span(trace_id, "handle", handle_start_ns, trace_now_ns(),
+                           trace_thread_cpu_ns() - handle_cpu_ns);
+            }
+            response_batch_complete(&conn->batch, (size_t)slot, response, response_length);
+            offset += (size_t)request_length;
+            continue;
+        }
+
+        bool queued = slot >= 0 &&
+                      message_queue_push(handler->queue, message_class, conn->fd, request,
+                                         &conn->batch, (size_t)slot, deadline_ns, trace_id);
+        request[request_length] = saved;
+
+        if (!queued) {
+            fprintf(stderr, "Failed to push message to queue\n");
+            conn->keep_alive = false;
+            if (slot < 0) {
+                conn->final_response = UNAVAILABLE_RESPONSE;
+                break;
+            }
+            char* response = strdup(UNAVAILABLE_RESPONSE);
+            response_batch_complete(&conn->batch, (size_t)slot, response, response ? strlen(response) : 0);
+        }
+
+        offset += (size_t)request_length;
+    }
+
+    if (!conn->keep_alive || conn->failed) {
+        // Nothing more will be read from this connection
+        conn->length = 0;
+    } else if (offset > 0) {
+        // Keep any partial request for the next read
+        memmove(conn->buffer, conn->buffer + offset, conn->length - offset);
+        conn->length -= offset;
+    }
+}
+
+int connection_ready_responses(Connection* conn, struct iovec* iov, int max_iov) {
+    if (!connection_has_outstanding(conn)) return 0;
+
+    size_t ready = response_batch_ready(&conn->batch, conn->next_response);
+    int iovcnt = 0;
+
+    for (size_t i = 0; i < ready; i++) {
+        PendingResponse* response = &conn->batch.responses[conn->next_response + i];
+        if (conn->closing) {
+            // Requests pipelined behind it are dropped unanswered
+            if (iovcnt == 0) {
+                conn->next_response++;
+                continue;
+            }
+            break;
+        }
+        if (conn->failed || !response->data) {
+            // Nothing after an unanswered request can be sent in order, but
+            // the remaining slots still have to be drained
+            conn->failed = true;
+            conn->keep_alive = false;
+            if (iovcnt == 0) {
+                conn->next_response++;
+                continue;
+            }
+            break;
+        }
+        if (iovcnt == max_iov) break;
+        iov[iovcnt].iov_base = response->data;
+        iov[iovcnt].iov_len = response->length;
+        iovcnt++;
+        if (response->trace_id && !conn->send_started_ns) conn->send_started_ns = trace_now_ns();
+        if (response->close) {
+            // Its Connection: close is the last thing the client reads
+            conn->closing = true;
+            conn->keep_alive = false;
+            conn->final_response = NULL;
+            break;
+        }
+    }
+
+    return iovcnt;
+}
+
+void connection_responses_sent(Connection* conn, int count) {
+    for (int i = 0; i < count; i++) {
+        // The status, without "HTTP/1.1 "
+        PendingResponse* response = &conn->batch.responses[conn->next_response + (size_t)i];
+        const char* status = response->length > 9 ? response->data + 9 : response->data;
+        const char* status_end = response->length > 9
+                                 ? (const char*)memchr(status, '\r', response->length - 9) : NULL;
+        flight_record(FLIGHT_REQUEST_END, conn->fd, response->length, status,
+                      status_end ? (size_t)(status_end - status) : 0);
+    }
+    // Traced requests end once their response is written
+    if (conn->send_started_ns) {
+        uint64_t now = trace_now_ns();
+        for (int i = 0; i < count; i++) {
+            PendingResponse* response = &conn->batch.responses[conn->next_response + (size_t)i];
+            if (!response->trace_id) continue;
+            trace_span(response->trace_id, "send", conn->send_started_ns, now, 0);
+            trace_span(response->trace_id, "request", response->trace_start_ns, now, 0);
+        }
+        conn->send_started_ns = 0;
+    }
+    conn->next_response += (size_t)count;
+}
+
+// Returns 1 once client_fd has input, 2 if wake_fd (when not -1) became
+// readable first, 0 if deadline_ms passed first, or -1.
+static int wait_readable(int client_fd, uint64_t deadline_ms, int wake_fd) {
+    struct pollfd pfds[2] = {
+        {.fd = client_fd, .events = POLLIN},
+        {.fd = wake_fd, .events = POLLIN},
+    };
+    nfds_t count = wake_fd >= 0 ? 2 : 1;
+    for (;;) {
+        uint64_t now = timer_now_ms();
+        int timeout = -1;
+        if (deadline_ms) {
+            if (now >= deadline_ms) return 0;
+            timeout = (int)(deadline_ms - now);
+        }
+        int ready = poll(pfds, count, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready > 0 && !pfds[0].revents) return 2;
+        return ready > 0 ? 1 : ready;
+    }
+}
+
+static bool send_iovecs(int client_fd, struct iovec* iov, int iovcnt, unsigned timeout_ms) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    uint64_t deadline = 0;
+
+    while (msg.msg_iovlen > 0) {
+        // Only a client that stops reading makes us wait, and only so long
+        ssize_t sent = sendmsg(client_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+            uint64_t now = timer_now_ms();
+            if (deadline == 0) deadline = now + timeout_ms;
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            struct pollfd pfd = {.fd = client_fd, .events = POLLOUT};
+            if (poll(&pfd, 1, (int)(deadline - now)) < 0 && errno != EINTR) return false;
+            continue;
+        }
+
+        // Skip fully sent buffers and advance into a partially sent one
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= (size_t)sent;
+        }
+    }
 
-    http_request_free(&parse_result.request);
     return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE  // sched_getaffinity
+
+#include "cpu_budget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <math.h>
+
+#define CGROUP_PATH_SIZE PATH_MAX
+
+// Whether token appears in the comma-separated list
+static bool list_has(const char* list, const char* token) {
+    size_t length = strlen(token);
+    while (*list) {
+        size_t item = strcspn(list, ",");
+        if (item == length && strncmp(list, token, length) == 0) return true;
+        list += item;
+        if (*list == ',') list++;
+    }
+    return false;
+}
+
+// Finds the mount of a cgroup hierarchy: cgroup2 when controller is NULL,
+// otherwise the v1 hierarchy carrying controller. root is the group the
+// mount shows at its top, which differs from "/" inside a cgroup namespace.
+static bool find_mount(const char* controller, char* mount, char* root) {
+    FILE* file = fopen("/proc/self/mountinfo", "r");
+    if (!file) return false;
+
+    char line[1024];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        char line_root[CGROUP_PATH_SIZE / 4];
+        char line_mount[CGROUP_PATH_SIZE / 4];
+        if (sscanf(line, "%*s %*s %*s %1023s %1023s", line_root, line_mount) != 2) continue;
+
+        // Optional fields end at " - ", followed by type, source and options
+        const char* tail = strstr(line, " - ");
+        if (!tail) continue;
+        char type[32];
+        char options[512];
+        if (sscanf(tail + 3, "%31s %*s %511s", type, options) != 2) continue;
+
+        if (controller ? strcmp(type, "cgroup") == 0 && list_has(options, controller)
+                       : strcmp(type, "cgroup2") == 0) {
+            snprintf(mount, CGROUP_PATH_SIZE, "%s", line_mount);
+            snprintf(root, CGROUP_PATH_SIZE, "%s", line_root);
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+// The process's group in a hierarchy, from /proc/self/cgroup: the "0::"
+// line for cgroup2, or the line listing controller for v1
+static bool find_group(const char* controller, char* group) {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (!file) return false;
+
+    char line[CGROUP_PATH_SIZE];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* controllers = strchr(line, ':');
+        char* path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!path) continue;
+        *controllers++ = '\0';
+        *path++ = '\0';
+
+        if (controller ? list_has(controllers, controller)
+                       : strcmp(line, "0") == 0 && *controllers == '\0') {
+            snprintf(group, CGROUP_PATH_SIZE, "%s", path);
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+// CPUs allowed by the group in dir, or 0 if it sets no limit
+static double read_limit(const char* dir, bool v2) {
+    char path[CGROUP_PATH_SIZE + 32];
+    long long quota = -1;
+    long long period = 0;
+
+    if (v2) {
+        // "max 100000" or "<quota> <period>"
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        FILE* file = fopen(path, "r");
+        if (!file) return 0;
+        char quota_text[32];
+        if (fscanf(file, "%31s %lld", quota_text, &period) == 2 && strcmp(quota_text, "max") != 0) {
+            quota = atoll(quota_text);
+        }
+        fclose(file);
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        FILE* file = fopen(path, "r");
+        if (!file) return 0;
+        if (fscanf(file, "%lld", &quota) != 1) quota = -1;
+        fclose(file);
+
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        file = fopen(path, "r");
+        if (!file) return 0;
+        if (fscanf(file, "%lld", &period) != 1) period = 0;
+        fclose(file);
+    }
+
+    if (quota <= 0 || period <= 0) return 0;
+    return (double)quota / (double)period;
+}
+
+// The tightest limit from the process's group up to the top of the mount,
+// since a parent's limit caps everything below it
+static double hierarchy_limit(const char* controller) {
+    char mount[CGROUP_PATH_SIZE];
+    char root[CGROUP_PATH_SIZE];
+    char group[CGROUP_PATH_SIZE];
+    if (!find_mount(controller, mount, root) || !find_group(controller, group)) return 0;
+
+    // Paths in /proc/self/cgroup are relative to the hierarchy's root, and
+    // the mount may show only part of it
+    const char* relative = group;
+    size_t root_length = strlen(root);
+    if (strcmp(root, "/") != 0 && strncmp(group, root, root_length) == 0) {
+        relative = group + root_length;
+    }
+
+    char dir[2 * CGROUP_PATH_SIZE];
+    size_t mount_length = strlen(mount);
+    snprintf(dir, sizeof(dir), "%s%s", mount, strcmp(relative, "/") == 0 ? "" : relative);
+
+    double tightest = 0;
+    for (;;) {
+        double limit = read_limit(dir, controller == NULL);
+        if (limit > 0 && (tightest == 0 || limit < tightest)) tightest = limit;
+
+        char* slash = strrchr(dir, '/');
+        if (strlen(dir) <= mount_length || !slash) break;
+        *slash = '\0';
+    }
+    return tightest;
+}
+
+void cpu_budget_detect(CpuBudget* budget) {
+    cpu_set_t set;
+    long online = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        online = CPU_COUNT(&set);
+    }
+    if (online <= 0) online = sysconf(_SC_NPROCESSORS_ONLN);
+    budget->online = online > 0 ? (unsigned)online : 1;
+
+    budget->quota = hierarchy_limit(NULL);
+    if (budget->quota == 0) budget->quota = hierarchy_limit("cpu");
+
+    budget->cpus = budget->online;
+    if (budget->quota > 0 && ceil(budget->quota) < budget->cpus) {
+        budget->cpus = (unsigned)ceil(budget->quota);
+    }
+    if (budget->cpus == 0) budget->cpus = 1;
+}
@@ -1,26 +1,75 @@
 #include "crash_handler.h"
+#include "flight_recorder.h"
 #include <execinfo.h>
 #include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
 #define BACKTRACE_SIZE 50
 
+// Only async-signal-safe calls from here on: no stdio, no allocation
+static void write_text(const char* text) {
+    ssize_t written = write(STDERR_FILENO, text, strlen(text));
+    (void)written;
+}
+
+static void write_signal(int sig) {
+    char digits[12];
+    size_t count = 0;
+    unsigned value = (unsigned)sig;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value && count < sizeof(digits));
+    ssize_t written = write(STDERR_FILENO, digits + sizeof(digits) - count, count);
+    (void)written;
+}
+
 static void crash_handler(int sig) {
     void *array[BACKTRACE_SIZE];
-    size_t size = backtrace(array, BACKTRACE_SIZE);
+    int size = backtrace(array, BACKTRACE_SIZE);
     
-    fprintf(stderr, "\n=== CRASH DETECTED ===\n");
-    fprintf(stderr, "Error: Signal %d\n", sig);
-    fprintf(stderr, "Stack trace:\n");
+    write_text("\n=== CRASH DETECTED ===\nError: Signal ");
+    write_signal(sig);
+    write_text("\nStack trace:\n");
     backtrace_symbols_fd(array, size, STDERR_FILENO);
-    exit(1);
+    flight_recorder_dump(STDERR_FILENO);
+    
+    // The handler was reset on entry; dying of the same signal keeps the
+    // exit status and the core dump
+    raise(sig);
 }
 
-void install_crash_handler() {
-    signal(SIGSEGV, crash_handler);  // Segmentation fault
-    signal(SIGABRT, crash_handler);  // Abort signal
-    signal(SIGILL, crash_handler);   // Illegal instruction
-    signal(SIGFPE, crash_handler);   // Floating point exception
-}
\ No newline at end of file
+// A stalled server is asked for its history and keeps running
+// The server keeps running, so the interrupted thread must find errno as
+// it left it, for example between a failed recv and its EAGAIN check
+static void dump_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    write_text("\n=== FLIGHT RECORDER DUMP REQUESTED ===\n");
+    flight_recorder_dump(STDERR_FILENO);
+    errno = saved_errno;
+}
+
+void install_crash_handler(void) {
+    // backtrace() loads libgcc the first time, which may allocate, so do
+    // that now rather than in the handler
+    void* warm_up[1];
+    backtrace(warm_up, 1);
+    
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = crash_handler;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGSEGV, &action, NULL);  // Segmentation fault
+    sigaction(SIGBUS, &action, NULL);   // Bus error
+    sigaction(SIGABRT, &action, NULL);  // Abort signal
+    sigaction(SIGILL, &action, NULL);   // Illegal instruction
+    sigaction(SIGFPE, &action, NULL);   // Floating point exception
+    
+    action.sa_handler = dump_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+}
@@ -0,0 +1,240 @@
+#include "flight_recorder.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef struct {
+    uint64_t ticks;
+    uint64_t value;
+    int32_t fd;
+    uint8_t type;
+    uint8_t detail_length;
+    char detail[FLIGHT_DETAIL_SIZE];
+} FlightEvent;
+
+// head counts every event the owner has recorded
+typedef struct FlightBuffer {
+    FlightEvent events[FLIGHT_RECORDER_EVENTS];
+    atomic_ullong head;
+    atomic_bool owned;
+    int tid;
+    struct FlightBuffer* next;
+} FlightBuffer;
+
+static const char* const EVENT_NAMES[FLIGHT_EVENT_TYPES] = {
+    [FLIGHT_REQUEST_START] = "request_start",
+    [FLIGHT_REQUEST_END] = "request_end",
+    [FLIGHT_QUEUE_PUSH] = "queue_push",
+    [FLIGHT_QUEUE_POP] = "queue_pop",
+    [FLIGHT_LOCK_WAIT] = "lock_wait",
+};
+
+// Pushed with a compare-and-swap and never removed, so the dump can walk
+// the list from a signal handler without a lock
+static _Atomic(FlightBuffer*) buffers = NULL;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+static __thread FlightBuffer* local_buffer;
+// Taken together when the first ring is claimed, to convert ticks to ns
+static uint64_t base_ticks;
+static uint64_t base_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The clock profiled_mutex uses, so lock waits can be recorded as measured
+static inline uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void release_buffer(void* arg) {
+    atomic_store(&((FlightBuffer*)arg)->owned, false);
+}
+
+static void init_recorder(void) {
+    base_ticks = read_ticks();
+    base_ns = now_ns();
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static FlightBuffer* claim_buffer(void) {
+    pthread_once(&init_once, init_recorder);
+
+    FlightBuffer* buffer;
+    for (buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&buffer->owned, &expected, true)) break;
+    }
+    if (!buffer) {
+        buffer = (FlightBuffer*)calloc(1, sizeof(FlightBuffer));
+        if (!buffer) return NULL;
+        atomic_init(&buffer->owned, true);
+        buffer->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer)) {
+        }
+    }
+    buffer->tid = (int)syscall(SYS_gettid);
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+void flight_record(FlightEventType type, int fd, uint64_t value, const char* detail,
+                   size_t detail_length) {
+    FlightBuffer* buffer = local_buffer;
+    if (!buffer) {
+        buffer = local_buffer = claim_buffer();
+        if (!buffer) return;
+    }
+
+    unsigned long long head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    FlightEvent* event = &buffer->events[head % FLIGHT_RECORDER_EVENTS];
+    event->ticks = read_ticks();
+    event->value = value;
+    event->fd = fd;
+    event->type = (uint8_t)type;
+    if (detail_length > FLIGHT_DETAIL_SIZE) detail_length = FLIGHT_DETAIL_SIZE;
+    if (detail_length) memcpy(event->detail, detail, detail_length);
+    event->detail_length = (uint8_t)detail_length;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+// ---- Dump: no stdio or allocation from here on ----
+
+typedef struct {
+    char data[192];
+    size_t length;
+} Line;
+
+static void line_text(Line* line, const char* text, size_t length) {
+    for (size_t i = 0; i < length && line->length < sizeof(line->data); i++) {
+        // Request lines come from clients
+        char c = text[i];
+        line->data[line->length++] = (c >= ' ' && c <= '~') ? c : '?';
+    }
+}
+
+static void line_string(Line* line, const char* text) {
+    line_text(line, text, strlen(text));
+}
+
+static void line_number(Line* line, uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (count && line->length < sizeof(line->data)) {
+        line->data[line->length++] = digits[--count];
+    }
+}
+
+static void write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+static void write_line(int fd, Line* line) {
+    if (line->length < sizeof(line->data)) {
+        line->data[line->length++] = '\n';
+    } else {
+        line->data[sizeof(line->data) - 1] = '\n';
+    }
+    write_all(fd, line->data, line->length);
+    line->length = 0;
+}
+
+static void write_event(int fd, const FlightEvent* event, uint64_t now_ticks, double ns_per_tick) {
+    Line line = {.length = 0};
+    uint64_t ago_us = event->ticks < now_ticks
+                      ? (uint64_t)((double)(now_ticks - event->ticks) * ns_per_tick / 1000.0) : 0;
+    line_string(&line, "  -");
+    line_number(&line, ago_us);
+    line_string(&line, "us ");
+    line_string(&line, event->type < FLIGHT_EVENT_TYPES ? EVENT_NAMES[event->type] : "unknown");
+    if (event->fd >= 0) {
+        line_string(&line, " fd=");
+        line_number(&line, (uint64_t)event->fd);
+    }
+
+    switch (event->type) {
+        case FLIGHT_REQUEST_START:
+        case FLIGHT_REQUEST_END:
+            line_string(&line, " bytes=");
+            line_number(&line, event->value);
+            break;
+        case FLIGHT_QUEUE_PUSH:
+            line_string(&line, " depth=");
+            line_number(&line, event->value);
+            break;
+        case FLIGHT_QUEUE_POP:
+            line_string(&line, " waited_us=");
+            line_number(&line, event->value / 1000);
+            break;
+        case FLIGHT_LOCK_WAIT:
+            line_string(&line, " waited_us=");
+            line_number(&line, (uint64_t)((double)event->value * ns_per_tick / 1000.0));
+            break;
+        default:
+            break;
+    }
+    if (event->detail_length) {
+        line_string(&line, " ");
+        line_text(&line, event->detail,
+                  event->detail_length < FLIGHT_DETAIL_SIZE ? event->detail_length : FLIGHT_DETAIL_SIZE);
+    }
+    write_line(fd, &line);
+}
+
+void flight_recorder_dump(int fd) {
+    uint64_t now_ticks = read_ticks();
+    uint64_t now = now_ns();
+    double ns_per_tick = 1.0;
+    if (now_ticks > base_ticks && now > base_ns + 1000000) {
+        ns_per_tick = (double)(now - base_ns) / (double)(now_ticks - base_ticks);
+    }
+
+    Line line = {.length = 0};
+    line_string(&line, "=== FLIGHT RECORDER (oldest first) ===");
+    write_line(fd, &line);
+
+    for (FlightBuffer* buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        unsigned long long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        if (head == 0) continue;
+        unsigned long long from = head > FLIGHT_RECORDER_EVENTS ? head - FLIGHT_RECORDER_EVENTS : 0;
+
+        line_string(&line, "thread ");
+        line_number(&line, (uint64_t)buffer->tid);
+        if (buffer == local_buffer) line_string(&line, " (this thread)");
+        if (!atomic_load(&buffer->owned)) line_string(&line, " (exited)");
+        line_string(&line, ", ");
+        line_number(&line, head - from);
+        line_string(&line, " events:");
+        write_line(fd, &line);
+
+        for (unsigned long long i = from; i < head; i++) {
+            write_event(fd, &buffer->events[i % FLIGHT_RECORDER_EVENTS], now_ticks, ns_per_tick);
+        }
+    }
+}
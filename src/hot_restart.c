@@ -0,0 +1,239 @@
+#define _GNU_SOURCE  // accept4, MSG_CMSG_CLOEXEC
+
+#include "hot_restart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// How long either side waits for the other during a handoff
+#define HANDOFF_TIMEOUT_MS 10000
+
+static const char HANDOFF_CONFIRM = 'K';
+
+LOCK_STATS_DEFINE(restart_lock_stats, "hot_restart");
+
+static bool fill_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Restart socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool wait_readable(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+
+static int open_listener(const char* path) {
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Restart socket creation failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Nobody answered on path, so any file left there is stale
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        fprintf(stderr, "Restart socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_descriptor(int conn, int fd) {
+    char byte = 'F';
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1;
+}
+
+static int receive_descriptor(int conn) {
+    if (!wait_readable(conn, HANDOFF_TIMEOUT_MS)) return -1;
+
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int hot_restart_takeover(const char* path, int* handoff_fd) {
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path)) return -1;
+
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) return -1;
+    if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        // No server running, or a stale file left by one that crashed
+        close(conn);
+        return -1;
+    }
+
+    int fd = receive_descriptor(conn);
+    if (fd < 0) {
+        fprintf(stderr, "Restart socket %s answered without a listening socket\n", path);
+        close(conn);
+        return -1;
+    }
+    *handoff_fd = conn;
+    return fd;
+}
+
+bool hot_restart_confirm(int handoff_fd) {
+    bool sent = send(handoff_fd, &HANDOFF_CONFIRM, 1, MSG_NOSIGNAL) == 1;
+    close(handoff_fd);
+    return sent;
+}
+
+static bool wait_confirm(int conn) {
+    char byte;
+    return wait_readable(conn, HANDOFF_TIMEOUT_MS) &&
+           recv(conn, &byte, 1, 0) == 1 && byte == HANDOFF_CONFIRM;
+}
+
+static void* handoff_thread(void* arg) {
+    HotRestart* hr = (HotRestart*)arg;
+
+    while (!atomic_load(&hr->stopping)) {
+        int conn = accept4(hr->unix_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!atomic_load(&hr->stopping)) {
+                fprintf(stderr, "Restart socket accept failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+
+        // Give up the path first so the successor can listen on it in turn
+        profiled_mutex_lock(&hr->mutex);
+        close(hr->unix_fd);
+        hr->unix_fd = -1;
+        unlink(hr->path);
+        profiled_mutex_unlock(&hr->mutex);
+
+        bool confirmed = send_descriptor(conn, hr->server_fd) && wait_confirm(conn);
+        close(conn);
+        if (confirmed) {
+            atomic_store(&hr->handed_off, true);
+            ssize_t written = write(hr->notify_fd, "R", 1);
+            (void)written;
+            break;
+        }
+
+        fprintf(stderr, "Successor did not take over; still serving\n");
+        profiled_mutex_lock(&hr->mutex);
+        if (!atomic_load(&hr->stopping)) hr->unix_fd = open_listener(hr->path);
+        bool listening = hr->unix_fd >= 0;
+        profiled_mutex_unlock(&hr->mutex);
+        if (!listening) break;
+    }
+    return NULL;
+}
+
+bool hot_restart_listen(HotRestart* hr, const char* path, int server_fd, int notify_fd) {
+    hr->path = strdup(path);
+    if (!hr->path) return false;
+    hr->server_fd = server_fd;
+    hr->notify_fd = notify_fd;
+    atomic_init(&hr->stopping, false);
+    atomic_init(&hr->handed_off, false);
+
+    hr->unix_fd = open_listener(path);
+    if (hr->unix_fd < 0) {
+        free(hr->path);
+        hr->path = NULL;
+        return false;
+    }
+
+    profiled_mutex_init(&hr->mutex, &restart_lock_stats);
+    if (pthread_create(&hr->thread, NULL, handoff_thread, hr) != 0) {
+        perror("Failed to create restart thread");
+        profiled_mutex_destroy(&hr->mutex);
+        close(hr->unix_fd);
+        unlink(path);
+        free(hr->path);
+        hr->path = NULL;
+        return false;
+    }
+    return true;
+}
+
+void hot_restart_stop(HotRestart* hr) {
+    if (!hr->path) return;
+
+    atomic_store(&hr->stopping, true);
+    profiled_mutex_lock(&hr->mutex);
+    if (hr->unix_fd >= 0) {
+        // Wakes the blocked accept
+        shutdown(hr->unix_fd, SHUT_RDWR);
+    }
+    profiled_mutex_unlock(&hr->mutex);
+    pthread_join(hr->thread, NULL);
+
+    if (hr->unix_fd >= 0) {
+        close(hr->unix_fd);
+        hr->unix_fd = -1;
+        unlink(hr->path);
+    }
+    profiled_mutex_destroy(&hr->mutex);
+    free(hr->path);
+    hr->path = NULL;
+}
+
+bool hot_restart_handed_off(HotRestart* hr) {
+    return atomic_load(&hr->handed_off);
+}
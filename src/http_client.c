@@ -0,0 +1,246 @@
+#include "http_client.h"
+#include "cJSON.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define READ_CHUNK_SIZE 4096
+
+static char* build_credentials_body(const char* username, const char* password);
+static int build_json_request(char* buffer, size_t size, const char* path, const char* host,
+                              const char* username, const char* password, bool keep_alive);
+
+int http_client_connect(const char* ip, int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", ip);
+        close(sockfd);
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        fprintf(stderr, "Error connecting to server: %s\n", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static int checked_length(int written, size_t size) {
+    return (written < 0 || (size_t)written >= size) ? -1 : written;
+}
+
+int http_client_build_get_users(char* buffer, size_t size, const char* host,
+                                const char* token, bool keep_alive) {
+    int written = snprintf(buffer, size,
+        "GET /users HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: text/plain\r\n"
+        "Authorization: Bearer %s\r\n"
+        "Connection: %s\r\n\r\n",
+        host, token, keep_alive ? "keep-alive" : "close");
+    return checked_length(written, size);
+}
+
+int http_client_build_post_users(char* buffer, size_t size, const char* host,
+                                 const char* token, const char* text, bool keep_alive) {
+    int written = snprintf(buffer, size,
+        "POST /users HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: text/plain\r\n"
+        "Authorization: Bearer %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n"
+        "%s",
+        host, token, strlen(text), keep_alive ? "keep-alive" : "close", text);
+    return checked_length(written, size);
+}
+
+int http_client_build_post_batch(char* buffer, size_t size, const char* host,
+                                 const char* token, const char* ndjson, bool keep_alive) {
+    int written = snprintf(buffer, size,
+        "POST /users/batch HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: application/x-ndjson\r\n"
+        "Authorization: Bearer %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n"
+        "%s",
+        host, token, strlen(ndjson), keep_alive ? "keep-alive" : "close", ndjson);
+    return checked_length(written, size);
+}
+
+int http_client_build_signup(char* buffer, size_t size, const char* host,
+                             const char* username, const char* password, bool keep_alive) {
+    return build_json_request(buffer, size, "/signup", host, username, password, keep_alive);
+}
+
+int http_client_build_login(char* buffer, size_t size, const char* host,
+                            const char* username, const char* password, bool keep_alive) {
+    return build_json_request(buffer, size, "/login", host, username, password, keep_alive);
+}
+
+static char* build_credentials_body(const char* username, const char* password) {
+    cJSON* json = cJSON_CreateObject();
+    if (!json) return NULL;
+    cJSON_AddStringToObject(json, "username", username);
+    cJSON_AddStringToObject(json, "password", password);
+    char* json_str = cJSON_Print(json);
+    cJSON_Delete(json);
+    return json_str;
+}
+
+static int build_json_request(char* buffer, size_t size, const char* path, const char* host,
+                              const char* username, const char* password, bool keep_alive) {
+    char* json_str = build_credentials_body(username, password);
+    if (!json_str) return -1;
+
+    int written = snprintf(buffer, size,
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n"
+        "%s",
+        path, host, strlen(json_str), keep_alive ? "keep-alive" : "close", json_str);
+
+    free(json_str);
+    return checked_length(written, size);
+}
+
+bool http_client_send_all(int fd, const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+static const char* find_header_end(const char* data, size_t length, size_t* header_length) {
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (data[i] != '\n') continue;
+        if (data[i + 1] == '\n') {
+            *header_length = i + 2;
+            return data + i;
+        }
+        if (i + 2 < length && data[i + 1] == '\r' && data[i + 2] == '\n') {
+            *header_length = i + 3;
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+long http_client_parse_response(const char* data, size_t length, bool at_eof,
+                                HttpClientResponse* response) {
+    size_t header_length;
+    const char* header_end = find_header_end(data, length, &header_length);
+    if (!header_end) return at_eof ? -1 : 0;
+
+    int status = 0;
+    if (sscanf(data, "HTTP/%*d.%*d %d", &status) != 1) return -1;
+
+    bool has_length = false;
+    bool keep_alive = true;
+    size_t content_length = 0;
+
+    const char* line = memchr(data, '\n', header_end - data);
+    while (line && line < header_end) {
+        line++;
+        const char* eol = memchr(line, '\n', header_end + 1 - line);
+        if (!eol) break;
+        size_t line_length = (size_t)(eol - line);
+
+        if (line_length > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 15, NULL, 10);
+            has_length = true;
+        } else if (line_length > 11 && strncasecmp(line, "Connection:", 11) == 0) {
+            const char* value = line + 11;
+            while (*value == ' ') value++;
+            if (strncasecmp(value, "close", 5) == 0) keep_alive = false;
+        }
+        line = eol;
+    }
+
+    // 1xx, 204 and 304 never have a body, whatever the headers say
+    if (status < 200 || status == 204 || status == 304) {
+        has_length = true;
+        content_length = 0;
+    }
+
+    if (!has_length) {
+        if (!at_eof) return 0;
+        content_length = length - header_length;
+        keep_alive = false;
+    }
+    if (length - header_length < content_length) return at_eof ? -1 : 0;
+
+    if (response) {
+        response->status = status;
+        response->keep_alive = keep_alive;
+        response->body_length = content_length;
+        response->body = (char*)malloc(content_length + 1);
+        if (!response->body) return -1;
+        memcpy(response->body, data + header_length, content_length);
+        response->body[content_length] = '\0';
+    }
+
+    return (long)(header_length + content_length);
+}
+
+bool http_client_read_response(int fd, HttpClientResponse* response) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t length = 0;
+    char* buffer = (char*)malloc(capacity);
+    if (!buffer) return false;
+
+    memset(response, 0, sizeof(*response));
+    bool at_eof = false;
+    long parsed = 0;
+
+    while (parsed == 0) {
+        if (capacity - length < READ_CHUNK_SIZE) {
+            char* grown = (char*)realloc(buffer, capacity * 2);
+            if (!grown) break;
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        ssize_t n = recv(fd, buffer + length, capacity - length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) at_eof = true;
+        else length += (size_t)n;
+
+        parsed = http_client_parse_response(buffer, length, at_eof, response);
+        if (at_eof && parsed == 0) parsed = -1;
+    }
+
+    free(buffer);
+    return parsed > 0;
+}
+
+void http_client_response_free(HttpClientResponse* response) {
+    free(response->body);
+    response->body = NULL;
+    response->body_length = 0;
+}
@@ -1,22 +1,41 @@
 #include "http_parser.h"
+#include "simd_scan.h"
 #include <string.h>
 #include "cJSON.h"
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <limits.h>
 
 #define MAX_HEADERS 50
 #define INITIAL_BUF_SIZE 1024
 
+// Indexed by HttpKnownHeader
+static const char* const KNOWN_HEADER_NAMES[HTTP_HEADER_KNOWN_COUNT] = {
+    "Authorization",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "Accept-Encoding",
+    "If-None-Match",
+    "Host",
+    "X-Request-Timeout",
+};
+
 static char* strtrim(char* str);
 static int find_char(const char* str, char c);
+static bool header_has_token(const char* value, const char* token);
 
 void http_request_init(HttpRequest* req) {
     req->method = NULL;
     req->path = NULL;
+    req->version = NULL;
     req->header_keys = NULL;
     req->header_values = NULL;
     req->header_count = 0;
+    memset(req->known_headers, 0, sizeof(req->known_headers));
     req->body = NULL;
 }
 
@@ -32,6 +51,10 @@ void http_request_free(HttpRequest* req) {
         free(req->path);
         req->path = NULL;
     }
+    if (req->version) {
+        free(req->version);
+        req->version = NULL;
+    }
     
     if (req->header_keys && req->header_values) {
         for (size_t i = 0; i < req->header_count; i++) {
@@ -49,6 +72,7 @@ void http_request_free(HttpRequest* req) {
     }
     
     req->header_count = 0;
+    memset(req->known_headers, 0, sizeof(req->known_headers));
 }
 
 HttpParseResult http_parse_request(const char* raw_request) {
@@ -62,42 +86,25 @@ HttpParseResult http_parse_request(const char* raw_request) {
     }
 
     // Make a working copy
-    char* request_copy = strdup(raw_request);
+    size_t raw_length = strlen(raw_request);
+    char* request_copy = (char*)malloc(raw_length + 1);
     if (!request_copy) {
-        printf("Parser: strdup failed\n");
+        printf("Parser: Copy allocation failed\n");
         return result;
     }
+    memcpy(request_copy, raw_request, raw_length + 1);
 
-    // Find the header/body separator
-    char* body_start = NULL;
-    char* current = request_copy;
-    
-    // Look for \r\n\r\n or \n\n
-    while (*current) {
-        if (*current == '\n') {
-            // Check for empty line
-            if (*(current+1) == '\n' || 
-                (*(current+1) == '\r' && *(current+2) == '\n')) {
-                body_start = current + (*(current+1) == '\r' ? 2 : 1) + 1;
-                break;
-            }
-        }
-        current++;
-    }
-
-    if (!body_start) {
+    // Find the header/body separator, \r\n\r\n or \n\n
+    size_t header_length = simd_scan_header_end(request_copy, raw_length);
+    if (!header_length) {
         printf("Parser: No empty line found between headers and body\n");
         free(request_copy);
         return result;
     }
+    char* body_start = request_copy + header_length;
 
-    // Parse request line (first line)
-    char* line_end = strchr(request_copy, '\n');
-    if (!line_end) {
-        printf("Parser: No newline in request\n");
-        free(request_copy);
-        return result;
-    }
+    // Parse request line (first line); the separator guarantees a newline
+    char* line_end = request_copy + simd_scan_byte(request_copy, header_length, '\n');
     *line_end = '\0';  // Terminate request line
     
     // Parse method, path, version
@@ -111,8 +118,14 @@ HttpParseResult http_parse_request(const char* raw_request) {
         return result;
     }
 
+    size_t version_len = strlen(version);
+    if (version_len > 0 && version[version_len-1] == '\r') {
+        version[version_len-1] = '\0';
+    }
+
     result.request.method = strdup(method);
     result.request.path = strdup(path);
+    result.request.version = strdup(version);
 
     // Allocate header arrays
     result.request.header_keys = (char**)malloc(MAX_HEADERS * sizeof(char*));
@@ -126,22 +139,24 @@ HttpParseResult http_parse_request(const char* raw_request) {
     }
 
     // Parse headers (between request line and empty line)
-    char* headers_start = line_end + 1;
     char* headers_end = body_start - 
         (*(body_start-2) == '\r' ? 2 : 1) - 1;
-    *headers_end = '\0';
 
-    char* header_line = strtok(headers_start, "\n");
-    while (header_line && result.request.header_count < MAX_HEADERS) {
+    char* header_line = line_end + 1;
+    while (header_line < headers_end && result.request.header_count < MAX_HEADERS) {
+        size_t len = simd_scan_byte(header_line, (size_t)(headers_end - header_line), '\n');
+        char* next_line = header_line + len + 1;
+        header_line[len] = '\0';
+
         // Trim \r if present
-        size_t len = strlen(header_line);
         if (len > 0 && header_line[len-1] == '\r') {
-            header_line[len-1] = '\0';
+            header_line[--len] = '\0';
         }
 
         // Parse header
-        char* colon = strchr(header_line, ':');
-        if (colon) {
+        size_t colon_offset = simd_scan_byte(header_line, len, ':');
+        if (colon_offset < len) {
+            char* colon = header_line + colon_offset;
             *colon = '\0';
             char* key = strtrim(header_line);
             char* value = strtrim(colon + 1);
@@ -151,16 +166,23 @@ HttpParseResult http_parse_request(const char* raw_request) {
                 result.request.header_values[result.request.header_count] = strdup(value);
                 if (result.request.header_keys[result.request.header_count] && 
                     result.request.header_values[result.request.header_count]) {
+                    HttpKnownHeader known = http_header_classify(key, strlen(key));
+                    if (known != HTTP_HEADER_UNKNOWN && !result.request.known_headers[known]) {
+                        result.request.known_headers[known] =
+                            result.request.header_values[result.request.header_count];
+                    }
                     result.request.header_count++;
                 }
             }
         }
-        header_line = strtok(NULL, "\n");
+        header_line = next_line;
     }
 
     // Store body
     if (*body_start) {
-        result.request.body = strdup(body_start);
+        size_t body_length = raw_length - header_length;
+        result.request.body = (char*)malloc(body_length + 1);
+        if (result.request.body) memcpy(result.request.body, body_start, body_length + 1);
     } else {
         printf("Parser: Empty body\n");
     }
@@ -171,6 +193,111 @@ HttpParseResult http_parse_request(const char* raw_request) {
     return result;
 }
 
+size_t http_header_length(const char* data, size_t length) {
+    // Find the empty line that ends the headers, as http_parse_request does
+    return simd_scan_header_end(data, length);
+}
+
+long http_request_length(const char* data, size_t length) {
+    size_t header_length = http_header_length(data, length);
+    if (header_length == 0) return 0;
+
+    size_t content_length = 0;
+    const char* line = memchr(data, '\n', header_length);
+    const char* headers_end = data + header_length;
+    while (line && line + 1 < headers_end) {
+        line++;
+        const char* eol = memchr(line, '\n', headers_end - line);
+        if (!eol) break;
+        size_t line_len = (size_t)(eol - line);
+
+        if (line_len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            char* end;
+            const char* value = line + 15;
+            while (*value == ' ' || *value == '\t') value++;
+            if (!isdigit((unsigned char)*value)) return -1;
+            unsigned long long parsed = strtoull(value, &end, 10);
+            while (end < eol && isspace((unsigned char)*end)) end++;
+            if (end != eol || parsed > (unsigned long long)LONG_MAX - header_length) return -1;
+            content_length = (size_t)parsed;
+        } else if (line_len > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            return -1;
+        }
+        line = eol;
+    }
+
+    if (length - header_length < content_length) return 0;
+    return (long)(header_length + content_length);
+}
+
+// Checks a comma-separated header value such as "keep-alive, Upgrade"
+static bool header_has_token(const char* value, const char* token) {
+    size_t token_len = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+        size_t len = strcspn(value, ",");
+        size_t trimmed = len;
+        while (trimmed > 0 && isspace((unsigned char)value[trimmed-1])) trimmed--;
+        if (trimmed == token_len && strncasecmp(value, token, token_len) == 0) return true;
+        value += len;
+    }
+    return false;
+}
+
+// Names are told apart by length and first letter, then confirmed with
+// one comparison
+HttpKnownHeader http_header_classify(const char* name, size_t length) {
+    HttpKnownHeader candidate = HTTP_HEADER_UNKNOWN;
+    char first = (char)tolower((unsigned char)name[0]);
+    switch (length) {
+        case 4:
+            if (first == 'h') candidate = HTTP_HEADER_HOST;
+            break;
+        case 10:
+            if (first == 'c') candidate = HTTP_HEADER_CONNECTION;
+            break;
+        case 12:
+            if (first == 'c') candidate = HTTP_HEADER_CONTENT_TYPE;
+            break;
+        case 13:
+            if (first == 'a') candidate = HTTP_HEADER_AUTHORIZATION;
+            else if (first == 'i') candidate = HTTP_HEADER_IF_NONE_MATCH;
+            break;
+        case 14:
+            if (first == 'c') candidate = HTTP_HEADER_CONTENT_LENGTH;
+            break;
+        case 15:
+            if (first == 'a') candidate = HTTP_HEADER_ACCEPT_ENCODING;
+            break;
+        case 17:
+            if (first == 't') candidate = HTTP_HEADER_TRANSFER_ENCODING;
+            else if (first == 'x') candidate = HTTP_HEADER_REQUEST_TIMEOUT;
+            break;
+    }
+    if (candidate == HTTP_HEADER_UNKNOWN) return candidate;
+    return strncasecmp(name, KNOWN_HEADER_NAMES[candidate], length) == 0
+           ? candidate : HTTP_HEADER_UNKNOWN;
+}
+
+const char* http_request_header(const HttpRequest* req, const char* name) {
+    HttpKnownHeader known = http_header_classify(name, strlen(name));
+    if (known != HTTP_HEADER_UNKNOWN) return req->known_headers[known];
+
+    for (size_t i = 0; i < req->header_count; i++) {
+        if (strcasecmp(req->header_keys[i], name) == 0) return req->header_values[i];
+    }
+    return NULL;
+}
+
+bool http_request_keep_alive(const HttpRequest* req) {
+    const char* connection = req->known_headers[HTTP_HEADER_CONNECTION];
+    if (connection) {
+        if (header_has_token(connection, "close")) return false;
+        if (header_has_token(connection, "keep-alive")) return true;
+    }
+    return !req->version || strcmp(req->version, "HTTP/1.0") != 0;
+}
+
 static char* strtrim(char* str) {
     if (!str) return NULL;
     
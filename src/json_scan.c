@@ -0,0 +1,292 @@
+#include "json_scan.h"
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+typedef struct {
+    const char* p;
+    JsonScanResult result;   // First problem found
+} Scanner;
+
+static bool fail(Scanner* s, JsonScanResult result) {
+    if (s->result == JSON_SCAN_OK) s->result = result;
+    return false;
+}
+
+static void skip_whitespace(Scanner* s) {
+    while (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r') s->p++;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool read_hex4(Scanner* s, uint32_t* value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value(s->p[i]);
+        if (digit < 0) return fail(s, JSON_SCAN_INVALID);
+        *value = (*value << 4) | (uint32_t)digit;
+    }
+    s->p += 4;
+    return true;
+}
+
+// Appends bytes to out when it is set, leaving room for the terminator
+static bool emit(Scanner* s, char* out, size_t size, size_t* length,
+                 const char* bytes, size_t count) {
+    if (!out) return true;
+    if (*length + count >= size) return fail(s, JSON_SCAN_UNSUPPORTED);
+    memcpy(out + *length, bytes, count);
+    *length += count;
+    return true;
+}
+
+static bool emit_codepoint(Scanner* s, char* out, size_t size, size_t* length, uint32_t cp) {
+    char utf8[4];
+    size_t count;
+    if (cp < 0x80) {
+        utf8[0] = (char)cp;
+        count = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = (char)(0xC0 | (cp >> 6));
+        utf8[1] = (char)(0x80 | (cp & 0x3F));
+        count = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = (char)(0xE0 | (cp >> 12));
+        utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[2] = (char)(0x80 | (cp & 0x3F));
+        count = 3;
+    } else {
+        utf8[0] = (char)(0xF0 | (cp >> 18));
+        utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[3] = (char)(0x80 | (cp & 0x3F));
+        count = 4;
+    }
+    return emit(s, out, size, length, utf8, count);
+}
+
+static bool scan_unicode_escape(Scanner* s, char* out, size_t size, size_t* length) {
+    uint32_t cp;
+    if (!read_hex4(s, &cp)) return false;
+
+    if (cp >= 0xD800 && cp <= 0xDBFF) {
+        uint32_t low;
+        if (s->p[0] != '\\' || s->p[1] != 'u') return fail(s, JSON_SCAN_UNSUPPORTED);
+        s->p += 2;
+        if (!read_hex4(s, &low)) return false;
+        if (low < 0xDC00 || low > 0xDFFF) return fail(s, JSON_SCAN_UNSUPPORTED);
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+    } else if ((cp >= 0xDC00 && cp <= 0xDFFF) || cp == 0) {
+        // A lone low surrogate, or a NUL a C string cannot hold
+        return fail(s, JSON_SCAN_UNSUPPORTED);
+    }
+    return emit_codepoint(s, out, size, length, cp);
+}
+
+// Reads the string starting at the opening quote, unescaping it into out
+// when out is set. *escaped tells whether it held any escapes.
+static bool scan_string(Scanner* s, char* out, size_t size, bool* escaped) {
+    size_t length = 0;
+    *escaped = false;
+    s->p++;
+
+    for (;;) {
+        // Copy plain runs in one go
+        const char* run = s->p;
+        while ((unsigned char)*s->p >= 0x20 && *s->p != '"' && *s->p != '\\') s->p++;
+        if (!emit(s, out, size, &length, run, (size_t)(s->p - run))) return false;
+
+        char c = *s->p;
+        if (c == '"') {
+            s->p++;
+            if (out) out[length] = '\0';
+            return true;
+        }
+        if (c != '\\') return fail(s, JSON_SCAN_INVALID);   // Control byte or end of input
+
+        *escaped = true;
+        char escape = s->p[1];
+        s->p += 2;
+        const char* plain = NULL;
+        switch (escape) {
+            case '"': plain = "\""; break;
+            case '\\': plain = "\\"; break;
+            case '/': plain = "/"; break;
+            case 'b': plain = "\b"; break;
+            case 'f': plain = "\f"; break;
+            case 'n': plain = "\n"; break;
+            case 'r': plain = "\r"; break;
+            case 't': plain = "\t"; break;
+            case 'u':
+                if (!scan_unicode_escape(s, out, size, &length)) return false;
+                continue;
+            default:
+                return fail(s, JSON_SCAN_INVALID);
+        }
+        if (!emit(s, out, size, &length, plain, 1)) return false;
+    }
+}
+
+static bool skip_digits(Scanner* s) {
+    if (*s->p < '0' || *s->p > '9') return fail(s, JSON_SCAN_INVALID);
+    while (*s->p >= '0' && *s->p <= '9') s->p++;
+    return true;
+}
+
+static bool skip_number(Scanner* s) {
+    if (*s->p == '-') s->p++;
+    if (*s->p == '0') {
+        s->p++;
+    } else if (!skip_digits(s)) {
+        return false;
+    }
+    if (*s->p == '.') {
+        s->p++;
+        if (!skip_digits(s)) return false;
+    }
+    if (*s->p == 'e' || *s->p == 'E') {
+        s->p++;
+        if (*s->p == '+' || *s->p == '-') s->p++;
+        if (!skip_digits(s)) return false;
+    }
+    return true;
+}
+
+static bool skip_literal(Scanner* s, const char* literal) {
+    size_t length = strlen(literal);
+    if (strncmp(s->p, literal, length) != 0) return fail(s, JSON_SCAN_INVALID);
+    s->p += length;
+    return true;
+}
+
+static bool skip_value(Scanner* s, int depth);
+
+// Steps over an object or array; open is the bracket at s->p
+static bool skip_container(Scanner* s, int depth, char close) {
+    if (depth >= JSON_SCAN_MAX_DEPTH) return fail(s, JSON_SCAN_UNSUPPORTED);
+    bool object = close == '}';
+    s->p++;
+    skip_whitespace(s);
+    if (*s->p == close) {
+        s->p++;
+        return true;
+    }
+
+    for (;;) {
+        if (object) {
+            bool escaped;
+            if (*s->p != '"') return fail(s, JSON_SCAN_INVALID);
+            if (!scan_string(s, NULL, 0, &escaped)) return false;
+            skip_whitespace(s);
+            if (*s->p != ':') return fail(s, JSON_SCAN_INVALID);
+            s->p++;
+            skip_whitespace(s);
+        }
+        if (!skip_value(s, depth + 1)) return false;
+        skip_whitespace(s);
+        if (*s->p == close) {
+            s->p++;
+            return true;
+        }
+        if (*s->p != ',') return fail(s, JSON_SCAN_INVALID);
+        s->p++;
+        skip_whitespace(s);
+    }
+}
+
+static bool skip_value(Scanner* s, int depth) {
+    bool escaped;
+    switch (*s->p) {
+        case '"': return scan_string(s, NULL, 0, &escaped);
+        case '{': return skip_container(s, depth, '}');
+        case '[': return skip_container(s, depth, ']');
+        case 't': return skip_literal(s, "true");
+        case 'f': return skip_literal(s, "false");
+        case 'n': return skip_literal(s, "null");
+        default:
+            if (*s->p == '-' || (*s->p >= '0' && *s->p <= '9')) return skip_number(s);
+            return fail(s, JSON_SCAN_INVALID);
+    }
+}
+
+// The wanted field named by the key at s->p, or NULL
+static JsonField* match_key(Scanner* s, JsonField* fields, size_t count) {
+    const char* key = s->p + 1;
+    bool escaped;
+    if (!scan_string(s, NULL, 0, &escaped)) return NULL;
+    size_t length = (size_t)(s->p - 1 - key);
+    if (escaped) {
+        // Escapes could spell any name; leave the comparison to cJSON
+        fail(s, JSON_SCAN_UNSUPPORTED);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t name_length = strlen(fields[i].name);
+        if (length != name_length || strncasecmp(key, fields[i].name, length) != 0) continue;
+        // cJSON matches keys without regard to case
+        if (memcmp(key, fields[i].name, length) != 0) {
+            fail(s, JSON_SCAN_UNSUPPORTED);
+            return NULL;
+        }
+        return &fields[i];
+    }
+    return NULL;
+}
+
+JsonScanResult json_scan_strings(const char* json, JsonField* fields, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        fields[i].found = false;
+    }
+    if (!json) return JSON_SCAN_INVALID;
+
+    Scanner scanner = {json, JSON_SCAN_OK};
+    Scanner* s = &scanner;
+    skip_whitespace(s);
+    if (*s->p != '{') return JSON_SCAN_INVALID;
+    s->p++;
+    skip_whitespace(s);
+
+    if (*s->p == '}') {
+        s->p++;
+    } else {
+        for (;;) {
+            if (*s->p != '"') return JSON_SCAN_INVALID;
+            JsonField* field = match_key(s, fields, count);
+            if (s->result != JSON_SCAN_OK) return s->result;
+            skip_whitespace(s);
+            if (*s->p != ':') return JSON_SCAN_INVALID;
+            s->p++;
+            skip_whitespace(s);
+
+            bool ok;
+            if (field && !field->found) {
+                bool escaped;
+                if (*s->p != '"') return JSON_SCAN_UNSUPPORTED;
+                ok = scan_string(s, field->value, field->size, &escaped);
+                field->found = ok;
+            } else {
+                ok = skip_value(s, 1);
+            }
+            if (!ok) return s->result;
+
+            skip_whitespace(s);
+            if (*s->p == '}') {
+                s->p++;
+                break;
+            }
+            if (*s->p != ',') return JSON_SCAN_INVALID;
+            s->p++;
+            skip_whitespace(s);
+        }
+    }
+
+    // cJSON_Parse ignores what follows the value; only whitespace is read here
+    skip_whitespace(s);
+    return *s->p == '\0' ? JSON_SCAN_OK : JSON_SCAN_UNSUPPORTED;
+}
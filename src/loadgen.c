@@ -0,0 +1,714 @@
+#define _GNU_SOURCE  // ppoll
+
+#include "http_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define MAX_REQUEST_SIZE 4096
+#define RECV_CHUNK_SIZE 4096
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_US 1000ULL
+#define TOKEN_SIZE 256
+// How long a finished run waits for the requests it still has in flight
+#define DRAIN_TIMEOUT_NS NS_PER_SEC
+
+// Log-linear latency histogram in microseconds: exact below 1024us, then
+// 512 sub-buckets per power of two (about 0.2% relative error).
+#define HISTOGRAM_SUB_BUCKET_BITS 10
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define HISTOGRAM_MAX_SHIFT 28
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + HISTOGRAM_MAX_SHIFT * HISTOGRAM_HALF_BUCKETS)
+
+typedef enum {
+    OP_GET_USERS,
+    OP_POST_USERS,
+    OP_LOGIN,
+    OP_SIGNUP,
+    OP_POST_BATCH,
+    OP_COUNT
+} OperationType;
+
+static const char* OPERATION_NAMES[OP_COUNT] = {"get", "post", "login", "signup", "batch"};
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum_us;
+    uint64_t max_us;
+} LatencyHistogram;
+
+typedef struct {
+    const char* ip;
+    int port;
+    char host[64];
+    unsigned threads;
+    unsigned connections;
+    double duration_s;
+    double rate;             // Requests per second across all threads, 0 = closed loop
+    unsigned mix[OP_COUNT];
+    unsigned mix_total;
+    bool keep_alive;
+    unsigned batch_records;  // Records per POST /users/batch
+    unsigned users;          // Distinct users GET/POST traffic is spread over
+    char username[64];
+    char password[64];
+    char (*tokens)[TOKEN_SIZE];   // One per user
+} LoadgenConfig;
+
+typedef enum {
+    CONN_IDLE,
+    CONN_SENDING,
+    CONN_RECEIVING
+} ConnectionState;
+
+typedef struct {
+    int fd;
+    ConnectionState state;
+    OperationType op;
+    const char* token;       // Of the user this connection acts as
+    char request[MAX_REQUEST_SIZE];
+    size_t request_length;
+    size_t sent;
+    char* response;
+    size_t response_length;
+    size_t response_capacity;
+    uint64_t intended_ns;    // When the request should have been sent
+    uint64_t sent_ns;        // When it was actually sent
+} LoadConnection;
+
+typedef struct {
+    unsigned id;
+    const LoadgenConfig* config;
+    LoadConnection* connections;
+    unsigned connection_count;
+    LatencyHistogram* latency;   // From intended send time
+    LatencyHistogram* service;   // From actual send time
+    uint64_t completed[OP_COUNT];
+    uint64_t non_2xx[OP_COUNT];
+    uint64_t errors;
+    uint64_t not_sent;
+    uint64_t timed_out;          // Still in flight when the run ended
+    uint64_t sequence;
+    uint64_t rng;
+    pthread_t thread;
+} LoadThread;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (size_t)value;
+
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    if (shift > HISTOGRAM_MAX_SHIFT) return HISTOGRAM_BUCKETS - 1;
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_HALF_BUCKETS +
+           ((value >> shift) - HISTOGRAM_HALF_BUCKETS);
+}
+
+// Highest value that maps to the bucket at index.
+static uint64_t histogram_value(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+    size_t offset = index - HISTOGRAM_SUB_BUCKETS;
+    unsigned shift = (unsigned)(offset / HISTOGRAM_HALF_BUCKETS) + 1;
+    uint64_t top = HISTOGRAM_HALF_BUCKETS + offset % HISTOGRAM_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static void histogram_record(LatencyHistogram* h, uint64_t value_us, uint64_t count) {
+    h->counts[histogram_index(value_us)] += count;
+    h->total += count;
+    h->sum_us += value_us * count;
+    if (value_us > h->max_us) h->max_us = value_us;
+}
+
+static void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum_us += from->sum_us;
+    if (from->max_us > into->max_us) into->max_us = from->max_us;
+}
+
+static uint64_t histogram_percentile(const LatencyHistogram* h, double percentile) {
+    if (h->total == 0) return 0;
+
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)h->total + 0.5);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+            return value < h->max_us ? value : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static uint64_t next_random(LoadThread* t) {
+    // xorshift64*
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ULL;
+}
+
+static OperationType pick_operation(LoadThread* t) {
+    uint64_t roll = next_random(t) % t->config->mix_total;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (roll < t->config->mix[op]) return (OperationType)op;
+        roll -= t->config->mix[op];
+    }
+    return OP_GET_USERS;
+}
+
+static void close_connection(LoadConnection* conn) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_IDLE;
+}
+
+static bool build_request(LoadThread* t, LoadConnection* conn) {
+    const LoadgenConfig* config = t->config;
+    char text[128];
+    char username[96];
+    char batch[MAX_REQUEST_SIZE];
+    int length = -1;
+
+    conn->op = pick_operation(t);
+    t->sequence++;
+
+    switch (conn->op) {
+        case OP_GET_USERS:
+            length = http_client_build_get_users(conn->request, sizeof(conn->request), config->host,
+                                                 conn->token, config->keep_alive);
+            break;
+        case OP_POST_USERS:
+            snprintf(text, sizeof(text), "loadgen thread %u record %llu",
+                     t->id, (unsigned long long)t->sequence);
+            length = http_client_build_post_users(conn->request, sizeof(conn->request), config->host,
+                                                  conn->token, text, config->keep_alive);
+            break;
+        case OP_LOGIN:
+            length = http_client_build_login(conn->request, sizeof(conn->request), config->host,
+                                             config->username, config->password, config->keep_alive);
+            break;
+        case OP_SIGNUP:
+            snprintf(username, sizeof(username), "%s_%u_%llu",
+                     config->username, t->id, (unsigned long long)t->sequence);
+            length = http_client_build_signup(conn->request, sizeof(conn->request), config->host,
+                                              username, config->password, config->keep_alive);
+            break;
+        case OP_POST_BATCH: {
+            size_t used = 0;
+            for (unsigned i = 0; i < config->batch_records && used < sizeof(batch); i++) {
+                int written = snprintf(batch + used, sizeof(batch) - used,
+                                       "\"loadgen thread %u record %llu.%u\"\n",
+                                       t->id, (unsigned long long)t->sequence, i);
+                if (written < 0) break;
+                used += (size_t)written;
+            }
+            if (used >= sizeof(batch)) break;
+            length = http_client_build_post_batch(conn->request, sizeof(conn->request), config->host,
+                                                  conn->token, batch, config->keep_alive);
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (length < 0) return false;
+    conn->request_length = (size_t)length;
+    conn->sent = 0;
+    conn->response_length = 0;
+    return true;
+}
+
+static bool start_request(LoadThread* t, LoadConnection* conn, uint64_t intended_ns) {
+    if (conn->fd < 0) {
+        conn->fd = http_client_connect(t->config->ip, t->config->port);
+        if (conn->fd < 0) return false;
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    if (!build_request(t, conn)) return false;
+
+    conn->intended_ns = intended_ns;
+    conn->sent_ns = now_ns();
+    conn->state = CONN_SENDING;
+    return true;
+}
+
+static void finish_request(LoadThread* t, LoadConnection* conn, const HttpClientResponse* response) {
+    uint64_t done = now_ns();
+    histogram_record(t->latency, (done - conn->intended_ns) / NS_PER_US, 1);
+    histogram_record(t->service, (done - conn->sent_ns) / NS_PER_US, 1);
+
+    t->completed[conn->op]++;
+    if (response->status < 200 || response->status >= 300) t->non_2xx[conn->op]++;
+
+    if (response->keep_alive) conn->state = CONN_IDLE;
+    else close_connection(conn);
+}
+
+static void handle_send(LoadThread* t, LoadConnection* conn) {
+    ssize_t n = send(conn->fd, conn->request + conn->sent,
+                     conn->request_length - conn->sent, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        t->errors++;
+        close_connection(conn);
+        return;
+    }
+
+    conn->sent += (size_t)n;
+    if (conn->sent == conn->request_length) conn->state = CONN_RECEIVING;
+}
+
+static void handle_receive(LoadThread* t, LoadConnection* conn) {
+    if (conn->response_capacity - conn->response_length < RECV_CHUNK_SIZE) {
+        size_t capacity = conn->response_capacity ? conn->response_capacity * 2 : RECV_CHUNK_SIZE * 2;
+        char* grown = (char*)realloc(conn->response, capacity);
+        if (!grown) {
+            t->errors++;
+            close_connection(conn);
+            return;
+        }
+        conn->response = grown;
+        conn->response_capacity = capacity;
+    }
+
+    ssize_t n = recv(conn->fd, conn->response + conn->response_length,
+                     conn->response_capacity - conn->response_length, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+    bool at_eof = n <= 0;
+    if (n > 0) conn->response_length += (size_t)n;
+
+    HttpClientResponse response;
+    long parsed = http_client_parse_response(conn->response, conn->response_length, at_eof, &response);
+    if (parsed > 0) {
+        finish_request(t, conn, &response);
+        http_client_response_free(&response);
+        if (at_eof) close_connection(conn);
+    } else if (parsed < 0 || at_eof) {
+        t->errors++;
+        close_connection(conn);
+    }
+}
+
+static void* load_thread_main(void* arg) {
+    LoadThread* t = (LoadThread*)arg;
+    const LoadgenConfig* config = t->config;
+    bool open_loop = config->rate > 0;
+
+    struct pollfd* fds = (struct pollfd*)calloc(t->connection_count, sizeof(struct pollfd));
+    unsigned* fd_owner = (unsigned*)calloc(t->connection_count, sizeof(unsigned));
+    if (!fds || !fd_owner) {
+        free(fds);
+        free(fd_owner);
+        return NULL;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(config->duration_s * NS_PER_SEC);
+    uint64_t interval = open_loop ? (uint64_t)((double)config->threads * NS_PER_SEC / config->rate) : 0;
+    uint64_t issued = 0;
+
+    uint64_t drain_end = end + DRAIN_TIMEOUT_NS;
+
+    for (uint64_t now = start; now < drain_end; now = now_ns()) {
+        // Hand due requests to idle connections. In open-loop mode, requests
+        // follow a fixed schedule and latency counts from the scheduled time.
+        // After the end only the responses still in flight are awaited.
+        bool running = now < end;
+        uint64_t due = !running ? 0 : open_loop ? (now - start) / interval + 1 : UINT64_MAX;
+        for (unsigned i = 0; i < t->connection_count && issued < due; i++) {
+            LoadConnection* conn = &t->connections[i];
+            if (conn->state != CONN_IDLE) continue;
+
+            uint64_t intended = open_loop ? start + issued * interval : now;
+            issued++;
+            if (!start_request(t, conn, intended)) {
+                t->errors++;
+                close_connection(conn);
+            }
+        }
+
+        nfds_t nfds = 0;
+        for (unsigned i = 0; i < t->connection_count; i++) {
+            LoadConnection* conn = &t->connections[i];
+            if (conn->state == CONN_IDLE) continue;
+            fds[nfds].fd = conn->fd;
+            fds[nfds].events = conn->state == CONN_SENDING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            fd_owner[nfds++] = i;
+        }
+
+        // Behind schedule, every connection is busy and only a finished send
+        // or response frees one, so the wait is for that rather than the
+        // next scheduled time, which has already passed
+        uint64_t wake = running ? end : drain_end;
+        uint64_t next = start + issued * interval;
+        if (!running) {
+            if (nfds == 0) break;
+        } else if (open_loop && next > now) {
+            if (next < wake) wake = next;
+        } else if (nfds == 0) {
+            // Every connection failed; back off instead of spinning.
+            wake = now + NS_PER_SEC / 100;
+        }
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec timeout = {(time_t)(wait / NS_PER_SEC), (long)(wait % NS_PER_SEC)};
+
+        int ready = ppoll(fds, nfds, &timeout, NULL);
+        if (ready <= 0) continue;
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (!fds[i].revents) continue;
+            LoadConnection* conn = &t->connections[fd_owner[i]];
+            if (conn->state == CONN_SENDING) handle_send(t, conn);
+            else if (conn->state == CONN_RECEIVING) handle_receive(t, conn);
+        }
+    }
+
+    if (open_loop) {
+        uint64_t scheduled = (end - start) / interval;
+        t->not_sent = scheduled > issued ? scheduled - issued : 0;
+    }
+
+    // Requests still unanswered are the slowest of the run; leaving them
+    // out would hide a stall, so they count with the time they had waited
+    uint64_t stopped = now_ns();
+    for (unsigned i = 0; i < t->connection_count; i++) {
+        LoadConnection* conn = &t->connections[i];
+        if (conn->state != CONN_IDLE) {
+            histogram_record(t->latency, (stopped - conn->intended_ns) / NS_PER_US, 1);
+            histogram_record(t->service, (stopped - conn->sent_ns) / NS_PER_US, 1);
+            t->timed_out++;
+        }
+        close_connection(conn);
+    }
+    free(fds);
+    free(fd_owner);
+    return NULL;
+}
+
+// A rate in requests per second; 0 keeps the closed loop
+static bool parse_rate(const char* text, double* rate) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(value) || value < 0) {
+        fprintf(stderr, "Invalid rate: %s\n", text);
+        return false;
+    }
+    *rate = value;
+    return true;
+}
+
+static bool parse_mix(LoadgenConfig* config, const char* spec) {
+    memset(config->mix, 0, sizeof(config->mix));
+    config->mix_total = 0;
+
+    char* copy = strdup(spec);
+    if (!copy) return false;
+
+    bool ok = true;
+    char* saveptr = NULL;
+    for (char* item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char* eq = strchr(item, '=');
+        if (!eq) {
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+
+        int op;
+        for (op = 0; op < OP_COUNT; op++) {
+            if (strcmp(item, OPERATION_NAMES[op]) == 0) break;
+        }
+        if (op == OP_COUNT) {
+            ok = false;
+            break;
+        }
+        config->mix[op] = (unsigned)atoi(eq + 1);
+        config->mix_total += config->mix[op];
+    }
+
+    free(copy);
+    return ok && config->mix_total > 0;
+}
+
+// Registers and logs in one of the users whose tokens GET/POST traffic
+// will use. User 0 is config->username, the one login requests use.
+static bool prepare_session(LoadgenConfig* config, unsigned user) {
+    char request[MAX_REQUEST_SIZE];
+    char username[96];
+    char* token_out = config->tokens[user];
+    HttpClientResponse response;
+
+    if (user == 0) {
+        snprintf(username, sizeof(username), "%s", config->username);
+    } else {
+        snprintf(username, sizeof(username), "%s_u%u", config->username, user);
+    }
+
+    int fd = http_client_connect(config->ip, config->port);
+    if (fd < 0) return false;
+    bool ok = http_client_build_signup(request, sizeof(request), config->host,
+                                       username, config->password, false) > 0 &&
+              http_client_send_all(fd, request, strlen(request)) &&
+              http_client_read_response(fd, &response);
+    close(fd);
+    if (!ok) return false;
+    http_client_response_free(&response);
+
+    fd = http_client_connect(config->ip, config->port);
+    if (fd < 0) return false;
+    ok = http_client_build_login(request, sizeof(request), config->host,
+                                 username, config->password, false) > 0 &&
+         http_client_send_all(fd, request, strlen(request)) &&
+         http_client_read_response(fd, &response);
+    close(fd);
+    if (!ok) return false;
+
+    const char* token = response.status == 200 ? strstr(response.body, "\"token\":\"") : NULL;
+    if (token) {
+        token += strlen("\"token\":\"");
+        size_t length = strcspn(token, "\"");
+        if (length < TOKEN_SIZE) {
+            memcpy(token_out, token, length);
+            token_out[length] = '\0';
+        } else {
+            token = NULL;
+        }
+    }
+    http_client_response_free(&response);
+    return token != NULL;
+}
+
+static void print_latency_row(const char* label, const LatencyHistogram* h) {
+    printf("  %-10s %10.3f %10.3f %10.3f %10.3f %10.3f\n", label,
+           histogram_percentile(h, 50.0) / 1000.0,
+           histogram_percentile(h, 99.0) / 1000.0,
+           histogram_percentile(h, 99.9) / 1000.0,
+           h->max_us / 1000.0,
+           h->total ? (double)h->sum_us / h->total / 1000.0 : 0.0);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -a IP        server address (default %s)\n"
+        "  -p PORT      server port (default %d)\n"
+        "  -t THREADS   worker threads (default 2)\n"
+        "  -c CONNS     total connections (default 8)\n"
+        "  -d SECONDS   test duration (default 10)\n"
+        "  -R RATE      open loop at RATE req/s total (default 0 = closed loop)\n"
+        "  -m MIX       weighted mix, e.g. get=70,post=20,login=8,signup=2,batch=0\n"
+        "  -b RECORDS   records per batch request (default 16)\n"
+        "  -u USERS     spread GET/POST traffic over this many users (default 1)\n"
+        "  -C           send Connection: close instead of keep-alive\n",
+        program, HTTP_CLIENT_DEFAULT_IP, HTTP_CLIENT_DEFAULT_PORT);
+}
+
+int main(int argc, char** argv) {
+    LoadgenConfig config;
+    memset(&config, 0, sizeof(config));
+    config.ip = HTTP_CLIENT_DEFAULT_IP;
+    config.port = HTTP_CLIENT_DEFAULT_PORT;
+    config.threads = 2;
+    config.connections = 8;
+    config.duration_s = 10.0;
+    config.keep_alive = true;
+    config.batch_records = 16;
+    config.users = 1;
+    parse_mix(&config, "get=70,post=20,login=8,signup=2");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:t:c:d:R:m:b:u:Ch")) != -1) {
+        switch (opt) {
+            case 'a': config.ip = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 't': config.threads = (unsigned)atoi(optarg); break;
+            case 'c': config.connections = (unsigned)atoi(optarg); break;
+            case 'd': config.duration_s = atof(optarg); break;
+            case 'R':
+                if (!parse_rate(optarg, &config.rate)) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (!parse_mix(&config, optarg)) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b': config.batch_records = (unsigned)atoi(optarg); break;
+            case 'u': config.users = (unsigned)atoi(optarg); break;
+            case 'C': config.keep_alive = false; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.threads == 0 || config.connections < config.threads || config.duration_s <= 0) {
+        fprintf(stderr, "Need at least one connection per thread and a positive duration\n");
+        return 1;
+    }
+    // Each thread sends every threads * 1s / rate; below 1ns that rounds to 0
+    if (config.rate > 0 && (double)config.threads * NS_PER_SEC / config.rate < 1.0) {
+        fprintf(stderr, "Rate too high: at most %.0f req/s with %u threads\n",
+                (double)config.threads * NS_PER_SEC, config.threads);
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (config.batch_records == 0) {
+        fprintf(stderr, "Need at least one record per batch\n");
+        return 1;
+    }
+    if (config.users == 0 || config.users > config.connections) {
+        fprintf(stderr, "Need between 1 and one user per connection\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(config.host, sizeof(config.host), "%s:%d", config.ip, config.port);
+    snprintf(config.username, sizeof(config.username), "loadgen_%d", (int)getpid());
+    snprintf(config.password, sizeof(config.password), "loadgen");
+
+    config.tokens = (char (*)[TOKEN_SIZE])calloc(config.users, TOKEN_SIZE);
+    if (!config.tokens) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (unsigned i = 0; i < config.users; i++) {
+        if (!prepare_session(&config, i)) {
+            fprintf(stderr, "Failed to sign up and log in the load generator users\n");
+            return 1;
+        }
+    }
+
+    LoadThread* threads = (LoadThread*)calloc(config.threads, sizeof(LoadThread));
+    LoadConnection* connections = (LoadConnection*)calloc(config.connections, sizeof(LoadConnection));
+    if (!threads || !connections) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    unsigned next_connection = 0;
+    for (unsigned i = 0; i < config.threads; i++) {
+        LoadThread* t = &threads[i];
+        t->id = i;
+        t->config = &config;
+        t->connection_count = config.connections / config.threads +
+                              (i < config.connections % config.threads ? 1 : 0);
+        t->connections = &connections[next_connection];
+        next_connection += t->connection_count;
+        t->rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (uint64_t)getpid();
+        t->latency = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+        t->service = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+        if (!t->latency || !t->service) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (unsigned c = 0; c < t->connection_count; c++) {
+            t->connections[c].fd = -1;
+            t->connections[c].state = CONN_IDLE;
+            t->connections[c].token = config.tokens[(next_connection - t->connection_count + c) %
+                                                    config.users];
+        }
+    }
+
+    uint64_t started = now_ns();
+    for (unsigned i = 0; i < config.threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, load_thread_main, &threads[i]) != 0) {
+            perror("Failed to create load thread");
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double elapsed = (double)(now_ns() - started) / NS_PER_SEC;
+
+    LatencyHistogram* latency = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    LatencyHistogram* service = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    if (!latency || !service) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint64_t completed[OP_COUNT] = {0}, non_2xx[OP_COUNT] = {0};
+    uint64_t total = 0, total_non_2xx = 0, errors = 0, not_sent = 0, timed_out = 0;
+    for (unsigned i = 0; i < config.threads; i++) {
+        histogram_merge(latency, threads[i].latency);
+        histogram_merge(service, threads[i].service);
+        for (int op = 0; op < OP_COUNT; op++) {
+            completed[op] += threads[i].completed[op];
+            non_2xx[op] += threads[i].non_2xx[op];
+            total += threads[i].completed[op];
+            total_non_2xx += threads[i].non_2xx[op];
+        }
+        errors += threads[i].errors;
+        not_sent += threads[i].not_sent;
+        timed_out += threads[i].timed_out;
+    }
+
+    if (config.rate > 0) {
+        printf("Mode: open loop at %.1f req/s", config.rate);
+    } else {
+        printf("Mode: closed loop");
+    }
+    printf(", %u threads, %u connections, %.1fs\n", config.threads, config.connections, elapsed);
+    printf("Requests: %llu completed, %llu non-2xx, %llu errors, %llu timed out, %llu not sent\n",
+           (unsigned long long)total, (unsigned long long)total_non_2xx,
+           (unsigned long long)errors, (unsigned long long)timed_out, (unsigned long long)not_sent);
+    printf("Throughput: %.1f req/s\n", total / elapsed);
+    printf("Latency (ms)        p50        p99       p999        max       mean\n");
+    // Open-loop latency counts from the schedule, so time a request spent
+    // waiting for a connection is included. A closed loop has no schedule
+    // to correct against: its requests go out whenever a connection frees up.
+    if (config.rate > 0) print_latency_row("corrected", latency);
+    print_latency_row("service", service);
+    printf("Operations:");
+    for (int op = 0; op < OP_COUNT; op++) {
+        printf(" %s=%llu/%llu", OPERATION_NAMES[op],
+               (unsigned long long)completed[op], (unsigned long long)non_2xx[op]);
+    }
+    printf(" (completed/non-2xx)\n");
+
+    for (unsigned i = 0; i < config.threads; i++) {
+        free(threads[i].latency);
+        free(threads[i].service);
+    }
+    for (unsigned i = 0; i < config.connections; i++) {
+        free(connections[i].response);
+    }
+    free(threads);
+    free(connections);
+    free(config.tokens);
+    free(latency);
+    free(service);
+    return 0;
+}
@@ -2,29 +2,68 @@
 #include "debug_macros.h"
 #include "auth.h"
 #include "cJSON.h"
+#include "compression.h"
+#include "profiled_mutex.h"
+#include "json_scan.h"
+#include "trace.h"
+#include "flight_recorder.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <time.h>
 
-static void process_single_message(MessageProcessor* mp);
+// Longer credentials are read by cJSON instead
+#define CREDENTIAL_USERNAME_SIZE (AUTH_USERNAME_MAX + 1)
+#define CREDENTIAL_PASSWORD_SIZE 256
+
+// Sent instead of running a request that waited past its deadline. The
+// client has most likely given up, so the connection is closed too.
+static const char EXPIRED_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 15\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n\r\n"
+    "Request expired";
+
+static void process_batch(MessageProcessor* mp);
 static char* create_response(const char* status, const char* content_type, 
                            const char* body, const char* connection);
-static char* create_error_response(const char* status, const char* message);
-static bool verify_auth(HttpRequest* request, ThreadSafeData* tsd);
+static char* create_body_response(const char* status, const char* content_type,
+                                  const char* extra_headers, const char* body,
+                                  size_t body_length, const char* connection,
+                                  size_t* response_length);
+static char* create_error_response(const char* status, const char* message,
+                                   const char* connection);
+static bool verify_auth(HttpRequest* request, ThreadSafeData* tsd, char* user);
+static char* handle_get_users(MessageProcessor* mp, HttpRequest* request, const char* user,
+                              const char* connection, size_t* response_length);
+static char* handle_post_users_batch(MessageProcessor* mp, HttpRequest* request,
+                                     const char* user, const char* connection);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
 void message_processor_init(MessageProcessor* mp, MessageQueue* queue, 
                           ThreadSafeData* data) {
     mp->queue = queue;
     mp->shared_data = data;
     mp->running = true;
+    mp->draining = NULL;
+    atomic_init(&mp->expired, 0);
 }
 
 void message_processor_start(MessageProcessor* mp) {
     while (mp->running) {
-        process_single_message(mp);
+        process_batch(mp);
     }
 }
 
@@ -32,7 +71,9 @@ void message_processor_stop(MessageProcessor* mp) {
     mp->running = false;
 }
 
-static bool verify_auth(HttpRequest* request, ThreadSafeData* tsd) {
+// Sets user to the authenticated username, or to "" for signup and login
+static bool verify_auth(HttpRequest* request, ThreadSafeData* tsd, char* user) {
+    user[0] = '\0';
     // Skip auth for signup and login
     if ((strcmp(request->method, "POST") == 0 && 
         (strcmp(request->path, "/signup") == 0 || strcmp(request->path, "/login") == 0))) {
@@ -40,113 +81,411 @@ static bool verify_auth(HttpRequest* request, ThreadSafeData* tsd) {
     }
     
     // Check Authorization header
-    for (size_t i = 0; i < request->header_count; i++) {
-        if (strcasecmp(request->header_keys[i], "Authorization") == 0) {
-            return auth_verify_token(request->header_values[i], tsd);
-        }
+    const char* authorization = http_request_known_header(request, HTTP_HEADER_AUTHORIZATION);
+    return authorization && auth_verify_token(authorization, tsd, user);
+}
+
+// Strong ETag for one representation of a text generation: the encoding is
+// part of the tag, since gzip and identity bodies differ byte for byte.
+static void format_etag(char* buffer, size_t size, unsigned long epoch,
+                        unsigned long generation, ContentEncoding encoding) {
+    const char* name = compression_encoding_name(encoding);
+    snprintf(buffer, size, "\"%lx-%lx%s%s\"", epoch, generation,
+             name ? "-" : "", name ? name : "");
+}
+
+// Whether If-None-Match lists etag, the tag of the representation the
+// request would get. The weak comparison RFC 9110 requires ignores only W/;
+// the rest of each tag, encoding included, must match exactly.
+static bool etag_matches(const char* if_none_match, const char* etag) {
+    size_t etag_length = strlen(etag);
+    const char* tag = if_none_match;
+    while (*tag) {
+        while (*tag == ' ' || *tag == '\t' || *tag == ',') tag++;
+        if (*tag == '*') return true;
+        if (strncmp(tag, "W/", 2) == 0) tag += 2;
+        if (*tag != '"') break;
+
+        const char* end = strchr(tag + 1, '"');
+        if (!end) break;
+        size_t length = (size_t)(end + 1 - tag);
+        if (length == etag_length && memcmp(tag, etag, length) == 0) return true;
+        tag = end + 1;
     }
     return false;
 }
 
-static void process_single_message(MessageProcessor* mp) {
-    int client_fd;
-    char* raw_request;
-    
-    if (!message_queue_pop(mp->queue, &client_fd, &raw_request)) {
-        DEBUG_PRINT("Queue pop failed or shutdown\n");
-        return;
+// Serves the caller's own data only, so its cost does not depend on
+// anyone else's
+static char* handle_get_users(MessageProcessor* mp, HttpRequest* request, const char* user,
+                              const char* connection, size_t* response_length) {
+    ThreadSafeData* tsd = mp->shared_data;
+    ContentEncoding encoding =
+        compression_negotiate(http_request_known_header(request, HTTP_HEADER_ACCEPT_ENCODING));
+    char etag[64];
+    char headers[160];
+
+    // Answered from the in-memory generation and compression cache, without
+    // reading the file. A negotiated encoding that does not pay off is
+    // served as identity, so the tag is the identity one then.
+    const char* if_none_match = http_request_known_header(request, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match) {
+        unsigned long generation = 0;
+        ContentEncoding served = encoding;
+        if (served == ENCODING_IDENTITY ||
+            !tsd_read_text_encoded(tsd, user, served, NULL, NULL, &generation)) {
+            served = ENCODING_IDENTITY;
+            generation = tsd_text_generation(tsd, user);
+        }
+        format_etag(etag, sizeof(etag), tsd->text_epoch, generation, served);
+        if (etag_matches(if_none_match, etag)) {
+            int length = snprintf(NULL, 0,
+                "HTTP/1.1 304 Not Modified\r\n"
+                "ETag: %s\r\n"
+                "Vary: Accept-Encoding\r\n"
+                "Connection: %s\r\n\r\n",
+                etag, connection);
+            char* response = (char*)malloc((size_t)length + 1);
+            if (!response) return NULL;
+            sprintf(response,
+                "HTTP/1.1 304 Not Modified\r\n"
+                "ETag: %s\r\n"
+                "Vary: Accept-Encoding\r\n"
+                "Connection: %s\r\n\r\n",
+                etag, connection);
+            *response_length = (size_t)length;
+            return response;
+        }
     }
 
-    HttpParseResult parse_result = http_parse_request(raw_request);
-    free(raw_request);
-    
-    char* response = NULL;
-    
-    if (!parse_result.success) {
-        response = create_error_response("400 Bad Request", "Bad Request");
-    } else {
-        HttpRequest* request = &parse_result.request;
-        
-        // Verify authentication for protected routes
-        if (!verify_auth(request, mp->shared_data)) {
-            response = create_error_response("401 Unauthorized", "Authentication required");
+    unsigned long generation = 0;
+    char* encoded = NULL;
+    size_t encoded_length = 0;
+    if (encoding != ENCODING_IDENTITY &&
+        tsd_read_text_encoded(tsd, user, encoding, &encoded, &encoded_length, &generation)) {
+        format_etag(etag, sizeof(etag), tsd->text_epoch, generation, encoding);
+        snprintf(headers, sizeof(headers),
+                 "Content-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\n",
+                 compression_encoding_name(encoding), etag);
+        char* response = create_body_response("200 OK", "text/plain", headers, encoded,
+                                              encoded_length, connection, response_length);
+        free(encoded);
+        return response;
+    }
+
+    char* text_data = tsd_read_text_version(tsd, user, &generation);
+    const char* body = text_data ? text_data : "";
+    format_etag(etag, sizeof(etag), tsd->text_epoch, generation, ENCODING_IDENTITY);
+    snprintf(headers, sizeof(headers), "Vary: Accept-Encoding\r\nETag: %s\r\n", etag);
+    char* response = create_body_response("200 OK", "text/plain", headers, body, strlen(body),
+                                          connection, response_length);
+    free(text_data);
+    return response;
+}
+
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} BatchRecords;
+
+static void batch_records_free(BatchRecords* records) {
+    for (size_t i = 0; i < records->count; i++) {
+        free(records->items[i]);
+    }
+    free(records->items);
+}
+
+// Takes ownership of record. Records become lines of the data file, so one
+// that spans lines is rejected.
+static bool batch_records_add(BatchRecords* records, char* record) {
+    if (!record || strchr(record, '\n')) {
+        free(record);
+        return false;
+    }
+    if (records->count == records->capacity) {
+        size_t capacity = records->capacity ? records->capacity * 2 : 64;
+        char** items = (char**)realloc(records->items, capacity * sizeof(char*));
+        if (!items) {
+            free(record);
+            return false;
         }
-        else if (strcmp(request->method, "GET") == 0 && 
-            strcmp(request->path, "/users") == 0) {
-            char* text_data = tsd_read_text(mp->shared_data);
-            const char* connection = "close";
-            for (size_t i = 0; i < request->header_count; i++) {
-                if (strcasecmp(request->header_keys[i], "Connection") == 0) {
-                    connection = request->header_values[i];
-                    break;
-                }
+        records->items = items;
+        records->capacity = capacity;
+    }
+    records->items[records->count++] = record;
+    return true;
+}
+
+// A JSON string is stored as its text, like a POST /users body; any other
+// value in compact JSON form.
+static char* batch_record_text(const cJSON* item) {
+    if (cJSON_IsString(item)) return strdup(item->valuestring);
+    return cJSON_PrintUnformatted(item);
+}
+
+// One record per non-blank line. Returns 0 on success, or the 1-based
+// number of the first record that is not valid JSON.
+static size_t parse_ndjson_batch(const char* body, BatchRecords* records) {
+    const char* line = body;
+    while (*line) {
+        const char* end = strchr(line, '\n');
+        if (!end) end = line + strlen(line);
+        const char* next = *end ? end + 1 : end;
+
+        while (line < end && isspace((unsigned char)*line)) line++;
+        while (end > line && isspace((unsigned char)end[-1])) end--;
+        if (line < end) {
+            const char* parse_end = NULL;
+            cJSON* item = cJSON_ParseWithLengthOpts(line, (size_t)(end - line), &parse_end, false);
+            bool valid = item && parse_end == end;
+            char* record = NULL;
+            if (valid) {
+                record = cJSON_IsString(item) ? strdup(item->valuestring)
+                                              : strndup(line, (size_t)(end - line));
             }
-            
-            response = create_response("200 OK", "text/plain", text_data ? text_data : "", connection);
-            if (text_data) free(text_data);
+            cJSON_Delete(item);
+            if (!valid || !batch_records_add(records, record)) return records->count + 1;
         }
-        else if (strcmp(request->method, "POST") == 0 && 
-                 strcmp(request->path, "/users") == 0) {
-            if (!request->body || !*request->body) {
-                response = create_error_response("400 Bad Request", "Missing request body");
+        line = next;
+    }
+    return 0;
+}
+
+// One record per element of a top-level array. Returns 0 on success, or
+// the 1-based number of the first record that cannot be stored.
+static size_t parse_array_batch(const char* body, BatchRecords* records) {
+    cJSON* array = cJSON_Parse(body);
+    if (!cJSON_IsArray(array)) {
+        cJSON_Delete(array);
+        return 1;
+    }
+
+    size_t failed = 0;
+    const cJSON* item = NULL;
+    cJSON_ArrayForEach(item, array) {
+        if (!batch_records_add(records, batch_record_text(item))) {
+            failed = records->count + 1;
+            break;
+        }
+    }
+    cJSON_Delete(array);
+    return failed;
+}
+
+// NDJSON unless the client says it sent JSON or, with no Content-Type,
+// the body opens with an array.
+static bool batch_is_array(const HttpRequest* request) {
+    const char* content_type = http_request_known_header(request, HTTP_HEADER_CONTENT_TYPE);
+    if (content_type) {
+        return strncasecmp(content_type, "application/json", 16) == 0 &&
+               (content_type[16] == '\0' || content_type[16] == ';' ||
+                isspace((unsigned char)content_type[16]));
+    }
+    const char* first = request->body;
+    while (isspace((unsigned char)*first)) first++;
+    return *first == '[';
+}
+
+// Stores every record of the body with one storage operation, or none of
+// them if any record is invalid, and answers with one status for the lot.
+static char* handle_post_users_batch(MessageProcessor* mp, HttpRequest* request,
+                                     const char* user, const char* connection) {
+    if (!request->body || !*request->body) {
+        return create_error_response("400 Bad Request", "Missing request body", connection);
+    }
+
+    BatchRecords records = {NULL, 0, 0};
+    size_t failed = batch_is_array(request) ? parse_array_batch(request->body, &records)
+                                            : parse_ndjson_batch(request->body, &records);
+    char message[96];
+    char* response;
+
+    if (failed) {
+        snprintf(message, sizeof(message), "Invalid record %zu", failed);
+        response = create_error_response("400 Bad Request", message, connection);
+    } else if (records.count == 0) {
+        response = create_error_response("400 Bad Request", "Empty batch", connection);
+    } else if (tsd_write_text_batch(mp->shared_data, user, (const char* const*)records.items,
+                                    records.count)) {
+        snprintf(message, sizeof(message), "{\"status\":\"success\",\"stored\":%zu}",
+                 records.count);
+        response = create_response("201 Created", "application/json", message, connection);
+    } else {
+        response = create_error_response("500 Internal Server Error", "Failed to save data", connection);
+    }
+
+    batch_records_free(&records);
+    return response;
+}
+
+// Username and password from a signup or login body. Either may be NULL
+// when the body lacks it or it is not a string.
+typedef struct {
+    const char* username;
+    const char* password;
+    char username_buffer[CREDENTIAL_USERNAME_SIZE];
+    char password_buffer[CREDENTIAL_PASSWORD_SIZE];
+    cJSON* json;            // Set when the fallback parser was needed
+} Credentials;
+
+// Reads the two fields in place with the scanner, and builds a cJSON tree
+// only for bodies it leaves to cJSON. False if the body is not JSON.
+static bool credentials_parse(Credentials* credentials, const char* body) {
+    JsonField fields[2] = {
+        {"username", credentials->username_buffer, sizeof(credentials->username_buffer), false},
+        {"password", credentials->password_buffer, sizeof(credentials->password_buffer), false},
+    };
+    credentials->json = NULL;
+
+    if (json_scan_strings(body, fields, 2) == JSON_SCAN_OK) {
+        credentials->username = fields[0].found ? credentials->username_buffer : NULL;
+        credentials->password = fields[1].found ? credentials->password_buffer : NULL;
+        return true;
+    }
+
+    credentials->json = cJSON_Parse(body);
+    if (!credentials->json) return false;
+    cJSON* username_obj = cJSON_GetObjectItem(credentials->json, "username");
+    cJSON* password_obj = cJSON_GetObjectItem(credentials->json, "password");
+    credentials->username = username_obj ? username_obj->valuestring : NULL;
+    credentials->password = password_obj ? password_obj->valuestring : NULL;
+    return true;
+}
+
+static void credentials_free(Credentials* credentials) {
+    cJSON_Delete(credentials->json);
+    credentials->json = NULL;
+}
+
+MessageClass message_processor_classify(const HttpRequest* request) {
+    if (strcmp(request->method, "GET") == 0) return MESSAGE_CLASS_READ;
+    if (strcmp(request->method, "POST") == 0 &&
+        (strcmp(request->path, "/signup") == 0 || strcmp(request->path, "/login") == 0)) {
+        return MESSAGE_CLASS_AUTH;
+    }
+    return MESSAGE_CLASS_WRITE;
+}
+
+char* message_processor_respond(MessageProcessor* mp, HttpRequest* request, bool keep_alive,
+                                size_t* response_length_out) {
+    const char* connection = keep_alive ? "keep-alive" : "close";
+    char* response = NULL;
+    size_t response_length = 0;   // Set for bodies that may hold NUL bytes
+    
+    // Verify authentication for protected routes
+    char user[AUTH_USERNAME_MAX + 1];
+    if (!verify_auth(request, mp->shared_data, user)) {
+        response = create_error_response("401 Unauthorized", "Authentication required", connection);
+    }
+    else if (strcmp(request->method, "GET") == 0 && 
+        strcmp(request->path, "/users") == 0) {
+        response = handle_get_users(mp, request, user, connection, &response_length);
+    }
+    else if (strcmp(request->method, "POST") == 0 && 
+             strcmp(request->path, "/users") == 0) {
+        if (!request->body || !*request->body) {
+            response = create_error_response("400 Bad Request", "Missing request body", connection);
+        } else {
+            if (tsd_write_text(mp->shared_data, user, request->body)) {
+                response = create_response("201 Created", "text/plain", "Data saved successfully", connection);
             } else {
-                if (tsd_write_text(mp->shared_data, request->body)) {
-                    response = create_response("201 Created", "text/plain", "Data saved successfully", "close");
-                } else {
-                    response = create_error_response("500 Internal Server Error", "Failed to save data");
-                }
+                response = create_error_response("500 Internal Server Error", "Failed to save data", connection);
             }
         }
-        else if (strcmp(request->method, "POST") == 0 && strcmp(request->path, "/signup") == 0) {
-            cJSON* req_json = cJSON_Parse(request->body);
-            if (!req_json) {
-                response = create_error_response("400 Bad Request", "Invalid JSON");
+    }
+    else if (strcmp(request->method, "POST") == 0 &&
+             strcmp(request->path, "/users/batch") == 0) {
+        response = handle_post_users_batch(mp, request, user, connection);
+    }
+    else if (strcmp(request->method, "GET") == 0 &&
+             strcmp(request->path, "/stats/locks") == 0) {
+        char* stats = lock_stats_json();
+        response = stats ? create_response("200 OK", "application/json", stats, connection)
+                         : create_error_response("500 Internal Server Error",
+                                                 "Stats unavailable", connection);
+        free(stats);
+    }
+    else if (strcmp(request->method, "GET") == 0 &&
+             strcmp(request->path, "/stats/trace") == 0) {
+        char* trace = trace_json();
+        response = trace ? create_response("200 OK", "application/json", trace, connection)
+                         : create_error_response("500 Internal Server Error",
+                                                 "Trace unavailable", connection);
+        free(trace);
+    }
+    else if (strcmp(request->method, "POST") == 0 && strcmp(request->path, "/signup") == 0) {
+        Credentials credentials;
+        if (!credentials_parse(&credentials, request->body)) {
+            response = create_error_response("400 Bad Request", "Invalid JSON", connection);
+        } else {
+            const char* username = credentials.username;
+            const char* password = credentials.password;
+            
+            if (username && password && auth_signup(mp->shared_data, username, password)) {
+                response = create_response("201 Created", "application/json", 
+                                        "{\"status\":\"success\",\"message\":\"User created\"}", connection);
             } else {
-                cJSON* username_obj = cJSON_GetObjectItem(req_json, "username");
-                cJSON* password_obj = cJSON_GetObjectItem(req_json, "password");
-                
-                char* username = username_obj ? username_obj->valuestring : NULL;
-                char* password = password_obj ? password_obj->valuestring : NULL;
-                
-                if (username && password && auth_signup(mp->shared_data, username, password)) {
-                    response = create_response("201 Created", "application/json", 
-                                            "{\"status\":\"success\",\"message\":\"User created\"}", "close");
-                } else {
-                    response = create_error_response("400 Bad Request", "Signup failed - username may be taken");
-                }
-                cJSON_Delete(req_json);
+                response = create_error_response("400 Bad Request", "Signup failed - username may be taken", connection);
             }
+            credentials_free(&credentials);
         }
-        else if (strcmp(request->method, "POST") == 0 && strcmp(request->path, "/login") == 0) {
-            cJSON* req_json = cJSON_Parse(request->body);
-            if (!req_json) {
-                response = create_error_response("400 Bad Request", "Invalid JSON");
+    }
+    else if (strcmp(request->method, "POST") == 0 && strcmp(request->path, "/login") == 0) {
+        Credentials credentials;
+        if (!credentials_parse(&credentials, request->body)) {
+            response = create_error_response("400 Bad Request", "Invalid JSON", connection);
+        } else {
+            char* token = auth_login(mp->shared_data, credentials.username, credentials.password);
+            if (token) {
+                char response_body[512];
+                snprintf(response_body, sizeof(response_body), 
+                        "{\"status\":\"success\",\"token\":\"%s\"}", token);
+                response = create_response("200 OK", "application/json", response_body, connection);
+                free(token);
             } else {
-                cJSON* username_obj = cJSON_GetObjectItem(req_json, "username");
-                cJSON* password_obj = cJSON_GetObjectItem(req_json, "password");
-                
-                char* username = username_obj ? username_obj->valuestring : NULL;
-                char* password = password_obj ? password_obj->valuestring : NULL;
-                
-                char* token = auth_login(mp->shared_data, username, password);
-                if (token) {
-                    char response_body[256];
-                    snprintf(response_body, sizeof(response_body), 
-                            "{\"status\":\"success\",\"token\":\"%s\"}", token);
-                    response = create_response("200 OK", "application/json", response_body, "close");
-                    free(token);
-                } else {
-                    response = create_error_response("401 Unauthorized", "Invalid credentials");
-                }
-                cJSON_Delete(req_json);
+                response = create_error_response("401 Unauthorized", "Invalid credentials", connection);
             }
-        } else {
-            response = create_error_response("404 Not Found", "Not Found");
+            credentials_free(&credentials);
         }
+    } else {
+        response = create_error_response("404 Not Found", "Not Found", connection);
     }
     
+    if (response && response_length == 0) {
+        response_length = strlen(response);
+    }
+    *response_length_out = response_length;
+    return response;
+}
+
+// Answers one request. Takes ownership of msg->message; the response is
+// returned in *response_length bytes, or NULL if none could be built.
+static char* process_message(MessageProcessor* mp, Message* msg, size_t* response_length_out) {
+    HttpParseResult parse_result = http_parse_request(msg->message);
+    free(msg->message);
+    msg->message = NULL;
+    
+    char* response = NULL;
+    if (!parse_result.success) {
+        response = create_error_response("400 Bad Request", "Bad Request", "close");
+        *response_length_out = response ? strlen(response) : 0;
+    } else {
+        HttpRequest* request = &parse_result.request;
+        // Only connections owned by a connection thread persist; direct sends close the socket,
+        // and a draining server tells clients not to send more
+        bool draining = mp->draining && atomic_load(mp->draining);
+        bool keep_alive = msg->batch && !draining && http_request_keep_alive(request);
+        response = message_processor_respond(mp, request, keep_alive, response_length_out);
+    }
+    
+    http_request_free(&parse_result.request);
+    return response;
+}
+
+static void send_and_close(int client_fd, char* response, size_t response_length) {
     if (response) {
-        if (send(client_fd, response, strlen(response), 0) == -1) {
+        if (send(client_fd, response, response_length, 0) == -1) {
             DEBUG_PRINT("Send failed: %s\n", strerror(errno));
         }
         free(response);
@@ -156,8 +495,74 @@ static void process_single_message(MessageProcessor* mp) {
         shutdown(client_fd, SHUT_RDWR);
         close(client_fd);
     }
+}
+
+// Takes up to MESSAGE_PROCESSOR_BATCH messages with one queue lock and
+// answers them back to back
+static void process_batch(MessageProcessor* mp) {
+    Message messages[MESSAGE_PROCESSOR_BATCH];
+    size_t count = message_queue_pop_batch(mp->queue, messages, MESSAGE_PROCESSOR_BATCH);
+    if (count == 0) {
+        DEBUG_PRINT("Queue pop failed or shutdown\n");
+        return;
+    }
+    message_processor_handle_batch(mp, messages, count);
+}
+
+// Responses for the same connection that end up next to each other are
+// completed together, so its thread is woken once for all of them
+void message_processor_handle_batch(MessageProcessor* mp, Message* messages, size_t count) {
+    ResponseBatch* pending_batch = NULL;
+    size_t pending = 0;
+    size_t slots[MESSAGE_PROCESSOR_BATCH];
+    char* responses[MESSAGE_PROCESSOR_BATCH];
+    size_t lengths[MESSAGE_PROCESSOR_BATCH];
+    bool closes[MESSAGE_PROCESSOR_BATCH];
     
-    http_request_free(&parse_result.request);
+    for (size_t i = 0; i < count; i++) {
+        Message* msg = &messages[i];
+        size_t response_length = 0;
+        char* response;
+        bool expired = false;
+        uint64_t trace_id = msg->trace_id;
+        uint64_t start_ns = trace_id ? trace_now_ns() : 0;
+        uint64_t start_cpu_ns = trace_id ? trace_thread_cpu_ns() : 0;
+        if (trace_id) trace_span(trace_id, "queue", msg->queued_ns, start_ns, 0);
+        uint64_t popped_ns = now_ns();
+        flight_record(FLIGHT_QUEUE_POP, msg->client_fd, popped_ns - msg->queued_ns, NULL, 0);
+        if (msg->deadline_ns && popped_ns > msg->deadline_ns) {
+            free(msg->message);
+            msg->message = NULL;
+            response = strdup(EXPIRED_RESPONSE);
+            response_length = response ? sizeof(EXPIRED_RESPONSE) - 1 : 0;
+            expired = true;
+            atomic_fetch_add(&mp->expired, 1);
+        } else {
+            response = process_message(mp, msg, &response_length);
+        }
+        if (trace_id) {
+            trace_span(trace_id, "handle", start_ns, trace_now_ns(), trace_thread_cpu_ns() - start_cpu_ns);
+        }
+        
+        if (!msg->batch) {
+            send_and_close(msg->client_fd, response, response_length);
+            continue;
+        }
+        
+        // The connection thread sends it, in request order
+        slots[pending] = msg->slot;
+        responses[pending] = response;
+        lengths[pending] = response_length;
+        closes[pending] = expired;
+        pending++;
+        pending_batch = msg->batch;
+        
+        bool next_same = i + 1 < count && messages[i + 1].batch == pending_batch;
+        if (!next_same) {
+            response_batch_complete_many(pending_batch, slots, responses, lengths, closes, pending);
+            pending = 0;
+        }
+    }
 }
 
 static char* create_response(const char* status, const char* content_type, 
@@ -182,6 +587,39 @@ static char* create_response(const char* status, const char* content_type,
     return response;
 }
 
-static char* create_error_response(const char* status, const char* message) {
-    return create_response(status, "text/plain", message, "close");
+// Builds a response around a body of known length, which may be binary.
+// extra_headers is inserted verbatim and must end each line with CRLF.
+static char* create_body_response(const char* status, const char* content_type,
+                                  const char* extra_headers, const char* body,
+                                  size_t body_length, const char* connection,
+                                  size_t* response_length) {
+    int header_length = snprintf(NULL, 0,
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n",
+        status, content_type, extra_headers, body_length, connection);
+    if (header_length < 0) return NULL;
+    
+    char* response = (char*)malloc((size_t)header_length + body_length + 1);
+    if (!response) return NULL;
+    
+    sprintf(response,
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n",
+        status, content_type, extra_headers, body_length, connection);
+    memcpy(response + header_length, body, body_length);
+    response[header_length + body_length] = '\0';
+    
+    *response_length = (size_t)header_length + body_length;
+    return response;
+}
+
+static char* create_error_response(const char* status, const char* message,
+                                   const char* connection) {
+    return create_response(status, "text/plain", message, connection);
 }
\ No newline at end of file
@@ -1,92 +1,205 @@
 #include "message_queue.h"
+#include "flight_recorder.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
+
+LOCK_STATS_DEFINE(queue_lock_stats, "message_queue");
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
 void message_queue_init(MessageQueue* mq, size_t capacity) {
-    mq->messages = (Message*)malloc(capacity * sizeof(Message));
-    mq->capacity = capacity;
-    mq->front = 0;
-    mq->rear = 0;
+    MessageLaneConfig lanes[MESSAGE_CLASS_COUNT];
+    for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+        lanes[i].capacity = capacity;
+        lanes[i].weight = 1;
+    }
+    message_queue_init_lanes(mq, lanes);
+}
+
+void message_queue_init_lanes(MessageQueue* mq, const MessageLaneConfig lanes[MESSAGE_CLASS_COUNT]) {
+    for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+        MessageLane* lane = &mq->lanes[i];
+        lane->messages = (Message*)malloc(lanes[i].capacity * sizeof(Message));
+        lane->capacity = lane->messages ? lanes[i].capacity : 0;
+        lane->front = 0;
+        lane->rear = 0;
+        lane->size = 0;
+        lane->weight = lanes[i].weight ? lanes[i].weight : 1;
+        lane->credit = 0;
+    }
     mq->size = 0;
+    mq->waiting = 0;
+    mq->popped = 0;
+    mq->wait_ns = 0;
     mq->shutdown_flag = false;
-    pthread_mutex_init(&mq->mutex, NULL);
-    pthread_cond_init(&mq->cond, NULL);
+    profiled_mutex_init(&mq->mutex, &queue_lock_stats);
+    // Timed pops measure their deadline on the clock queued_ns uses
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mq->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static Message* lane_take(MessageQueue* mq, MessageLane* lane) {
+    Message* msg = &lane->messages[lane->front];
+    lane->front = (lane->front + 1) % lane->capacity;
+    lane->size--;
+    mq->size--;
+    if (lane->size == 0) {
+        // Credit saved up while busy is not carried into the next burst
+        lane->credit = 0;
+    }
+    return msg;
 }
 
 void message_queue_destroy(MessageQueue* mq) {
-    pthread_mutex_lock(&mq->mutex);
-    
-    while (mq->size > 0) {
-        free(mq->messages[mq->front].message);
-        mq->front = (mq->front + 1) % mq->capacity;
-        mq->size--;
+    profiled_mutex_lock(&mq->mutex);
+
+    for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+        MessageLane* lane = &mq->lanes[i];
+        while (lane->size > 0) {
+            free(lane_take(mq, lane)->message);
+        }
+        free(lane->messages);
     }
-    
-    free(mq->messages);
-    pthread_mutex_unlock(&mq->mutex);
-    pthread_mutex_destroy(&mq->mutex);
+
+    profiled_mutex_unlock(&mq->mutex);
+    profiled_mutex_destroy(&mq->mutex);
     pthread_cond_destroy(&mq->cond);
 }
 
-bool message_queue_push(MessageQueue* mq, int client_fd, const char* message) {
-    pthread_mutex_lock(&mq->mutex);
-    
-    if (mq->shutdown_flag) {
-        pthread_mutex_unlock(&mq->mutex);
-        return false;
-    }
-    
-    // Check if queue is full
-    if (mq->size == mq->capacity) {
-        pthread_mutex_unlock(&mq->mutex);
-        return false;
-    }
-    
-    // Copy the message
+bool message_queue_push(MessageQueue* mq, MessageClass message_class, int client_fd,
+                        const char* message, ResponseBatch* batch, size_t slot,
+                        uint64_t deadline_ns, uint64_t trace_id) {
+    // Copy outside the lock; it is freed again if the lane has no room
     char* msg_copy = strdup(message);
-    if (!msg_copy) {
-        pthread_mutex_unlock(&mq->mutex);
+    if (!msg_copy) return false;
+    uint64_t queued_ns = now_ns();
+
+    profiled_mutex_lock(&mq->mutex);
+    MessageLane* lane = &mq->lanes[message_class];
+
+    if (mq->shutdown_flag || lane->size == lane->capacity) {
+        profiled_mutex_unlock(&mq->mutex);
+        free(msg_copy);
         return false;
     }
-    
+
     // Add to queue
-    mq->messages[mq->rear].client_fd = client_fd;
-    mq->messages[mq->rear].message = msg_copy;
-    mq->rear = (mq->rear + 1) % mq->capacity;
-    mq->size++;
-    
+    lane->messages[lane->rear].client_fd = client_fd;
+    lane->messages[lane->rear].message = msg_copy;
+    lane->messages[lane->rear].batch = batch;
+    lane->messages[lane->rear].slot = slot;
+    lane->messages[lane->rear].queued_ns = queued_ns;
+    lane->messages[lane->rear].deadline_ns = deadline_ns;
+    lane->messages[lane->rear].trace_id = trace_id;
+    lane->rear = (lane->rear + 1) % lane->capacity;
+    lane->size++;
+    size_t depth = ++mq->size;
+
     pthread_cond_signal(&mq->cond);
-    pthread_mutex_unlock(&mq->mutex);
+    profiled_mutex_unlock(&mq->mutex);
+    flight_record(FLIGHT_QUEUE_PUSH, client_fd, depth, NULL, 0);
     return true;
 }
 
-bool message_queue_pop(MessageQueue* mq, int* client_fd, char** message) {
-    pthread_mutex_lock(&mq->mutex);
-    
-    while (mq->size == 0 && !mq->shutdown_flag) {
-        pthread_cond_wait(&mq->cond, &mq->mutex);
+// Smooth weighted round robin over the lanes that have messages: each gains
+// its weight in credit, the richest is served and pays the total back
+static MessageLane* next_lane(MessageQueue* mq) {
+    MessageLane* best = NULL;
+    long total = 0;
+    for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+        MessageLane* lane = &mq->lanes[i];
+        if (lane->size == 0) continue;
+        lane->credit += lane->weight;
+        total += lane->weight;
+        if (!best || lane->credit > best->credit) best = lane;
     }
-    
-    if (mq->shutdown_flag) {
-        pthread_mutex_unlock(&mq->mutex);
-        return false;
+    best->credit -= total;
+    return best;
+}
+
+bool message_queue_pop(MessageQueue* mq, Message* out) {
+    return message_queue_pop_batch(mq, out, 1) == 1;
+}
+
+size_t message_queue_pop_batch(MessageQueue* mq, Message* out, size_t max) {
+    return message_queue_pop_batch_timed(mq, out, max, 0);
+}
+
+size_t message_queue_pop_batch_timed(MessageQueue* mq, Message* out, size_t max,
+                                     unsigned timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms) {
+        uint64_t deadline_ns = now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+        deadline.tv_sec = (time_t)(deadline_ns / 1000000000ULL);
+        deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
     }
-    
-    // Get message from queue
-    *client_fd = mq->messages[mq->front].client_fd;
-    *message = mq->messages[mq->front].message;
-    
-    mq->front = (mq->front + 1) % mq->capacity;
-    mq->size--;
-    
-    pthread_mutex_unlock(&mq->mutex);
-    return true;
+
+    profiled_mutex_lock(&mq->mutex);
+
+    bool timed_out = false;
+    while (mq->size == 0 && !mq->shutdown_flag && !timed_out) {
+        mq->waiting++;
+        if (timeout_ms) {
+            timed_out = profiled_cond_timedwait(&mq->cond, &mq->mutex, &deadline) != 0;
+        } else {
+            profiled_cond_wait(&mq->cond, &mq->mutex);
+        }
+        mq->waiting--;
+    }
+
+    if (mq->shutdown_flag || mq->size == 0) {
+        profiled_mutex_unlock(&mq->mutex);
+        return 0;
+    }
+
+    // Taking everything would leave woken consumers with nothing to do
+    size_t share = mq->size / (mq->waiting + 1);
+    size_t count = share < 1 ? 1 : share;
+    if (count > max) count = max;
+
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        out[i] = *lane_take(mq, next_lane(mq));
+        mq->wait_ns += now - out[i].queued_ns;
+    }
+    mq->popped += count;
+
+    profiled_mutex_unlock(&mq->mutex);
+    return count;
+}
+
+void message_queue_stats(MessageQueue* mq, uint64_t* popped, uint64_t* wait_ns, size_t* queued) {
+    profiled_mutex_lock(&mq->mutex);
+    *popped = mq->popped;
+    *wait_ns = mq->wait_ns;
+    *queued = mq->size;
+    profiled_mutex_unlock(&mq->mutex);
 }
 
 void message_queue_shutdown(MessageQueue* mq) {
-    pthread_mutex_lock(&mq->mutex);
+    profiled_mutex_lock(&mq->mutex);
     mq->shutdown_flag = true;
+
+    // Nobody will pop these any more; release connections waiting on them
+    for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+        MessageLane* lane = &mq->lanes[i];
+        while (lane->size > 0) {
+            Message* msg = lane_take(mq, lane);
+            if (msg->batch) {
+                response_batch_complete(msg->batch, msg->slot, NULL, 0);
+            }
+            free(msg->message);
+        }
+    }
     pthread_cond_broadcast(&mq->cond);
-    pthread_mutex_unlock(&mq->mutex);
-}
\ No newline at end of file
+    profiled_mutex_unlock(&mq->mutex);
+}
@@ -0,0 +1,184 @@
+#include "processor_pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_INTERVAL_MS 100
+#define DEFAULT_GROW_WAIT_US 1000
+// Busy fraction above which waiting messages are blamed on too few threads
+#define GROW_UTILIZATION 0.7
+// Busy fraction below which an interval counts as idle
+#define SHRINK_UTILIZATION 0.25
+// Idle intervals in a row before a thread is retired
+#define SHRINK_INTERVALS 10
+
+LOCK_STATS_DEFINE(pool_lock_stats, "processor_pool");
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void* processor_main(void* arg) {
+    ProcessorSlot* slot = (ProcessorSlot*)arg;
+    ProcessorPool* pool = slot->pool;
+    MessageProcessor* mp = pool->processor;
+    Message messages[MESSAGE_PROCESSOR_BATCH];
+
+    // The pop times out so a retired thread notices within an interval
+    while (mp->running && slot->index < atomic_load(&pool->target)) {
+        size_t count = message_queue_pop_batch_timed(mp->queue, messages, MESSAGE_PROCESSOR_BATCH,
+                                                     pool->config.interval_ms);
+        if (count == 0) continue;
+
+        uint64_t start = now_ns();
+        message_processor_handle_batch(mp, messages, count);
+        atomic_fetch_add(&pool->busy_ns, now_ns() - start);
+    }
+    return NULL;
+}
+
+static bool add_thread(ProcessorPool* pool) {
+    ProcessorSlot* slot = &pool->slots[pool->threads];
+    slot->pool = pool;
+    slot->index = pool->threads;
+    atomic_store(&pool->target, pool->threads + 1);
+    if (pthread_create(&slot->thread, NULL, processor_main, slot) != 0) {
+        perror("Failed to create processor thread");
+        atomic_store(&pool->target, pool->threads);
+        return false;
+    }
+    pool->threads++;
+    return true;
+}
+
+// Waits for the last thread to finish its batch and exit
+static void retire_thread(ProcessorPool* pool) {
+    atomic_store(&pool->target, pool->threads - 1);
+    pthread_join(pool->slots[pool->threads - 1].thread, NULL);
+    pool->threads--;
+}
+
+static void join_processors(ProcessorPool* pool) {
+    atomic_store(&pool->target, 0);
+    for (unsigned i = 0; i < pool->threads; i++) {
+        pthread_join(pool->slots[i].thread, NULL);
+    }
+    pool->threads = 0;
+    profiled_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+static void resize(ProcessorPool* pool) {
+    uint64_t popped, wait_ns;
+    size_t queued;
+    message_queue_stats(pool->processor->queue, &popped, &wait_ns, &queued);
+    uint64_t busy_ns = atomic_load(&pool->busy_ns);
+
+    uint64_t interval_popped = popped - pool->last_popped;
+    uint64_t interval_wait_ns = wait_ns - pool->last_wait_ns;
+    uint64_t interval_busy_ns = busy_ns - pool->last_busy_ns;
+    pool->last_popped = popped;
+    pool->last_wait_ns = wait_ns;
+    pool->last_busy_ns = busy_ns;
+
+    double mean_wait_us = interval_popped
+                          ? (double)interval_wait_ns / (double)interval_popped / 1000.0 : 0;
+    double utilization = (double)interval_busy_ns /
+                         ((double)pool->config.interval_ms * 1e6 * pool->threads);
+    // Nothing popped while messages sit in the queue means every thread is stuck
+    bool backlog = mean_wait_us > pool->config.grow_wait_us || (queued > 0 && interval_popped == 0);
+
+    if (backlog && utilization > GROW_UTILIZATION) {
+        pool->idle_intervals = 0;
+        if (pool->threads < pool->config.max_threads && add_thread(pool)) {
+            atomic_fetch_add(&pool->grown, 1);
+        }
+    } else if (!backlog && utilization < SHRINK_UTILIZATION) {
+        if (++pool->idle_intervals >= SHRINK_INTERVALS && pool->threads > pool->config.min_threads) {
+            retire_thread(pool);
+            atomic_fetch_add(&pool->shrunk, 1);
+            pool->idle_intervals = 0;
+        }
+    } else {
+        pool->idle_intervals = 0;
+    }
+}
+
+static void* controller_main(void* arg) {
+    ProcessorPool* pool = (ProcessorPool*)arg;
+
+    profiled_mutex_lock(&pool->mutex);
+    while (!pool->stopping) {
+        uint64_t deadline_ns = now_ns() + (uint64_t)pool->config.interval_ms * 1000000ULL;
+        struct timespec deadline = {(time_t)(deadline_ns / 1000000000ULL),
+                                    (long)(deadline_ns % 1000000000ULL)};
+        while (!pool->stopping &&
+               profiled_cond_timedwait(&pool->cond, &pool->mutex, &deadline) == 0) {
+        }
+        if (pool->stopping) break;
+
+        profiled_mutex_unlock(&pool->mutex);
+        resize(pool);
+        profiled_mutex_lock(&pool->mutex);
+    }
+    profiled_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+bool processor_pool_start(ProcessorPool* pool, MessageProcessor* processor,
+                          const ProcessorPoolConfig* config) {
+    pool->processor = processor;
+    pool->config = *config;
+    if (pool->config.min_threads == 0) pool->config.min_threads = 1;
+    if (pool->config.max_threads > PROCESSOR_POOL_MAX_THREADS) {
+        pool->config.max_threads = PROCESSOR_POOL_MAX_THREADS;
+    }
+    if (pool->config.min_threads > pool->config.max_threads) {
+        pool->config.min_threads = pool->config.max_threads;
+    }
+    if (pool->config.interval_ms == 0) pool->config.interval_ms = DEFAULT_INTERVAL_MS;
+    if (pool->config.grow_wait_us == 0) pool->config.grow_wait_us = DEFAULT_GROW_WAIT_US;
+
+    pool->threads = 0;
+    atomic_init(&pool->target, 0);
+    atomic_init(&pool->busy_ns, 0);
+    atomic_init(&pool->grown, 0);
+    atomic_init(&pool->shrunk, 0);
+    pool->stopping = false;
+    pool->last_popped = 0;
+    pool->last_wait_ns = 0;
+    pool->last_busy_ns = 0;
+    pool->idle_intervals = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    profiled_mutex_init(&pool->mutex, &pool_lock_stats);
+
+    while (pool->threads < pool->config.min_threads && add_thread(pool)) {
+    }
+    if (pool->threads > 0 &&
+        pthread_create(&pool->controller, NULL, controller_main, pool) == 0) {
+        return true;
+    }
+    fprintf(stderr, "Failed to start the processor pool\n");
+    join_processors(pool);
+    return false;
+}
+
+void processor_pool_stop(ProcessorPool* pool) {
+    profiled_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_signal(&pool->cond);
+    profiled_mutex_unlock(&pool->mutex);
+    pthread_join(pool->controller, NULL);
+    join_processors(pool);
+}
+
+unsigned processor_pool_size(const ProcessorPool* pool) {
+    return atomic_load(&pool->target);
+}
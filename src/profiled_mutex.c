@@ -0,0 +1,256 @@
+#include "profiled_mutex.h"
+#include "flight_recorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Registered LockStats, newest first; entries are never removed
+static LockStats* registry = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Taken together when the first lock registers, to convert ticks to ns
+static uint64_t base_ticks;
+static uint64_t base_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Timestamps on the lock path are raw ticks: the TSC where there is one,
+// which costs about half a clock_gettime, and nanoseconds elsewhere
+static inline uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+// Measured over the whole run so far, which needs no calibration delay
+static double ns_per_tick(void) {
+    uint64_t ticks = read_ticks() - base_ticks;
+    uint64_t ns = now_ns() - base_ns;
+    return ticks > 0 && ns >= 1000000 ? (double)ns / (double)ticks : 1.0;
+}
+
+static void record_max(atomic_ullong* max, uint64_t value) {
+    unsigned long long current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(max, &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void register_stats(LockStats* stats) {
+    if (atomic_load_explicit(&stats->registered, memory_order_acquire)) return;
+
+    pthread_mutex_lock(&registry_mutex);
+    if (!atomic_load_explicit(&stats->registered, memory_order_relaxed)) {
+        if (!registry) {
+            base_ticks = read_ticks();
+            base_ns = now_ns();
+        }
+        stats->next = registry;
+        registry = stats;
+        atomic_store_explicit(&stats->registered, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void profiled_mutex_init(ProfiledMutex* mutex, LockStats* stats) {
+    register_stats(stats);
+    atomic_fetch_add_explicit(&stats->instances, 1, memory_order_relaxed);
+
+    pthread_mutex_init(&mutex->mutex, NULL);
+    mutex->stats = stats;
+    size_t shard = ((uintptr_t)mutex >> 6) % LOCK_STATS_SHARDS;
+    mutex->shard = &stats->shards[shard];
+    mutex->locked_at = 0;
+}
+
+void profiled_mutex_destroy(ProfiledMutex* mutex) {
+    pthread_mutex_destroy(&mutex->mutex);
+    atomic_fetch_sub_explicit(&mutex->stats->instances, 1, memory_order_relaxed);
+}
+
+static void record_wait(LockStats* stats, LockStatsShard* shard, uint64_t waited) {
+    atomic_fetch_add_explicit(&shard->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->wait_ticks, waited, memory_order_relaxed);
+    record_max(&shard->max_wait_ticks, waited);
+    flight_record(FLIGHT_LOCK_WAIT, -1, waited, stats->name, strlen(stats->name));
+}
+
+static void record_hold(LockStatsShard* shard, uint64_t locked_at) {
+    uint64_t held = read_ticks() - locked_at;
+    atomic_fetch_add_explicit(&shard->hold_ticks, held, memory_order_relaxed);
+    record_max(&shard->max_hold_ticks, held);
+}
+
+void profiled_mutex_lock(ProfiledMutex* mutex) {
+    LockStatsShard* shard = mutex->shard;
+    if (pthread_mutex_trylock(&mutex->mutex) != 0) {
+        uint64_t started = read_ticks();
+        pthread_mutex_lock(&mutex->mutex);
+        mutex->locked_at = read_ticks();
+        record_wait(mutex->stats, shard, mutex->locked_at - started);
+    } else {
+        mutex->locked_at = read_ticks();
+    }
+    atomic_fetch_add_explicit(&shard->acquisitions, 1, memory_order_relaxed);
+}
+
+static void end_hold(ProfiledMutex* mutex) {
+    record_hold(mutex->shard, mutex->locked_at);
+}
+
+void profiled_mutex_unlock(ProfiledMutex* mutex) {
+    end_hold(mutex);
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+void profiled_cond_wait(pthread_cond_t* cond, ProfiledMutex* mutex) {
+    end_hold(mutex);
+    pthread_cond_wait(cond, &mutex->mutex);
+    mutex->locked_at = read_ticks();
+}
+
+int profiled_cond_timedwait(pthread_cond_t* cond, ProfiledMutex* mutex,
+                            const struct timespec* deadline) {
+    end_hold(mutex);
+    int result = pthread_cond_timedwait(cond, &mutex->mutex, deadline);
+    mutex->locked_at = read_ticks();
+    return result;
+}
+
+// Spreads the threads reading one rwlock over the shards
+static atomic_uint next_reader_shard;
+static __thread unsigned reader_shard = LOCK_STATS_SHARDS;
+
+static LockStatsShard* read_shard(LockStats* stats) {
+    if (reader_shard == LOCK_STATS_SHARDS) {
+        reader_shard = atomic_fetch_add_explicit(&next_reader_shard, 1, memory_order_relaxed) %
+                       LOCK_STATS_SHARDS;
+    }
+    return &stats->shards[reader_shard];
+}
+
+bool profiled_rwlock_init(ProfiledRwlock* lock, LockStats* read_stats, LockStats* write_stats) {
+    if (pthread_rwlock_init(&lock->rwlock, NULL) != 0) return false;
+    register_stats(read_stats);
+    register_stats(write_stats);
+    atomic_fetch_add_explicit(&read_stats->instances, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&write_stats->instances, 1, memory_order_relaxed);
+    lock->read_stats = read_stats;
+    lock->write_stats = write_stats;
+    lock->write_shard = &write_stats->shards[((uintptr_t)lock >> 6) % LOCK_STATS_SHARDS];
+    lock->write_locked_at = 0;
+    return true;
+}
+
+void profiled_rwlock_destroy(ProfiledRwlock* lock) {
+    pthread_rwlock_destroy(&lock->rwlock);
+    atomic_fetch_sub_explicit(&lock->read_stats->instances, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&lock->write_stats->instances, 1, memory_order_relaxed);
+}
+
+uint64_t profiled_rwlock_rdlock(ProfiledRwlock* lock) {
+    LockStatsShard* shard = read_shard(lock->read_stats);
+    uint64_t locked_at;
+    if (pthread_rwlock_tryrdlock(&lock->rwlock) != 0) {
+        uint64_t started = read_ticks();
+        pthread_rwlock_rdlock(&lock->rwlock);
+        locked_at = read_ticks();
+        record_wait(lock->read_stats, shard, locked_at - started);
+    } else {
+        locked_at = read_ticks();
+    }
+    atomic_fetch_add_explicit(&shard->acquisitions, 1, memory_order_relaxed);
+    return locked_at;
+}
+
+void profiled_rwlock_rdunlock(ProfiledRwlock* lock, uint64_t locked_at) {
+    record_hold(read_shard(lock->read_stats), locked_at);
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+void profiled_rwlock_wrlock(ProfiledRwlock* lock) {
+    LockStatsShard* shard = lock->write_shard;
+    if (pthread_rwlock_trywrlock(&lock->rwlock) != 0) {
+        uint64_t started = read_ticks();
+        pthread_rwlock_wrlock(&lock->rwlock);
+        lock->write_locked_at = read_ticks();
+        record_wait(lock->write_stats, shard, lock->write_locked_at - started);
+    } else {
+        lock->write_locked_at = read_ticks();
+    }
+    atomic_fetch_add_explicit(&shard->acquisitions, 1, memory_order_relaxed);
+}
+
+void profiled_rwlock_wrunlock(ProfiledRwlock* lock) {
+    record_hold(lock->write_shard, lock->write_locked_at);
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+typedef struct {
+    unsigned long long acquisitions;
+    unsigned long long contended;
+    unsigned long long wait_ticks;
+    unsigned long long max_wait_ticks;
+    unsigned long long hold_ticks;
+    unsigned long long max_hold_ticks;
+} LockTotals;
+
+static LockTotals sum_shards(const LockStats* stats) {
+    LockTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    for (int i = 0; i < LOCK_STATS_SHARDS; i++) {
+        const LockStatsShard* shard = &stats->shards[i];
+        totals.acquisitions += atomic_load_explicit(&shard->acquisitions, memory_order_relaxed);
+        totals.contended += atomic_load_explicit(&shard->contended, memory_order_relaxed);
+        totals.wait_ticks += atomic_load_explicit(&shard->wait_ticks, memory_order_relaxed);
+        totals.hold_ticks += atomic_load_explicit(&shard->hold_ticks, memory_order_relaxed);
+        unsigned long long max_wait = atomic_load_explicit(&shard->max_wait_ticks, memory_order_relaxed);
+        unsigned long long max_hold = atomic_load_explicit(&shard->max_hold_ticks, memory_order_relaxed);
+        if (max_wait > totals.max_wait_ticks) totals.max_wait_ticks = max_wait;
+        if (max_hold > totals.max_hold_ticks) totals.max_hold_ticks = max_hold;
+    }
+    return totals;
+}
+
+char* lock_stats_json(void) {
+    char* buffer = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&buffer, &size);
+    if (!out) return NULL;
+
+    fputs("{\"locks\":[", out);
+    pthread_mutex_lock(&registry_mutex);
+    double scale = ns_per_tick();
+    for (LockStats* stats = registry; stats; stats = stats->next) {
+        LockTotals totals = sum_shards(stats);
+        fprintf(out,
+                "%s{\"name\":\"%s\",\"instances\":%ld,\"acquisitions\":%llu,"
+                "\"contended\":%llu,\"wait_ns\":%llu,\"max_wait_ns\":%llu,"
+                "\"hold_ns\":%llu,\"max_hold_ns\":%llu}",
+                stats == registry ? "" : ",", stats->name,
+                atomic_load_explicit(&stats->instances, memory_order_relaxed),
+                totals.acquisitions, totals.contended,
+                (unsigned long long)(totals.wait_ticks * scale),
+                (unsigned long long)(totals.max_wait_ticks * scale),
+                (unsigned long long)(totals.hold_ticks * scale),
+                (unsigned long long)(totals.max_hold_ticks * scale));
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    fputs("]}", out);
+
+    if (fclose(out) != 0) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
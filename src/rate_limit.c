@@ -0,0 +1,176 @@
+#include "rate_limit.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define OWNER_CONNECTIONS 0x7fffffffULL
+#define OWNER_IN_USE (1ULL << 31)
+// Bucket contents are kept in thousandths of a token, so a refill rate of
+// N tokens per second is simply N per millisecond
+#define TOKEN 1000
+
+static uint64_t owner_key(uint32_t addr) {
+    return ((uint64_t)addr << 32) | OWNER_IN_USE;
+}
+
+static uint64_t pack_bucket(uint32_t time, uint32_t tokens) {
+    return ((uint64_t)time << 32) | tokens;
+}
+
+static uint32_t full_bucket(const RateLimiter* limiter) {
+    return limiter->config.burst * TOKEN;
+}
+
+static uint32_t limiter_time(const RateLimiter* limiter, uint64_t now_ms) {
+    return (uint32_t)(now_ms - limiter->epoch_ms);
+}
+
+// Tokens in the bucket at now. Threads read the clock independently, so
+// now may be a little behind the bucket's own time; that counts as no
+// refill rather than a wrap-around.
+static uint32_t refilled(const RateLimiter* limiter, uint64_t bucket, uint32_t now) {
+    int32_t elapsed = (int32_t)(now - (uint32_t)(bucket >> 32));
+    uint64_t tokens = (uint32_t)bucket;
+    if (elapsed > 0) tokens += (uint64_t)elapsed * limiter->config.requests_per_sec;
+    uint32_t full = full_bucket(limiter);
+    return tokens > full ? full : (uint32_t)tokens;
+}
+
+// A slot with no connections and a full bucket is indistinguishable from
+// one that was never used
+static bool reclaimable(const RateLimiter* limiter, const RateLimitEntry* entry,
+                        uint64_t owner, uint32_t now) {
+    if (owner & OWNER_CONNECTIONS) return false;
+    if (limiter->config.requests_per_sec == 0) return true;
+    uint64_t bucket = atomic_load_explicit(&entry->bucket, memory_order_relaxed);
+    return refilled(limiter, bucket, now) == full_bucket(limiter);
+}
+
+static size_t hash_addr(uint32_t addr) {
+    uint32_t hash = addr * 2654435761u;
+    return (hash ^ (hash >> 15)) & (RATE_LIMIT_TABLE_SIZE - 1);
+}
+
+// Returns the slot for addr, claiming a free or reclaimable one if it has
+// none, or NULL when every probed slot belongs to a live client. Slots only
+// ever change hands, never empty, so addr cannot sit past the first empty
+// slot in its probe sequence.
+static RateLimitEntry* find_entry(RateLimiter* limiter, uint32_t addr, uint32_t now) {
+    uint64_t key = owner_key(addr);
+    size_t start = hash_addr(addr);
+
+    for (;;) {
+        RateLimitEntry* target = NULL;
+        uint64_t expected = 0;
+        for (size_t probe = 0; probe < RATE_LIMIT_MAX_PROBE; probe++) {
+            RateLimitEntry* entry = &limiter->table[(start + probe) & (RATE_LIMIT_TABLE_SIZE - 1)];
+            uint64_t owner = atomic_load_explicit(&entry->owner, memory_order_acquire);
+            if (owner == 0) {
+                if (!target) target = entry;
+                break;
+            }
+            if ((owner & ~OWNER_CONNECTIONS) == key) return entry;
+            if (!target && reclaimable(limiter, entry, owner, now)) {
+                target = entry;
+                expected = owner;
+            }
+        }
+        if (!target) return NULL;
+
+        // The bucket is full either way, so it needs no reset; a lost race
+        // means the slot changed, so look again
+        if (atomic_compare_exchange_strong_explicit(&target->owner, &expected, key,
+                                                    memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            return target;
+        }
+    }
+}
+
+bool rate_limiter_init(RateLimiter* limiter, const RateLimitConfig* config, uint64_t now_ms) {
+    limiter->config = *config;
+    if (limiter->config.burst == 0) limiter->config.burst = limiter->config.requests_per_sec;
+    limiter->epoch_ms = now_ms;
+    atomic_init(&limiter->rejected_connections, 0);
+    atomic_init(&limiter->rejected_requests, 0);
+    atomic_init(&limiter->untracked, 0);
+
+    limiter->table = (RateLimitEntry*)malloc(RATE_LIMIT_TABLE_SIZE * sizeof(RateLimitEntry));
+    if (!limiter->table) {
+        fprintf(stderr, "Failed to allocate the rate limit table\n");
+        return false;
+    }
+    uint64_t full = pack_bucket(0, full_bucket(limiter));
+    for (size_t i = 0; i < RATE_LIMIT_TABLE_SIZE; i++) {
+        atomic_init(&limiter->table[i].owner, 0);
+        atomic_init(&limiter->table[i].bucket, full);
+    }
+    return true;
+}
+
+void rate_limiter_destroy(RateLimiter* limiter) {
+    free(limiter->table);
+    limiter->table = NULL;
+}
+
+RateLimitResult rate_limiter_connect(RateLimiter* limiter, uint32_t addr, uint64_t now_ms,
+                                     RateLimitEntry** entry) {
+    *entry = NULL;
+    uint32_t now = limiter_time(limiter, now_ms);
+    uint64_t key = owner_key(addr);
+
+    for (;;) {
+        RateLimitEntry* slot = find_entry(limiter, addr, now);
+        if (!slot) {
+            atomic_fetch_add_explicit(&limiter->untracked, 1, memory_order_relaxed);
+            return RATE_LIMIT_ALLOWED;
+        }
+
+        uint64_t owner = atomic_load_explicit(&slot->owner, memory_order_acquire);
+        while ((owner & ~OWNER_CONNECTIONS) == key) {
+            uint64_t connections = owner & OWNER_CONNECTIONS;
+            if (limiter->config.max_connections && connections >= limiter->config.max_connections) {
+                atomic_fetch_add_explicit(&limiter->rejected_connections, 1, memory_order_relaxed);
+                return RATE_LIMIT_TOO_MANY_CONNECTIONS;
+            }
+            // Only checked here; the token is spent by the first request
+            if (limiter->config.requests_per_sec) {
+                uint64_t bucket = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+                if (refilled(limiter, bucket, now) < TOKEN) {
+                    atomic_fetch_add_explicit(&limiter->rejected_connections, 1, memory_order_relaxed);
+                    return RATE_LIMIT_TOO_MANY_REQUESTS;
+                }
+            }
+            // Holding a connection pins the slot to this address
+            if (atomic_compare_exchange_weak_explicit(&slot->owner, &owner, owner + 1,
+                                                      memory_order_acq_rel,
+                                                      memory_order_acquire)) {
+                *entry = slot;
+                return RATE_LIMIT_ALLOWED;
+            }
+        }
+        // Reclaimed by another address between the lookup and here
+    }
+}
+
+void rate_limiter_disconnect(RateLimitEntry* entry) {
+    if (entry) atomic_fetch_sub_explicit(&entry->owner, 1, memory_order_release);
+}
+
+bool rate_limiter_take(RateLimiter* limiter, RateLimitEntry* entry, uint64_t now_ms) {
+    if (!entry || limiter->config.requests_per_sec == 0) return true;
+
+    uint32_t now = limiter_time(limiter, now_ms);
+    uint64_t bucket = atomic_load_explicit(&entry->bucket, memory_order_relaxed);
+    for (;;) {
+        uint32_t tokens = refilled(limiter, bucket, now);
+        if (tokens < TOKEN) {
+            atomic_fetch_add_explicit(&limiter->rejected_requests, 1, memory_order_relaxed);
+            return false;
+        }
+        if (atomic_compare_exchange_weak_explicit(&entry->bucket, &bucket,
+                                                  pack_bucket(now, tokens - TOKEN),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
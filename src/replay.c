@@ -0,0 +1,414 @@
+#define _GNU_SOURCE  // ppoll
+
+#include "http_client.h"
+#include "cJSON.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define RECV_CHUNK_SIZE 4096
+#define MAX_CONNECTIONS 256
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_US 1000ULL
+
+// Requests sent ahead of their responses on one connection
+#define DEFAULT_WINDOW 32
+
+typedef struct {
+    uint64_t ts_us;        // Arrival time in the capture
+    size_t index;          // Position in the file, to keep ties in order
+    char* data;            // Rebuilt HTTP/1.1 request
+    size_t length;
+} ReplayRequest;
+
+typedef struct {
+    int fd;
+    char* out;             // Requests queued but not yet written
+    size_t out_length;
+    size_t out_sent;
+    size_t out_capacity;
+    char* in;
+    size_t in_length;
+    size_t in_capacity;
+    unsigned in_flight;    // Requests written or queued without a response
+} ReplayConnection;
+
+typedef struct {
+    const char* ip;
+    int port;
+    unsigned connections;
+    double speed;          // 1 = as captured, 0 = as fast as the window allows
+    unsigned window;
+    const char* token;     // Replaces captured Authorization headers when set
+} ReplayConfig;
+
+typedef struct {
+    uint64_t completed;
+    uint64_t status_class[6];   // Index by status / 100
+    uint64_t failed;
+    uint64_t lag_sum_us;
+    uint64_t lag_max_us;
+} ReplayStats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static bool append(char** buffer, size_t* length, size_t* capacity, const char* data, size_t size) {
+    if (*length + size > *capacity) {
+        size_t new_capacity = *capacity ? *capacity : RECV_CHUNK_SIZE;
+        while (new_capacity < *length + size) new_capacity *= 2;
+        char* grown = (char*)realloc(*buffer, new_capacity);
+        if (!grown) return false;
+        *buffer = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *length, data, size);
+    *length += size;
+    return true;
+}
+
+static bool append_string(char** buffer, size_t* length, size_t* capacity, const char* text) {
+    return append(buffer, length, capacity, text, strlen(text));
+}
+
+// Framing headers are recomputed, and every request asks to keep the
+// connection open so the replay controls when connections close.
+static bool skip_header(const char* name, const ReplayConfig* config) {
+    return strcasecmp(name, "Content-Length") == 0 ||
+           strcasecmp(name, "Transfer-Encoding") == 0 ||
+           strcasecmp(name, "Connection") == 0 ||
+           (config->token && strcasecmp(name, "Authorization") == 0);
+}
+
+// Turns one capture line back into a request. Returns false if the line is
+// not a captured request.
+static bool build_request(const cJSON* json, const ReplayConfig* config, ReplayRequest* out) {
+    const cJSON* ts = cJSON_GetObjectItem(json, "ts_us");
+    const char* method = cJSON_GetStringValue(cJSON_GetObjectItem(json, "method"));
+    const char* path = cJSON_GetStringValue(cJSON_GetObjectItem(json, "path"));
+    const char* body = cJSON_GetStringValue(cJSON_GetObjectItem(json, "body"));
+    const cJSON* headers = cJSON_GetObjectItem(json, "headers");
+    if (!cJSON_IsNumber(ts) || !method || !path) return false;
+    if (!body) body = "";
+
+    char* data = NULL;
+    size_t length = 0, capacity = 0;
+    char line[256];
+    bool ok = append_string(&data, &length, &capacity, method) &&
+              append_string(&data, &length, &capacity, " ") &&
+              append_string(&data, &length, &capacity, path) &&
+              append_string(&data, &length, &capacity, " HTTP/1.1\r\n");
+
+    const cJSON* pair = NULL;
+    cJSON_ArrayForEach(pair, headers) {
+        const char* name = cJSON_GetStringValue(cJSON_GetArrayItem(pair, 0));
+        const char* value = cJSON_GetStringValue(cJSON_GetArrayItem(pair, 1));
+        if (!ok || !name || !value || skip_header(name, config)) continue;
+        ok = append_string(&data, &length, &capacity, name) &&
+             append_string(&data, &length, &capacity, ": ") &&
+             append_string(&data, &length, &capacity, value) &&
+             append_string(&data, &length, &capacity, "\r\n");
+    }
+
+    if (config->token) {
+        snprintf(line, sizeof(line), "Authorization: Bearer %s\r\n", config->token);
+        ok = ok && append_string(&data, &length, &capacity, line);
+    }
+    size_t body_length = strlen(body);
+    if (body_length > 0 || strcmp(method, "GET") != 0) {
+        snprintf(line, sizeof(line), "Content-Length: %zu\r\n", body_length);
+        ok = ok && append_string(&data, &length, &capacity, line);
+    }
+    ok = ok && append_string(&data, &length, &capacity, "Connection: keep-alive\r\n\r\n") &&
+         append(&data, &length, &capacity, body, body_length);
+
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    out->ts_us = (uint64_t)ts->valuedouble;
+    out->data = data;
+    out->length = length;
+    return true;
+}
+
+static int compare_requests(const void* a, const void* b) {
+    const ReplayRequest* left = (const ReplayRequest*)a;
+    const ReplayRequest* right = (const ReplayRequest*)b;
+    if (left->ts_us != right->ts_us) return left->ts_us < right->ts_us ? -1 : 1;
+    return left->index < right->index ? -1 : (left->index > right->index ? 1 : 0);
+}
+
+// Loads and orders every request of a capture. Writer threads may log
+// concurrent requests slightly out of order, so they are sorted by arrival.
+static ReplayRequest* load_capture(const char* path, const ReplayConfig* config, size_t* count) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    ReplayRequest* requests = NULL;
+    size_t used = 0, capacity = 0, skipped = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+
+    while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+        if (line_length <= 1) continue;
+        if (used == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            ReplayRequest* grown = (ReplayRequest*)realloc(requests, capacity * sizeof(ReplayRequest));
+            if (!grown) break;
+            requests = grown;
+        }
+
+        cJSON* json = cJSON_Parse(line);
+        if (json && build_request(json, config, &requests[used])) {
+            requests[used].index = used;
+            used++;
+        } else {
+            skipped++;
+        }
+        cJSON_Delete(json);
+    }
+    free(line);
+    fclose(file);
+
+    if (skipped > 0) fprintf(stderr, "Skipped %zu malformed capture lines\n", skipped);
+    if (used > 0) qsort(requests, used, sizeof(ReplayRequest), compare_requests);
+    *count = used;
+    return requests;
+}
+
+static void close_connection(ReplayConnection* conn, ReplayStats* stats) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    stats->failed += conn->in_flight;
+    conn->in_flight = 0;
+    conn->out_length = 0;
+    conn->out_sent = 0;
+    conn->in_length = 0;
+}
+
+static bool ensure_connected(ReplayConnection* conn, const ReplayConfig* config) {
+    if (conn->fd >= 0) return true;
+    conn->fd = http_client_connect(config->ip, config->port);
+    if (conn->fd < 0) return false;
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+static void handle_send(ReplayConnection* conn, ReplayStats* stats) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                     conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        close_connection(conn, stats);
+        return;
+    }
+    conn->out_sent += (size_t)n;
+    if (conn->out_sent == conn->out_length) {
+        conn->out_sent = 0;
+        conn->out_length = 0;
+    }
+}
+
+static void handle_receive(ReplayConnection* conn, ReplayStats* stats) {
+    char chunk[RECV_CHUNK_SIZE];
+    ssize_t n = recv(conn->fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+    bool at_eof = n <= 0;
+    if (n > 0 && !append(&conn->in, &conn->in_length, &conn->in_capacity, chunk, (size_t)n)) {
+        close_connection(conn, stats);
+        return;
+    }
+
+    // Pipelined responses arrive back to back; take every complete one
+    size_t offset = 0;
+    while (conn->in_flight > 0 && offset < conn->in_length) {
+        HttpClientResponse response;
+        long parsed = http_client_parse_response(conn->in + offset, conn->in_length - offset,
+                                                 at_eof, &response);
+        if (parsed <= 0) break;
+        offset += (size_t)parsed;
+        conn->in_flight--;
+        stats->completed++;
+        int status_class = response.status / 100;
+        if (status_class >= 1 && status_class <= 5) stats->status_class[status_class]++;
+        http_client_response_free(&response);
+    }
+    memmove(conn->in, conn->in + offset, conn->in_length - offset);
+    conn->in_length -= offset;
+
+    if (at_eof) close_connection(conn, stats);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options] capture.jsonl\n"
+        "  -a IP        server address (default %s)\n"
+        "  -p PORT      server port (default %d)\n"
+        "  -c CONNS     connections, requests assigned round robin (default 1)\n"
+        "  -s SPEED     time scale: 1 = as captured, 2 = twice as fast,\n"
+        "               0 = as fast as possible (default 1)\n"
+        "  -w WINDOW    most requests in flight per connection (default %d)\n"
+        "  -A TOKEN     send this bearer token instead of the captured ones\n",
+        program, HTTP_CLIENT_DEFAULT_IP, HTTP_CLIENT_DEFAULT_PORT, DEFAULT_WINDOW);
+}
+
+int main(int argc, char** argv) {
+    ReplayConfig config;
+    memset(&config, 0, sizeof(config));
+    config.ip = HTTP_CLIENT_DEFAULT_IP;
+    config.port = HTTP_CLIENT_DEFAULT_PORT;
+    config.connections = 1;
+    config.speed = 1.0;
+    config.window = DEFAULT_WINDOW;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:s:w:A:h")) != -1) {
+        switch (opt) {
+            case 'a': config.ip = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.connections = (unsigned)atoi(optarg); break;
+            case 's': config.speed = atof(optarg); break;
+            case 'w': config.window = (unsigned)atoi(optarg); break;
+            case 'A': config.token = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (config.connections == 0 || config.connections > MAX_CONNECTIONS ||
+        config.window == 0 || config.speed < 0) {
+        fprintf(stderr, "Need 1..%d connections, a window of at least 1 and a speed of 0 or more\n",
+                MAX_CONNECTIONS);
+        return 1;
+    }
+
+    size_t count = 0;
+    ReplayRequest* requests = load_capture(argv[optind], &config, &count);
+    if (count == 0) {
+        fprintf(stderr, "No requests to replay\n");
+        free(requests);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ReplayConnection connections[MAX_CONNECTIONS];
+    memset(connections, 0, sizeof(connections));
+    for (unsigned i = 0; i < config.connections; i++) {
+        connections[i].fd = -1;
+    }
+    struct pollfd fds[MAX_CONNECTIONS];
+    unsigned fd_owner[MAX_CONNECTIONS];
+
+    ReplayStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t first_us = requests[0].ts_us;
+    uint64_t start = now_ns();
+    size_t next = 0;
+
+    while (stats.completed + stats.failed < count) {
+        uint64_t now = now_ns();
+
+        // Requests go out strictly in capture order: one that is not due yet,
+        // or whose connection has a full window, holds back all later ones.
+        uint64_t due = 0;
+        while (next < count) {
+            ReplayRequest* request = &requests[next];
+            due = config.speed > 0
+                ? start + (uint64_t)((double)(request->ts_us - first_us) * NS_PER_US / config.speed)
+                : now;
+            if (due > now) break;
+
+            ReplayConnection* conn = &connections[next % config.connections];
+            if (conn->in_flight >= config.window) break;
+            if (!ensure_connected(conn, &config) ||
+                !append(&conn->out, &conn->out_length, &conn->out_capacity,
+                        request->data, request->length)) {
+                stats.failed++;
+                next++;
+                continue;
+            }
+            conn->in_flight++;
+
+            uint64_t lag_us = (now - due) / NS_PER_US;
+            stats.lag_sum_us += lag_us;
+            if (lag_us > stats.lag_max_us) stats.lag_max_us = lag_us;
+            next++;
+        }
+
+        nfds_t nfds = 0;
+        for (unsigned i = 0; i < config.connections; i++) {
+            ReplayConnection* conn = &connections[i];
+            if (conn->fd < 0) continue;
+            fds[nfds].fd = conn->fd;
+            fds[nfds].events = (conn->in_flight ? POLLIN : 0) | (conn->out_length ? POLLOUT : 0);
+            fds[nfds].revents = 0;
+            fd_owner[nfds++] = i;
+        }
+
+        struct timespec timeout = {1, 0};
+        if (next < count && due > now) {
+            uint64_t wait = due - now;
+            if (wait < NS_PER_SEC) timeout = (struct timespec){0, (long)wait};
+        }
+
+        int ready = ppoll(fds, nfds, &timeout, NULL);
+        if (ready <= 0) continue;
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            ReplayConnection* conn = &connections[fd_owner[i]];
+            if ((fds[i].revents & POLLOUT) && conn->fd >= 0) handle_send(conn, &stats);
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && conn->fd >= 0) {
+                handle_receive(conn, &stats);
+            }
+        }
+    }
+
+    double elapsed = (double)(now_ns() - start) / NS_PER_SEC;
+    double captured = (double)(requests[count - 1].ts_us - first_us) / 1e6;
+    printf("Replayed %zu requests in %.3fs (captured over %.3fs), %.1f req/s\n",
+           count, elapsed, captured, elapsed > 0 ? count / elapsed : 0.0);
+    printf("Responses: 1xx=%llu 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu failed=%llu\n",
+           (unsigned long long)stats.status_class[1], (unsigned long long)stats.status_class[2],
+           (unsigned long long)stats.status_class[3], (unsigned long long)stats.status_class[4],
+           (unsigned long long)stats.status_class[5], (unsigned long long)stats.failed);
+    if (config.speed > 0) {
+        printf("Send lag behind schedule (ms): mean %.3f, max %.3f\n",
+               (double)stats.lag_sum_us / count / 1000.0, stats.lag_max_us / 1000.0);
+    }
+
+    for (unsigned i = 0; i < config.connections; i++) {
+        if (connections[i].fd >= 0) close(connections[i].fd);
+        free(connections[i].out);
+        free(connections[i].in);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(requests[i].data);
+    }
+    free(requests);
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include "response_batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define INITIAL_BATCH_CAPACITY 8
+
+LOCK_STATS_DEFINE(batch_lock_stats, "response_batch");
+
+void response_batch_init(ResponseBatch* batch) {
+    batch->responses = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->notifier = NULL;
+    profiled_mutex_init(&batch->mutex, &batch_lock_stats);
+    pthread_cond_init(&batch->cond, NULL);
+}
+
+void response_batch_destroy(ResponseBatch* batch) {
+    response_batch_reset(batch);
+    free(batch->responses);
+    batch->responses = NULL;
+    batch->capacity = 0;
+    profiled_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->cond);
+}
+
+void response_batch_reset(ResponseBatch* batch) {
+    profiled_mutex_lock(&batch->mutex);
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->responses[i].data);
+    }
+    batch->count = 0;
+    profiled_mutex_unlock(&batch->mutex);
+}
+
+long response_batch_reserve(ResponseBatch* batch) {
+    profiled_mutex_lock(&batch->mutex);
+
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : INITIAL_BATCH_CAPACITY;
+        PendingResponse* grown = (PendingResponse*)realloc(batch->responses,
+                                                           capacity * sizeof(PendingResponse));
+        if (!grown) {
+            profiled_mutex_unlock(&batch->mutex);
+            return -1;
+        }
+        batch->responses = grown;
+        batch->capacity = capacity;
+    }
+
+    size_t slot = batch->count++;
+    batch->responses[slot].data = NULL;
+    batch->responses[slot].length = 0;
+    batch->responses[slot].ready = false;
+    batch->responses[slot].close = false;
+    batch->responses[slot].trace_id = 0;
+
+    profiled_mutex_unlock(&batch->mutex);
+    return (long)slot;
+}
+
+void response_batch_complete(ResponseBatch* batch, size_t slot, char* data, size_t length) {
+    response_batch_complete_many(batch, &slot, &data, &length, NULL, 1);
+}
+
+void response_batch_complete_many(ResponseBatch* batch, const size_t* slots, char* const* data,
+                                  const size_t* lengths, const bool* closes, size_t count) {
+    profiled_mutex_lock(&batch->mutex);
+    for (size_t i = 0; i < count; i++) {
+        PendingResponse* response = &batch->responses[slots[i]];
+        response->data = data[i];
+        response->length = lengths[i];
+        response->close = closes && closes[i];
+        response->ready = true;
+    }
+    ResponseNotifier* notifier = batch->notifier;
+    pthread_cond_broadcast(&batch->cond);
+    profiled_mutex_unlock(&batch->mutex);
+
+    // The notifier outlives every batch it serves, unlike the batch itself
+    if (notifier) {
+        response_notifier_signal(notifier);
+    }
+}
+
+static size_t count_ready_locked(ResponseBatch* batch, size_t from) {
+    size_t ready = 0;
+    while (from + ready < batch->count && batch->responses[from + ready].ready) {
+        ready++;
+    }
+    return ready;
+}
+
+size_t response_batch_wait(ResponseBatch* batch, size_t from) {
+    profiled_mutex_lock(&batch->mutex);
+
+    while (!batch->responses[from].ready) {
+        profiled_cond_wait(&batch->cond, &batch->mutex);
+    }
+
+    size_t ready = count_ready_locked(batch, from);
+    profiled_mutex_unlock(&batch->mutex);
+    return ready;
+}
+
+size_t response_batch_ready(ResponseBatch* batch, size_t from) {
+    profiled_mutex_lock(&batch->mutex);
+    size_t ready = count_ready_locked(batch, from);
+    profiled_mutex_unlock(&batch->mutex);
+    return ready;
+}
+
+int response_notifier_init(ResponseNotifier* notifier) {
+    notifier->event_fd = eventfd(0, EFD_CLOEXEC);
+    atomic_init(&notifier->signalled, false);
+    return notifier->event_fd < 0 ? -1 : 0;
+}
+
+void response_notifier_destroy(ResponseNotifier* notifier) {
+    if (notifier->event_fd >= 0) {
+        close(notifier->event_fd);
+        notifier->event_fd = -1;
+    }
+}
+
+void response_notifier_signal(ResponseNotifier* notifier) {
+    if (!atomic_exchange(&notifier->signalled, true)) {
+        uint64_t one = 1;
+        ssize_t written = write(notifier->event_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+void response_notifier_clear(ResponseNotifier* notifier) {
+    atomic_store(&notifier->signalled, false);
+}
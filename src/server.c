@@ -1,16 +1,29 @@
+#define _GNU_SOURCE  // pipe2
+
 #include "socket.h"
 #include "message_queue.h"
 #include "thread_safe_data.h"
 #include "connection_handler.h"
 #include "message_processor.h"
+#include "uring_engine.h"
+#include "capture.h"
+#include "hot_restart.h"
+#include "profiled_mutex.h"
+#include "rate_limit.h"
+#include "timer_wheel.h"
+#include "cpu_budget.h"
+#include "processor_pool.h"
+#include "trace.h"
+#include "crash_handler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
-
-#define MAX_THREADS 32
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
 
 typedef struct {
     ConnectionHandler* handler;
@@ -19,19 +32,23 @@ typedef struct {
 
 ThreadSafeData shared_data;
 bool running = true;
-pthread_mutex_t running_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Wakes main() for a shutdown: written by signal handlers and by the
+// restart thread once a successor has taken over
+int wake_pipe[2] = {-1, -1};
+ProfiledMutex running_mutex;
+LOCK_STATS_DEFINE(running_lock_stats, "server.running");
 
 bool get_running_status() {
-    pthread_mutex_lock(&running_mutex);
+    profiled_mutex_lock(&running_mutex);
     bool status = running;
-    pthread_mutex_unlock(&running_mutex);
+    profiled_mutex_unlock(&running_mutex);
     return status;
 }
 
 void set_running_status(bool status) {
-    pthread_mutex_lock(&running_mutex);
+    profiled_mutex_lock(&running_mutex);
     running = status;
-    pthread_mutex_unlock(&running_mutex);
+    profiled_mutex_unlock(&running_mutex);
 }
 
 void* worker_thread(void* arg) {
@@ -39,106 +56,529 @@ void* worker_thread(void* arg) {
     ConnectionHandler* handler = args->handler;
     Socket* server = args->server;
     
-    while (get_running_status()) {
-        int client_fd;
-        char client_ip[INET_ADDRSTRLEN];
+    // The listening socket is non-blocking and may be shared with another
+    // server process, so wait for a connection, the drain, or a parked
+    // connection's next request before accepting
+    struct pollfd pfds[3] = {
+        {.fd = socket_get_fd(server), .events = POLLIN},
+        {.fd = handler->drain_fd, .events = POLLIN},
+        {.fd = connection_handler_park_fd(handler), .events = POLLIN},
+    };
+    
+    // Once accepting stops, parked connections are still served until
+    // they close or the drain grace period closes them
+    for (;;) {
+        bool accepting = get_running_status() && !connection_handler_draining(handler);
+        if (!accepting && connection_handler_parked(handler) == 0) break;
+        pfds[0].fd = accepting ? socket_get_fd(server) : -1;
+        pfds[1].fd = accepting ? handler->drain_fd : -1;
         
-        if (socket_accept(server, &client_fd, client_ip) != 0) {
-            if (get_running_status()) {
-                fprintf(stderr, "Accept error: %s\n", strerror(errno));
-            }
-            continue;
+        int ready = poll(pfds, 3, CONNECTION_PARK_SWEEP_MS);
+        connection_handler_expire(handler, timer_now_ms());
+        if (ready <= 0) continue;
+        
+        if (pfds[2].revents & POLLIN) {
+            connection_handler_resume(handler);
         }
+        if (!(pfds[0].revents & POLLIN)) continue;
+        
+        int client_fd;
+        char client_ip[INET_ADDRSTRLEN];
+        uint32_t client_addr;
+        if (socket_accept(server, &client_fd, client_ip, &client_addr) != 0) continue;
         
         printf("New connection from: %s\n", client_ip);
-        connection_handler_handle(handler, client_fd);
+        connection_handler_handle(handler, client_fd, client_addr);
     }
     return NULL;
 }
 
-void* processor_thread(void* arg) {
-    MessageProcessor* processor = (MessageProcessor*)arg;
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--io-engine threads|uring]\n"
+            "          [--header-timeout ms] [--body-timeout ms]\n"
+            "          [--idle-timeout ms] [--write-timeout ms] [--request-deadline ms]\n"
+            "          [--capture file.jsonl] [--capture-sample n]\n"
+            "          [--restart-socket path]\n"
+            "          [--rate-limit req/s] [--rate-burst n] [--max-conns-per-ip n]\n"
+            "          [--run-to-completion all|fast] [--processors min[:max]]\n"
+            "          [--trace-sample n]\n"
+            "          [--import-users users.json] [--export-users users.json]\n"
+            "          [--import-data username]\n",
+            program);
+}
+
+static void handle_shutdown_signal(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    ssize_t written = write(wake_pipe[1], "S", 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+static bool install_shutdown_handlers(void) {
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("Failed to create wake pipe");
+        return false;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_shutdown_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    return true;
+}
+
+// Blocks until Enter is pressed, SIGINT or SIGTERM arrives, or a successor
+// has taken over the listening socket. Without a terminal on stdin only the
+// last two apply.
+static void wait_for_shutdown(void) {
+    struct pollfd pfds[2] = {
+        {.fd = wake_pipe[0], .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+    nfds_t nfds = 2;
     
-    while (get_running_status()) {
-        message_processor_start(processor);
+    for (;;) {
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        if (pfds[0].revents) return;
+        if (pfds[1].revents) {
+            char input[64];
+            ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+            if (n > 0) return;
+            if (n == 0 || errno != EINTR) nfds = 1;
+        }
     }
-    return NULL;
 }
 
-int main() {
+static bool parse_timeout(const char* arg, unsigned* out) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value == 0 || value > 3600000) {
+        fprintf(stderr, "Invalid timeout: %s (1..3600000 ms)\n", arg);
+        return false;
+    }
+    *out = (unsigned)value;
+    return true;
+}
+
+// "n" for a fixed pool, or "min:max"
+static bool parse_processors(const char* arg, ProcessorPoolConfig* config) {
+    char* end;
+    unsigned long min = strtoul(arg, &end, 10);
+    unsigned long max = min;
+    if (*end == ':') max = strtoul(end + 1, &end, 10);
+    if (*arg == '\0' || *end != '\0' || min == 0 || max < min || max > PROCESSOR_POOL_MAX_THREADS) {
+        fprintf(stderr, "Invalid processors: %s (min[:max], 1..%d)\n", arg, PROCESSOR_POOL_MAX_THREADS);
+        return false;
+    }
+    config->min_threads = (unsigned)min;
+    config->max_threads = (unsigned)max;
+    return true;
+}
+
+static bool parse_limit(const char* arg, const char* name, unsigned max, unsigned* out) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value == 0 || value > max) {
+        fprintf(stderr, "Invalid %s: %s (1..%u)\n", name, arg, max);
+        return false;
+    }
+    *out = (unsigned)value;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
     MessageQueue message_queue;
     Socket server;
     ConnectionHandler handler;
     MessageProcessor processor;
+    UringEngine uring_engine;
+    bool use_uring = false;
+    Capture capture;
+    const char* capture_path = NULL;
+    unsigned capture_sample = 1;
+    HotRestart hot_restart;
+    const char* restart_path = NULL;
+    const char* import_path = NULL;
+    const char* export_path = NULL;
+    const char* data_owner = NULL;
+    RateLimiter rate_limiter;
+    RateLimitConfig rate_config = {0, 0, 0};
+    ProcessorPool processor_pool;
+    ProcessorPoolConfig pool_config = {0, 0, 0, 0};
+    unsigned trace_every = 0;
+    
+    install_crash_handler();
+    memset(&hot_restart, 0, sizeof(hot_restart));
+    profiled_mutex_init(&running_mutex, &running_lock_stats);
+    
+    connection_handler_init(&handler, &message_queue);
+    ConnectionTimeouts* timeouts = &handler.timeouts;
+    
+    static const struct option long_options[] = {
+        {"io-engine", required_argument, NULL, 'e'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"body-timeout", required_argument, NULL, 'B'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"write-timeout", required_argument, NULL, 'W'},
+        {"request-deadline", required_argument, NULL, 'D'},
+        {"capture", required_argument, NULL, 'c'},
+        {"capture-sample", required_argument, NULL, 'S'},
+        {"restart-socket", required_argument, NULL, 'R'},
+        {"import-users", required_argument, NULL, 'i'},
+        {"export-users", required_argument, NULL, 'x'},
+        {"import-data", required_argument, NULL, 'd'},
+        {"rate-limit", required_argument, NULL, 'r'},
+        {"rate-burst", required_argument, NULL, 'b'},
+        {"max-conns-per-ip", required_argument, NULL, 'C'},
+        {"run-to-completion", required_argument, NULL, 'T'},
+        {"processors", required_argument, NULL, 'P'},
+        {"trace-sample", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    use_uring = true;
+                } else if (strcmp(optarg, "threads") != 0) {
+                    fprintf(stderr, "Unknown I/O engine: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'H':
+                if (!parse_timeout(optarg, &timeouts->header_ms)) return 1;
+                break;
+            case 'B':
+                if (!parse_timeout(optarg, &timeouts->body_ms)) return 1;
+                break;
+            case 'I':
+                if (!parse_timeout(optarg, &timeouts->idle_ms)) return 1;
+                break;
+            case 'W':
+                if (!parse_timeout(optarg, &timeouts->write_ms)) return 1;
+                break;
+            case 'D':
+                if (!parse_timeout(optarg, &timeouts->deadline_ms)) return 1;
+                break;
+            case 'c':
+                capture_path = optarg;
+                break;
+            case 'S': {
+                char* end;
+                unsigned long value = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value == 0 || value > 1000000) {
+                    fprintf(stderr, "Invalid capture sample: %s (1..1000000)\n", optarg);
+                    return 1;
+                }
+                capture_sample = (unsigned)value;
+                break;
+            }
+            case 'R':
+                restart_path = optarg;
+                break;
+            case 'i':
+                import_path = optarg;
+                break;
+            case 'x':
+                export_path = optarg;
+                break;
+            case 'd':
+                data_owner = optarg;
+                break;
+            case 'r':
+                if (!parse_limit(optarg, "rate limit", 1000000, &rate_config.requests_per_sec)) return 1;
+                break;
+            case 'b':
+                if (!parse_limit(optarg, "rate burst", 1000000, &rate_config.burst)) return 1;
+                break;
+            case 'C':
+                if (!parse_limit(optarg, "connection limit", 1000000, &rate_config.max_connections)) return 1;
+                break;
+            case 'T':
+                if (strcmp(optarg, "all") == 0) {
+                    handler.dispatch_mode = DISPATCH_INLINE;
+                } else if (strcmp(optarg, "fast") == 0) {
+                    handler.dispatch_mode = DISPATCH_INLINE_FAST;
+                } else {
+                    fprintf(stderr, "Unknown run-to-completion mode: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (!parse_processors(optarg, &pool_config)) return 1;
+                break;
+            case 't':
+                if (!parse_limit(optarg, "trace sample", 1000000, &trace_every)) return 1;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
     
-    pthread_t workers[MAX_THREADS];
-    pthread_t processors[MAX_THREADS/2];
-    unsigned num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (rate_config.burst && !rate_config.requests_per_sec) {
+        fprintf(stderr, "--rate-burst needs --rate-limit\n");
+        return 1;
+    }
     
-    // Initialize components
-    if (socket_init(&server, AF_INET, SOCK_STREAM, 0) != 0) {
-        fprintf(stderr, "Socket initialization failed\n");
+    if (use_uring && !uring_engine_available()) {
+        fprintf(stderr, "Server was built without io_uring support (make IO_URING=1)\n");
         return 1;
     }
     
-    if (socket_bind(&server, 8080, "0.0.0.0") != 0) {
-        fprintf(stderr, "Bind failed\n");
-        socket_destroy(&server);
+    // JSON is only an interchange format; the server loads the binary snapshot.
+    // The data import is the one-time split of the old shared data file.
+    if (import_path || export_path || data_owner) {
+        tsd_init(&shared_data);
+        size_t imported = 0;
+        bool success = true;
+        if (import_path) {
+            success = tsd_import_users(&shared_data, import_path, &imported);
+            if (success) printf("Imported %zu users from %s\n", imported, import_path);
+        }
+        if (success && data_owner) {
+            size_t bytes = 0;
+            success = tsd_import_legacy_text(&shared_data, data_owner, &bytes);
+            if (success) printf("Moved %zu bytes from %s to %s\n",
+                                bytes, TSD_LEGACY_DATA_FILENAME, data_owner);
+        }
+        if (success && export_path) {
+            success = tsd_export_users(&shared_data, export_path);
+            if (success) printf("Exported %zu users to %s\n",
+                                user_directory_count(&shared_data.users), export_path);
+        }
+        tsd_destroy(&shared_data);
+        connection_handler_destroy(&handler);
+        return success ? 0 : 1;
+    }
+    
+    // One I/O thread per CPU the process may actually use. Processors
+    // start at half that and follow the load, up to twice as many, since
+    // they also wait on files
+    CpuBudget budget;
+    cpu_budget_detect(&budget);
+    unsigned num_threads = budget.cpus;
+    if (pool_config.max_threads == 0) {
+        pool_config.min_threads = num_threads / 2 ? num_threads / 2 : 1;
+        pool_config.max_threads = num_threads * 2;
+        if (pool_config.max_threads > PROCESSOR_POOL_MAX_THREADS) {
+            pool_config.max_threads = PROCESSOR_POOL_MAX_THREADS;
+        }
+    }
+    if (budget.quota > 0) {
+        printf("CPU budget: %u (%u CPUs, cgroup limit %.2f)\n", budget.cpus, budget.online, budget.quota);
+    } else {
+        printf("CPU budget: %u\n", budget.cpus);
+    }
+    
+    pthread_t* workers = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (!workers) {
+        perror("Failed to allocate worker threads");
         return 1;
     }
     
-    if (socket_listen(&server, 10) != 0) {
-        fprintf(stderr, "Listen failed\n");
+    if (!install_shutdown_handlers()) return 1;
+    
+    // Take the listening socket over from a running server if there is one
+    int handoff_fd = -1;
+    int inherited_fd = restart_path ? hot_restart_takeover(restart_path, &handoff_fd) : -1;
+    if (inherited_fd >= 0) {
+        socket_init_from_fd(&server, inherited_fd);
+        printf("Took over the listening socket from the running server\n");
+    } else {
+        // Initialize components
+        if (socket_init(&server, AF_INET, SOCK_STREAM, 0) != 0) {
+            fprintf(stderr, "Socket initialization failed\n");
+            return 1;
+        }
+        
+        if (socket_bind(&server, 8080, "0.0.0.0") != 0) {
+            fprintf(stderr, "Bind failed\n");
+            socket_destroy(&server);
+            return 1;
+        }
+        
+        if (socket_listen(&server, 10) != 0) {
+            fprintf(stderr, "Listen failed\n");
+            socket_destroy(&server);
+            return 1;
+        }
+    }
+    
+    // Accepting threads poll first, and another process may accept the
+    // connection in between
+    if (socket_set_nonblocking(&server, true) != 0) {
         socket_destroy(&server);
         return 1;
     }
     
-    message_queue_init(&message_queue, 1000);
+    // Reads are cheap and get most of the processors when everything is
+    // busy; a storm of signups or logins fills only its own lane
+    static const MessageLaneConfig lanes[MESSAGE_CLASS_COUNT] = {
+        [MESSAGE_CLASS_READ] = {1000, 8},
+        [MESSAGE_CLASS_WRITE] = {500, 3},
+        [MESSAGE_CLASS_AUTH] = {250, 1},
+    };
+    message_queue_init_lanes(&message_queue, lanes);
     tsd_init(&shared_data);
-    connection_handler_init(&handler, &message_queue);
+    if (access(TSD_LEGACY_DATA_FILENAME, F_OK) == 0) {
+        fprintf(stderr, "%s from an earlier version is not served; "
+                "run once with --import-data <username> to give it to that user\n",
+                TSD_LEGACY_DATA_FILENAME);
+    }
     message_processor_init(&processor, &message_queue, &shared_data);
+    processor.draining = &handler.draining;
+    handler.processor = &processor;
+    
+    if (capture_path) {
+        if (!capture_start(&capture, capture_path, capture_sample)) {
+            socket_destroy(&server);
+            return 1;
+        }
+        handler.capture = &capture;
+        printf("Capturing 1 in %u requests to %s\n", capture_sample, capture_path);
+    }
+    
+    if (rate_config.requests_per_sec || rate_config.max_connections) {
+        if (!rate_limiter_init(&rate_limiter, &rate_config, timer_now_ms())) {
+            socket_destroy(&server);
+            return 1;
+        }
+        handler.rate_limiter = &rate_limiter;
+        printf("Limiting each client address to %u req/s (burst %u) and %u connections (0 = unlimited)\n",
+               rate_limiter.config.requests_per_sec, rate_limiter.config.burst,
+               rate_limiter.config.max_connections);
+    }
+    
+    if (handler.dispatch_mode == DISPATCH_INLINE) {
+        printf("Running every request to completion on its connection's thread\n");
+    } else if (handler.dispatch_mode == DISPATCH_INLINE_FAST) {
+        printf("Running requests on their connection's thread; signup and login go to the processors\n");
+    }
+    
+    if (trace_every) {
+        trace_configure(trace_every);
+        printf("Tracing 1 in %u requests; GET /stats/trace for the spans\n", trace_every);
+    }
     
     printf("Server running on port 8080...\n");
     
-    // Create worker threads
+    // Create worker threads, or the io_uring threads that replace them
     ThreadArgs worker_args = {&handler, &server};
-    for (unsigned i = 0; i < num_threads; ++i) {
-        if (pthread_create(&workers[i], NULL, worker_thread, &worker_args) != 0) {
-            perror("Failed to create worker thread");
+    if (use_uring) {
+        if (!uring_engine_start(&uring_engine, &handler, socket_get_fd(&server), num_threads)) {
+            fprintf(stderr, "Failed to start io_uring engine\n");
             set_running_status(false);
-            break;
+        } else {
+            printf("Using io_uring I/O engine with %u threads\n", num_threads);
+        }
+    } else {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            if (pthread_create(&workers[i], NULL, worker_thread, &worker_args) != 0) {
+                perror("Failed to create worker thread");
+                set_running_status(false);
+                break;
+            }
         }
     }
     
     // Create processor threads
-    for (unsigned i = 0; i < num_threads/2; ++i) {
-        if (pthread_create(&processors[i], NULL, processor_thread, &processor) != 0) {
-            perror("Failed to create processor thread");
-            set_running_status(false);
-            break;
-        }
+    bool pool_started = processor_pool_start(&processor_pool, &processor, &pool_config);
+    if (pool_started) {
+        printf("Processor threads: %u, adjusted between %u and %u\n",
+               processor_pool_size(&processor_pool), processor_pool.config.min_threads,
+               processor_pool.config.max_threads);
+    } else {
+        set_running_status(false);
+    }
+    
+    // The previous server drains only once this one is accepting
+    if (handoff_fd >= 0 && !hot_restart_confirm(handoff_fd)) {
+        fprintf(stderr, "Failed to confirm the takeover\n");
+    }
+    if (restart_path &&
+        !hot_restart_listen(&hot_restart, restart_path, socket_get_fd(&server), wake_pipe[1])) {
+        fprintf(stderr, "Hot restart unavailable\n");
     }
     
     printf("Press Enter to shutdown...\n");
-    getchar();
+    wait_for_shutdown();
     set_running_status(false);
+    hot_restart_stop(&hot_restart);
+    bool handed_off = hot_restart_handed_off(&hot_restart);
+    printf(handed_off ? "Successor took over; draining connections...\n"
+                      : "Shutting down; draining connections...\n");
     
-    // Cleanup
-    socket_destroy(&server);
-    message_queue_shutdown(&message_queue);
-    
-    // Wait for threads
+    // Stop accepting and let every connection finish what it started
+    connection_handler_drain(&handler);
+    if (use_uring) {
+        uring_engine_drain(&uring_engine);
+    }
     for (unsigned i = 0; i < num_threads; ++i) {
         if (workers[i]) pthread_join(workers[i], NULL);
     }
     
-    for (unsigned i = 0; i < num_threads/2; ++i) {
-        if (processors[i]) pthread_join(processors[i], NULL);
+    // With every connection closed, nothing more reaches the queue
+    message_processor_stop(&processor);
+    message_queue_shutdown(&message_queue);
+    if (atomic_load(&processor.expired)) {
+        printf("Dropped %lu requests that outlived their deadline in the queue\n",
+               (unsigned long)atomic_load(&processor.expired));
+    }
+    if (pool_started) {
+        printf("Processor pool grew %lu and shrank %lu times\n",
+               (unsigned long)atomic_load(&processor_pool.grown),
+               (unsigned long)atomic_load(&processor_pool.shrunk));
+        processor_pool_stop(&processor_pool);
+    }
+    free(workers);
+    
+    // The successor keeps accepting on the shared socket
+    if (handed_off) {
+        socket_release(&server);
+    } else {
+        socket_destroy(&server);
+    }
+    
+    if (use_uring) {
+        uring_engine_destroy(&uring_engine);
+    }
+    if (handler.capture) {
+        capture_stop(handler.capture);
+    }
+    if (handler.rate_limiter) {
+        printf("Rate limiting refused %llu connections and %llu requests\n",
+               (unsigned long long)atomic_load(&rate_limiter.rejected_connections),
+               (unsigned long long)atomic_load(&rate_limiter.rejected_requests));
+        rate_limiter_destroy(handler.rate_limiter);
     }
     
     // Final cleanup
-    pthread_mutex_destroy(&running_mutex);
+    connection_handler_destroy(&handler);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    profiled_mutex_destroy(&running_mutex);
     message_queue_destroy(&message_queue);
+    // The successor owns the user files now and checkpoints them itself
+    if (!handed_off) {
+        tsd_checkpoint_users(&shared_data);
+    }
     tsd_destroy(&shared_data);
     
     return 0;
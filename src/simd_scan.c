@@ -0,0 +1,182 @@
+#include "simd_scan.h"
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SCAN_X86 1
+#endif
+
+typedef struct {
+    SimdScanKernel kernel;
+    size_t (*scan_byte)(const char* data, size_t length, char c);
+    size_t (*scan_header_end)(const char* data, size_t length);
+} ScanKernels;
+
+// Checks the bytes after the '\n' at offset i for the rest of an empty
+// line. Returns the end of the headers, 0 if this '\n' does not start one,
+// or SIZE_MAX if data ends before that can be told.
+static inline size_t header_end_at(const char* data, size_t length, size_t i) {
+    if (i + 1 >= length) return SIZE_MAX;
+    if (data[i+1] == '\n') return i + 2;
+    if (data[i+1] != '\r') return 0;
+    if (i + 2 >= length) return SIZE_MAX;
+    return data[i+2] == '\n' ? i + 3 : 0;
+}
+
+static size_t scalar_scan_byte(const char* data, size_t length, char c) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == c) return i;
+    }
+    return length;
+}
+
+static size_t scalar_scan_header_end(const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] != '\n') continue;
+        size_t end = header_end_at(data, length, i);
+        if (end == SIZE_MAX) return 0;
+        if (end) return end;
+    }
+    return 0;
+}
+
+// Tries each '\n' marked in mask, a bitmap of the block starting at base
+static inline size_t header_end_in_mask(const char* data, size_t length, size_t base,
+                                        uint32_t mask, bool* done) {
+    while (mask) {
+        size_t end = header_end_at(data, length, base + (size_t)__builtin_ctz(mask));
+        if (end) {
+            *done = true;
+            return end == SIZE_MAX ? 0 : end;
+        }
+        mask &= mask - 1;
+    }
+    return 0;
+}
+
+#ifdef SIMD_SCAN_X86
+
+// Loads are unaligned and never run past length; the last partial block
+// is left to the narrower kernel. The AVX2 kernels clear the upper register
+// halves before returning, since unoptimised builds do not do it for them
+// and the SSE code in libc would then pay a transition penalty.
+
+static size_t sse2_scan_byte(const char* data, size_t length, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + scalar_scan_byte(data + i, length - i, c);
+}
+
+static size_t sse2_scan_header_end(const char* data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        bool done = false;
+        size_t end = header_end_in_mask(data, length, i, mask, &done);
+        if (done) return end;
+    }
+    // A '\n' in the tail can only be checked against bytes that follow it,
+    // so restart the scalar search where the vector one stopped
+    size_t end = scalar_scan_header_end(data + i, length - i);
+    return end ? i + end : 0;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_scan_byte(const char* data, size_t length, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask) {
+            _mm256_zeroupper();
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return i + sse2_scan_byte(data + i, length - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_scan_header_end(const char* data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        bool done = false;
+        size_t end = header_end_in_mask(data, length, i, mask, &done);
+        if (done) {
+            _mm256_zeroupper();
+            return end;
+        }
+    }
+    _mm256_zeroupper();
+    size_t end = sse2_scan_header_end(data + i, length - i);
+    return end ? i + end : 0;
+}
+
+#endif // SIMD_SCAN_X86
+
+static const ScanKernels KERNELS[] = {
+    {SIMD_SCAN_SCALAR, scalar_scan_byte, scalar_scan_header_end},
+#ifdef SIMD_SCAN_X86
+    {SIMD_SCAN_SSE2, sse2_scan_byte, sse2_scan_header_end},
+    {SIMD_SCAN_AVX2, avx2_scan_byte, avx2_scan_header_end},
+#endif
+};
+
+// Set once before main() and only changed again by simd_scan_select
+static const ScanKernels* active = &KERNELS[0];
+
+static bool kernel_supported(SimdScanKernel kernel) {
+#ifdef SIMD_SCAN_X86
+    __builtin_cpu_init();
+    if (kernel == SIMD_SCAN_SSE2) return __builtin_cpu_supports("sse2");
+    if (kernel == SIMD_SCAN_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+    return kernel == SIMD_SCAN_SCALAR;
+}
+
+__attribute__((constructor))
+static void pick_kernel(void) {
+    for (size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); i++) {
+        if (kernel_supported(KERNELS[i].kernel)) active = &KERNELS[i];
+    }
+}
+
+size_t simd_scan_byte(const char* data, size_t length, char c) {
+    return active->scan_byte(data, length, c);
+}
+
+size_t simd_scan_header_end(const char* data, size_t length) {
+    return active->scan_header_end(data, length);
+}
+
+SimdScanKernel simd_scan_kernel(void) {
+    return active->kernel;
+}
+
+const char* simd_scan_kernel_name(SimdScanKernel kernel) {
+    switch (kernel) {
+        case SIMD_SCAN_SSE2: return "sse2";
+        case SIMD_SCAN_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+bool simd_scan_select(SimdScanKernel kernel) {
+    for (size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); i++) {
+        if (KERNELS[i].kernel == kernel && kernel_supported(kernel)) {
+            active = &KERNELS[i];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,181 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// Entries are checksummed and written this many at a time
+#define WRITE_CHUNK_ENTRIES 1024
+
+static uint32_t checksum(uint32_t crc, const void* data, size_t length) {
+    // crc32 takes a uInt length, so feed large regions in pieces
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (length > 0) {
+        uInt piece = length > (1u << 30) ? (1u << 30) : (uInt)length;
+        crc = (uint32_t)crc32(crc, bytes, piece);
+        bytes += piece;
+        length -= piece;
+    }
+    return crc;
+}
+
+SnapshotStatus snapshot_open(Snapshot* snapshot, const char* path) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) return SNAPSHOT_MISSING;
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        return SNAPSHOT_INVALID;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Snapshot %s is truncated\n", path);
+        close(fd);
+        return SNAPSHOT_INVALID;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map snapshot %s: %s\n", path, strerror(errno));
+        return SNAPSHOT_INVALID;
+    }
+
+    const SnapshotHeader* header = (const SnapshotHeader*)map;
+    size_t body_size = size - sizeof(SnapshotHeader);
+    const char* problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "is not a user snapshot";
+    } else if (header->version != SNAPSHOT_VERSION ||
+               header->header_size != sizeof(SnapshotHeader)) {
+        problem = "has an unsupported version";
+    } else if (header->user_count > body_size / sizeof(SnapshotEntry) ||
+               header->user_count * sizeof(SnapshotEntry) + header->strings_size != body_size) {
+        problem = "is truncated";
+    } else if (checksum((uint32_t)crc32(0, Z_NULL, 0), header + 1, body_size) != header->crc) {
+        problem = "fails its checksum";
+    }
+    if (problem) {
+        fprintf(stderr, "Snapshot %s %s\n", path, problem);
+        munmap(map, size);
+        return SNAPSHOT_INVALID;
+    }
+
+    // Index lookups are random, so skip the kernel's sequential readahead
+    madvise(map, size, MADV_RANDOM);
+
+    snapshot->map = map;
+    snapshot->map_size = size;
+    snapshot->count = (size_t)header->user_count;
+    snapshot->entries = (const SnapshotEntry*)(header + 1);
+    snapshot->strings = (const char*)(snapshot->entries + snapshot->count);
+    return SNAPSHOT_OK;
+}
+
+void snapshot_close(Snapshot* snapshot) {
+    if (snapshot->map) {
+        munmap(snapshot->map, snapshot->map_size);
+    }
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+static int compare_entry(const Snapshot* snapshot, size_t index,
+                         const char* username, size_t length) {
+    const SnapshotEntry* entry = &snapshot->entries[index];
+    size_t common = entry->username_length < length ? entry->username_length : length;
+    int order = memcmp(snapshot->strings + entry->offset, username, common);
+    if (order != 0) return order;
+    if (entry->username_length == length) return 0;
+    return entry->username_length < length ? -1 : 1;
+}
+
+long snapshot_find(const Snapshot* snapshot, const char* username) {
+    size_t length = strlen(username);
+    size_t low = 0;
+    size_t high = snapshot->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int order = compare_entry(snapshot, mid, username, length);
+        if (order == 0) return (long)mid;
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+SnapshotUser snapshot_user(const Snapshot* snapshot, size_t index) {
+    const SnapshotEntry* entry = &snapshot->entries[index];
+    const char* username = snapshot->strings + entry->offset;
+    SnapshotUser user = {username, username + entry->username_length + 1};
+    return user;
+}
+
+static bool write_checked(FILE* file, const void* data, size_t length, uint32_t* crc) {
+    *crc = checksum(*crc, data, length);
+    return fwrite(data, 1, length, file) == length;
+}
+
+bool snapshot_write(const char* path, const SnapshotUser* users, size_t count) {
+    char temp_path[512];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE* file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to create snapshot %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.user_count = count;
+
+    // Header last, once the checksum is known
+    bool ok = fseek(file, sizeof(header), SEEK_SET) == 0;
+    uint32_t crc = (uint32_t)crc32(0, Z_NULL, 0);
+
+    SnapshotEntry chunk[WRITE_CHUNK_ENTRIES];
+    uint64_t offset = 0;
+    for (size_t i = 0; ok && i < count; i += WRITE_CHUNK_ENTRIES) {
+        size_t n = count - i < WRITE_CHUNK_ENTRIES ? count - i : WRITE_CHUNK_ENTRIES;
+        for (size_t j = 0; j < n; j++) {
+            const SnapshotUser* user = &users[i + j];
+            chunk[j].offset = offset;
+            chunk[j].username_length = (uint32_t)strlen(user->username);
+            chunk[j].hash_length = (uint32_t)strlen(user->password_hash);
+            offset += chunk[j].username_length + chunk[j].hash_length + 2;
+        }
+        ok = write_checked(file, chunk, n * sizeof(SnapshotEntry), &crc);
+    }
+    header.strings_size = offset;
+
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = write_checked(file, users[i].username, strlen(users[i].username) + 1, &crc) &&
+             write_checked(file, users[i].password_hash, strlen(users[i].password_hash) + 1, &crc);
+    }
+    header.crc = crc;
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0) ok = false;
+
+    if (!ok || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to write snapshot %s: %s\n", path, strerror(errno));
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
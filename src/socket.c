@@ -1,5 +1,6 @@
 #include "socket.h"
 #include <stdio.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <stdlib.h>
 
@@ -38,6 +39,23 @@ void socket_destroy(Socket* sock) {
     }
 }
 
+void socket_release(Socket* sock) {
+    if (sock->sockfd != -1) {
+        close(sock->sockfd);
+        sock->sockfd = -1;
+    }
+}
+
+int socket_set_nonblocking(Socket* sock, bool enable) {
+    int flags = fcntl(sock->sockfd, F_GETFL, 0);
+    if (flags < 0 ||
+        fcntl(sock->sockfd, F_SETFL, enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 int socket_set_reuse_addr(Socket* sock, bool enable) {
     int opt = enable ? 1 : 0;
     if (setsockopt(sock->sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
@@ -83,19 +101,25 @@ int socket_listen(Socket* sock, int backlog) {
     return 0;
 }
 
-int socket_accept(Socket* sock, int* client_fd, char* client_ip) {
+int socket_accept(Socket* sock, int* client_fd, char* client_ip, uint32_t* client_addr_out) {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     
     *client_fd = accept(sock->sockfd, (struct sockaddr*)&client_addr, &client_len);
     if (*client_fd < 0) {
-        fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+        // A non-blocking listener shared with other threads often loses the race
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+        }
         return -1;
     }
 
     if (client_ip != NULL) {
         inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
     }
+    if (client_addr_out != NULL) {
+        *client_addr_out = client_addr.sin_addr.s_addr;
+    }
     
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "thread_safe_data.h"
 #include "debug_macros.h"
+#include "auth.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,195 +8,625 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <libgen.h> // For dirname
+#include <time.h>
+#include <openssl/rand.h>
+
+#define INITIAL_PARTITION_BUCKETS 256
 
 static const char* AUTH_FILENAME = "users.json";
-static const char* DATA_FILENAME = "data.txt";
+static const char* SNAPSHOT_FILENAME = "users.snapshot";
+static const char* JOURNAL_FILENAME = "users.journal";
+static const char* TOKEN_KEY_FILENAME = "token.key";
+static const char* DATA_DIRECTORY = "data";
+
+LOCK_STATS_DEFINE(users_lock_stats, "tsd.users");
+LOCK_STATS_DEFINE(partitions_read_lock_stats, "tsd.partitions.read");
+LOCK_STATS_DEFINE(partitions_write_lock_stats, "tsd.partitions.write");
+LOCK_STATS_DEFINE(partition_lock_stats, "tsd.partition");
+LOCK_STATS_DEFINE(partition_cache_lock_stats, "tsd.partition_cache");
 
 // Forward declarations
 static void load_from_file(ThreadSafeData* tsd);
-bool save_to_file_unlocked(ThreadSafeData* tsd);
-static bool ensure_directory_exists(const char* filepath);
+static void load_token_key(ThreadSafeData* tsd);
+static char* read_text_unlocked(DataPartition* partition, size_t* length);
 
 void tsd_init(ThreadSafeData* tsd) {
     tsd->auth_filename = strdup(AUTH_FILENAME);
-    tsd->data_filename = strdup(DATA_FILENAME);
-    if (pthread_mutex_init(&tsd->mutex, NULL) != 0) {
+    tsd->data_directory = strdup(DATA_DIRECTORY);
+    profiled_mutex_init(&tsd->mutex, &users_lock_stats);
+    if (!profiled_rwlock_init(&tsd->partitions_lock, &partitions_read_lock_stats,
+                              &partitions_write_lock_stats)) {
         DEBUG_PRINT("Mutex init failed\n");
         exit(EXIT_FAILURE);
     }
-    tsd->auth_data = NULL;
+    if (mkdir(tsd->data_directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", tsd->data_directory, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    tsd->text_epoch = ((unsigned long)time(NULL) << 16) ^ (unsigned long)getpid();
+    tsd->partitions = NULL;
+    tsd->partition_buckets = 0;
+    tsd->partition_count = 0;
+    tsd->evict_bucket = 0;
+    atomic_init(&tsd->generation_clock, 1);
+    atomic_init(&tsd->cached_bytes, 0);
+    load_token_key(tsd);
     load_from_file(tsd);
 }
 
-void tsd_destroy(ThreadSafeData* tsd) {
-    pthread_mutex_lock(&tsd->mutex);
-    if (tsd->auth_data) {
-        cJSON_Delete(tsd->auth_data);
-        tsd->auth_data = NULL;
+static void free_partition(DataPartition* partition) {
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        free(partition->encoded_text[i].data);
     }
+    profiled_mutex_destroy(&partition->mutex);
+    profiled_mutex_destroy(&partition->cache_mutex);
+    free(partition->owner);
+    free(partition->filename);
+    free(partition);
+}
+
+void tsd_destroy(ThreadSafeData* tsd) {
+    profiled_mutex_lock(&tsd->mutex);
+    user_directory_close(&tsd->users);
     free(tsd->auth_filename);
-    free(tsd->data_filename);
-    pthread_mutex_unlock(&tsd->mutex);
-    pthread_mutex_destroy(&tsd->mutex);
+    free(tsd->data_directory);
+    profiled_mutex_unlock(&tsd->mutex);
+    profiled_mutex_destroy(&tsd->mutex);
+
+    for (size_t i = 0; i < tsd->partition_buckets; i++) {
+        DataPartition* partition = tsd->partitions[i];
+        while (partition) {
+            DataPartition* next = partition->next;
+            free_partition(partition);
+            partition = next;
+        }
+    }
+    free(tsd->partitions);
+    tsd->partitions = NULL;
+    profiled_rwlock_destroy(&tsd->partitions_lock);
+    memset(tsd->token_key, 0, sizeof(tsd->token_key));
 }
 
-// Ensure directory exists
-static bool ensure_directory_exists(const char* filepath) {
-    char* path_copy = strdup(filepath);
-    if (!path_copy) return false;
-    
-    char* dir = dirname(path_copy);
-    
-    // Check if the directory path is just "." (current directory)
-    if (strcmp(dir, ".") == 0) {
-        free(path_copy);
-        return true; // Current directory always exists
+// The key lives in a file so tokens stay valid across restarts, including
+// a hot restart where both servers accept the same clients
+static void load_token_key(ThreadSafeData* tsd) {
+    int fd = open(TOKEN_KEY_FILENAME, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, tsd->token_key, sizeof(tsd->token_key));
+        close(fd);
+        if (n == (ssize_t)sizeof(tsd->token_key)) return;
+        fprintf(stderr, "%s is damaged; issuing a new key\n", TOKEN_KEY_FILENAME);
+    }
+
+    if (RAND_bytes(tsd->token_key, sizeof(tsd->token_key)) != 1) {
+        fprintf(stderr, "Cannot generate a token key\n");
+        exit(EXIT_FAILURE);
+    }
+    char temp_filename[256];
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", TOKEN_KEY_FILENAME);
+    fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool saved = fd >= 0 &&
+                 write(fd, tsd->token_key, sizeof(tsd->token_key)) == (ssize_t)sizeof(tsd->token_key);
+    if (fd >= 0) close(fd);
+    if (!saved || rename(temp_filename, TOKEN_KEY_FILENAME) != 0) {
+        // Still usable; tokens just end with this process
+        fprintf(stderr, "Failed to save %s: %s\n", TOKEN_KEY_FILENAME, strerror(errno));
+        remove(temp_filename);
     }
-    
-    // Try to create directory tree
-    char command[512];
-    snprintf(command, sizeof(command), "mkdir -p %s", dir);
-    int result = system(command);
-    
-    free(path_copy);
-    return (result == 0);
 }
 
 static void load_from_file(ThreadSafeData* tsd) {
-    pthread_mutex_lock(&tsd->mutex);
-    
-    // Load auth data
-    DEBUG_PRINT("Loading auth data from %s\n", tsd->auth_filename);
-    FILE* auth_file = fopen(tsd->auth_filename, "r");
-    if (!auth_file) {
-        DEBUG_PRINT("Auth file not found, initializing empty data\n");
-        tsd->auth_data = cJSON_CreateObject();
-        if (tsd->auth_data) {
-            cJSON_AddItemToObject(tsd->auth_data, "users", cJSON_CreateArray());
-            save_to_file_unlocked(tsd);
-        }
-    } else {
-        fseek(auth_file, 0, SEEK_END);
-        long length = ftell(auth_file);
-        fseek(auth_file, 0, SEEK_SET);
-        
-        if (length > 0) {
-            char* buffer = malloc(length + 1);
-            if (buffer) {
-                size_t read = fread(buffer, 1, length, auth_file);
-                buffer[length] = '\0';
-                tsd->auth_data = cJSON_Parse(buffer);
-                free(buffer);
-            }
+    // Refuse to start rather than run with a damaged user directory
+    if (!user_directory_open(&tsd->users, SNAPSHOT_FILENAME, JOURNAL_FILENAME)) {
+        fprintf(stderr, "Cannot load users from %s\n", SNAPSHOT_FILENAME);
+        exit(EXIT_FAILURE);
+    }
+    DEBUG_PRINT("Loaded %zu users from %s\n", user_directory_count(&tsd->users), SNAPSHOT_FILENAME);
+
+    // First start after the move from JSON storage
+    if (user_directory_empty(&tsd->users) && access(tsd->auth_filename, F_OK) == 0) {
+        size_t imported;
+        if (tsd_import_users(tsd, tsd->auth_filename, &imported)) {
+            printf("Imported %zu users from %s\n", imported, tsd->auth_filename);
+        } else {
+            fprintf(stderr, "Failed to import users from %s\n", tsd->auth_filename);
         }
-        fclose(auth_file);
     }
-    
-    pthread_mutex_unlock(&tsd->mutex);
 }
 
-bool save_to_file_unlocked(ThreadSafeData* tsd) {
+bool tsd_find_user(ThreadSafeData* tsd, const char* username, char* hash, size_t size) {
+    profiled_mutex_lock(&tsd->mutex);
+    const char* stored = user_directory_find(&tsd->users, username);
+    bool found = stored && strlen(stored) < size;
+    if (found) {
+        strcpy(hash, stored);
+    }
+    profiled_mutex_unlock(&tsd->mutex);
+    return found;
+}
+
+UserAddResult tsd_add_user(ThreadSafeData* tsd, const char* username, const char* password_hash) {
+    if (strlen(username) > AUTH_USERNAME_MAX) return USER_ADD_FAILED;
+    profiled_mutex_lock(&tsd->mutex);
+    UserAddResult result = user_directory_add(&tsd->users, username, password_hash);
+    profiled_mutex_unlock(&tsd->mutex);
+    return result;
+}
+
+bool tsd_checkpoint_users(ThreadSafeData* tsd) {
+    profiled_mutex_lock(&tsd->mutex);
+    bool success = tsd->users.added == 0 || user_directory_checkpoint(&tsd->users);
+    profiled_mutex_unlock(&tsd->mutex);
+    return success;
+}
+
+bool tsd_import_users(ThreadSafeData* tsd, const char* path, size_t* imported) {
+    *imported = 0;
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open user import file");
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* buffer = length >= 0 ? (char*)malloc(length + 1) : NULL;
+    cJSON* json = NULL;
+    if (buffer) {
+        size_t n = fread(buffer, 1, length, file);
+        buffer[n] = '\0';
+        json = cJSON_Parse(buffer);
+        free(buffer);
+    }
+    fclose(file);
+
+    cJSON* users = cJSON_GetObjectItem(json, "users");
+    if (!cJSON_IsArray(users)) {
+        fprintf(stderr, "%s has no users array\n", path);
+        cJSON_Delete(json);
+        return false;
+    }
+
     bool success = true;
-    
-    // Save auth data
-    if (tsd->auth_data) {
-        DEBUG_PRINT("Saving auth data to %s\n", tsd->auth_filename);
-        if (!ensure_directory_exists(tsd->auth_filename)) {
-            DEBUG_PRINT("Failed to create directory for %s\n", tsd->auth_filename);
-            return false;
+    size_t skipped = 0;
+    profiled_mutex_lock(&tsd->mutex);
+    cJSON* user;
+    cJSON_ArrayForEach(user, users) {
+        const char* username = cJSON_GetStringValue(cJSON_GetObjectItem(user, "username"));
+        const char* hash = cJSON_GetStringValue(cJSON_GetObjectItem(user, "password_hash"));
+        if (!username || !hash || username[0] == '\0') continue;
+        // Such a user could never log in, and signup would not have made one
+        if (strlen(username) > AUTH_USERNAME_MAX) {
+            fprintf(stderr, "Skipping user %.32s...: name is %zu bytes (at most %d)\n",
+                    username, strlen(username), AUTH_USERNAME_MAX);
+            skipped++;
+            continue;
         }
-        
-        char temp_filename[256];
-        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", tsd->auth_filename);
-        
-        FILE* file = fopen(temp_filename, "w");
-        if (file) {
-            char* json_str = cJSON_Print(tsd->auth_data);
-            if (json_str) {
-                fwrite(json_str, 1, strlen(json_str), file);
-                free(json_str);
-                fclose(file);
-                rename(temp_filename, tsd->auth_filename);
-            } else {
-                fclose(file);
-                remove(temp_filename);
-                success = false;
-            }
-        } else {
+
+        UserAddResult result = user_directory_add(&tsd->users, username, hash);
+        if (result == USER_ADD_FAILED) {
             success = false;
+            break;
         }
+        if (result == USER_ADDED) (*imported)++;
     }
-    
+    if (success) {
+        success = user_directory_checkpoint(&tsd->users);
+    }
+    profiled_mutex_unlock(&tsd->mutex);
+    if (skipped) {
+        fprintf(stderr, "Skipped %zu users from %s with names longer than %d bytes\n",
+                skipped, path, AUTH_USERNAME_MAX);
+    }
+
+    cJSON_Delete(json);
     return success;
 }
 
-cJSON* tsd_read_auth(ThreadSafeData* tsd) {
-    pthread_mutex_lock(&tsd->mutex);
-    cJSON* copy = tsd->auth_data ? cJSON_Duplicate(tsd->auth_data, 1) : NULL;
-    pthread_mutex_unlock(&tsd->mutex);
-    return copy;
+static bool export_user(const char* username, const char* password_hash, void* ctx) {
+    cJSON* user = cJSON_CreateObject();
+    if (!user) return false;
+    cJSON_AddStringToObject(user, "username", username);
+    cJSON_AddStringToObject(user, "password_hash", password_hash);
+    return cJSON_AddItemToArray((cJSON*)ctx, user);
 }
 
-bool tsd_write_auth(ThreadSafeData* tsd, cJSON* value) {
-    bool result = false;
-    pthread_mutex_lock(&tsd->mutex);
-    
-    if (tsd->auth_data) {
-        cJSON_Delete(tsd->auth_data);
+bool tsd_export_users(ThreadSafeData* tsd, const char* path) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON* users = cJSON_AddArrayToObject(json, "users");
+    if (!users) {
+        cJSON_Delete(json);
+        return false;
     }
-    tsd->auth_data = value;
-    
-    result = save_to_file_unlocked(tsd);
-    pthread_mutex_unlock(&tsd->mutex);
-    return result;
+
+    profiled_mutex_lock(&tsd->mutex);
+    user_directory_for_each(&tsd->users, export_user, users);
+    profiled_mutex_unlock(&tsd->mutex);
+
+    char* text = cJSON_Print(json);
+    cJSON_Delete(json);
+    if (!text) return false;
+
+    bool success = false;
+    char temp_filename[256];
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", path);
+    FILE* file = fopen(temp_filename, "w");
+    if (file) {
+        success = fwrite(text, 1, strlen(text), file) == strlen(text);
+        if (fclose(file) != 0) success = false;
+        if (success) {
+            success = rename(temp_filename, path) == 0;
+        } else {
+            remove(temp_filename);
+        }
+    }
+    free(text);
+    return success;
 }
 
-// New functions for handling text data
-char* tsd_read_text(ThreadSafeData* tsd) {
-    pthread_mutex_lock(&tsd->mutex);
-    
-    FILE* file = fopen(tsd->data_filename, "r");
+bool tsd_import_legacy_text(ThreadSafeData* tsd, const char* owner, size_t* bytes) {
+    *bytes = 0;
+    profiled_mutex_lock(&tsd->mutex);
+    bool known = user_directory_find(&tsd->users, owner) != NULL;
+    profiled_mutex_unlock(&tsd->mutex);
+    if (!known) {
+        fprintf(stderr, "No user named %s to import %s into\n", owner, TSD_LEGACY_DATA_FILENAME);
+        return false;
+    }
+
+    FILE* file = fopen(TSD_LEGACY_DATA_FILENAME, "r");
+    if (!file) {
+        perror("Failed to open " TSD_LEGACY_DATA_FILENAME);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* text = length >= 0 ? (char*)malloc(length + 1) : NULL;
+    size_t n = 0;
+    if (text) {
+        n = fread(text, 1, length, file);
+        text[n] = '\0';
+    }
+    fclose(file);
+    if (!text) return false;
+
+    // Written as one record, whose newline the file already ends with
+    if (n > 0 && text[n - 1] == '\n') text[n - 1] = '\0';
+    bool success = n == 0 || tsd_write_text(tsd, owner, text);
+    free(text);
+    if (!success) return false;
+
+    if (rename(TSD_LEGACY_DATA_FILENAME, TSD_LEGACY_DATA_FILENAME ".imported") != 0) {
+        // Left in place, a second run would import it again
+        perror("Failed to rename " TSD_LEGACY_DATA_FILENAME);
+        return false;
+    }
+    *bytes = n;
+    return true;
+}
+
+// Partitions are created on first use. find_partition hands out a
+// reference, taken under partitions_lock, so the pointer stays valid
+// without the lock until release_partition; eviction, under the write
+// lock, only frees partitions nobody holds.
+
+static uint64_t hash_owner(const char* owner) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)owner; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static DataPartition* lookup_partition(ThreadSafeData* tsd, const char* owner, uint64_t hash) {
+    if (!tsd->partitions) return NULL;
+    DataPartition* partition = tsd->partitions[hash & (tsd->partition_buckets - 1)];
+    while (partition && strcmp(partition->owner, owner) != 0) {
+        partition = partition->next;
+    }
+    return partition;
+}
+
+static bool grow_partitions(ThreadSafeData* tsd) {
+    size_t count = tsd->partition_buckets ? tsd->partition_buckets * 2 : INITIAL_PARTITION_BUCKETS;
+    DataPartition** buckets = (DataPartition**)calloc(count, sizeof(DataPartition*));
+    if (!buckets) return false;
+
+    for (size_t i = 0; i < tsd->partition_buckets; i++) {
+        DataPartition* partition = tsd->partitions[i];
+        while (partition) {
+            DataPartition* next = partition->next;
+            size_t bucket = hash_owner(partition->owner) & (count - 1);
+            partition->next = buckets[bucket];
+            buckets[bucket] = partition;
+            partition = next;
+        }
+    }
+    free(tsd->partitions);
+    tsd->partitions = buckets;
+    tsd->partition_buckets = count;
+    return true;
+}
+
+// Usernames may hold any byte, so the file is named after their hex form
+static char* partition_filename(const char* directory, const char* owner) {
+    static const char HEX[] = "0123456789abcdef";
+    size_t owner_length = strlen(owner);
+    size_t length = strlen(directory) + 1 + owner_length * 2 + strlen(".txt") + 1;
+    char* filename = (char*)malloc(length);
+    if (!filename) return NULL;
+
+    char* out = filename + sprintf(filename, "%s/", directory);
+    for (size_t i = 0; i < owner_length; i++) {
+        unsigned char c = (unsigned char)owner[i];
+        *out++ = HEX[c >> 4];
+        *out++ = HEX[c & 0x0f];
+    }
+    strcpy(out, ".txt");
+    return filename;
+}
+
+static DataPartition* create_partition(ThreadSafeData* tsd, const char* owner) {
+    DataPartition* partition = (DataPartition*)calloc(1, sizeof(DataPartition));
+    if (!partition) return NULL;
+    partition->owner = strdup(owner);
+    partition->filename = partition_filename(tsd->data_directory, owner);
+    if (!partition->owner || !partition->filename) {
+        free(partition->owner);
+        free(partition->filename);
+        free(partition);
+        return NULL;
+    }
+    profiled_mutex_init(&partition->mutex, &partition_lock_stats);
+    profiled_mutex_init(&partition->cache_mutex, &partition_cache_lock_stats);
+    partition->generation = atomic_fetch_add(&tsd->generation_clock, 1);
+    atomic_init(&partition->refs, 0);
+    atomic_init(&partition->referenced, true);
+    return partition;
+}
+
+static void drop_partition(ThreadSafeData* tsd, DataPartition* partition) {
+    size_t cached = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        cached += partition->encoded_text[i].length;
+    }
+    atomic_fetch_sub(&tsd->cached_bytes, cached);
+    free_partition(partition);
+    tsd->partition_count--;
+}
+
+static bool over_budget(ThreadSafeData* tsd) {
+    return tsd->partition_count >= TSD_MAX_PARTITIONS ||
+           atomic_load(&tsd->cached_bytes) > TSD_MAX_CACHED_BYTES;
+}
+
+// Clock sweep over the buckets, called with partitions_lock held for
+// writing: a partition used since the last pass gets another pass, an idle
+// one that was not is freed, until the table is back under budget
+static void evict_partitions(ThreadSafeData* tsd) {
+    for (size_t visited = 0; visited < 2 * tsd->partition_buckets && over_budget(tsd); visited++) {
+        DataPartition** link = &tsd->partitions[tsd->evict_bucket];
+        while (*link && over_budget(tsd)) {
+            DataPartition* partition = *link;
+            if (atomic_load(&partition->refs) == 0 &&
+                !atomic_exchange(&partition->referenced, false)) {
+                *link = partition->next;
+                drop_partition(tsd, partition);
+            } else {
+                link = &partition->next;
+            }
+        }
+        tsd->evict_bucket = (tsd->evict_bucket + 1) & (tsd->partition_buckets - 1);
+    }
+}
+
+static DataPartition* find_partition(ThreadSafeData* tsd, const char* owner) {
+    if (!owner || !*owner) return NULL;
+    uint64_t hash = hash_owner(owner);
+
+    uint64_t read_locked_at = profiled_rwlock_rdlock(&tsd->partitions_lock);
+    DataPartition* partition = lookup_partition(tsd, owner, hash);
+    if (partition) {
+        atomic_fetch_add(&partition->refs, 1);
+        if (!atomic_load_explicit(&partition->referenced, memory_order_relaxed)) {
+            atomic_store(&partition->referenced, true);
+        }
+    }
+    profiled_rwlock_rdunlock(&tsd->partitions_lock, read_locked_at);
+    if (partition) return partition;
+
+    profiled_rwlock_wrlock(&tsd->partitions_lock);
+    partition = lookup_partition(tsd, owner, hash);
+    if (!partition) {
+        if (tsd->partitions && over_budget(tsd)) evict_partitions(tsd);
+        if (tsd->partition_count < tsd->partition_buckets || grow_partitions(tsd)) {
+            partition = create_partition(tsd, owner);
+            if (partition) {
+                size_t bucket = hash & (tsd->partition_buckets - 1);
+                partition->next = tsd->partitions[bucket];
+                tsd->partitions[bucket] = partition;
+                tsd->partition_count++;
+            }
+        }
+    }
+    if (partition) {
+        atomic_fetch_add(&partition->refs, 1);
+        atomic_store(&partition->referenced, true);
+    }
+    profiled_rwlock_wrunlock(&tsd->partitions_lock);
+    return partition;
+}
+
+static void release_partition(DataPartition* partition) {
+    atomic_fetch_sub(&partition->refs, 1);
+}
+
+// A cache that grew past the budget is trimmed by the caller that grew it
+static void trim_caches(ThreadSafeData* tsd) {
+    if (atomic_load(&tsd->cached_bytes) <= TSD_MAX_CACHED_BYTES) return;
+    profiled_rwlock_wrlock(&tsd->partitions_lock);
+    evict_partitions(tsd);
+    profiled_rwlock_wrunlock(&tsd->partitions_lock);
+}
+
+static char* read_text_unlocked(DataPartition* partition, size_t* length) {
+    *length = 0;
+    FILE* file = fopen(partition->filename, "r");
     if (!file) {
-        pthread_mutex_unlock(&tsd->mutex);
         return strdup("");  // Return empty string if file doesn't exist
     }
     
     fseek(file, 0, SEEK_END);
-    long length = ftell(file);
+    long file_length = ftell(file);
     fseek(file, 0, SEEK_SET);
     
-    char* buffer = malloc(length + 1);
+    char* buffer = file_length >= 0 ? malloc(file_length + 1) : NULL;
     if (buffer) {
-        size_t read = fread(buffer, 1, length, file);
-        buffer[length] = '\0';
+        *length = fread(buffer, 1, file_length, file);
+        buffer[*length] = '\0';
     }
     
     fclose(file);
-    pthread_mutex_unlock(&tsd->mutex);
     return buffer ? buffer : strdup("");
 }
 
-bool tsd_write_text(ThreadSafeData* tsd, const char* text) {
-    pthread_mutex_lock(&tsd->mutex);
-    
-    if (!ensure_directory_exists(tsd->data_filename)) {
-        pthread_mutex_unlock(&tsd->mutex);
-        return false;
+char* tsd_read_text(ThreadSafeData* tsd, const char* owner) {
+    return tsd_read_text_version(tsd, owner, NULL);
+}
+
+char* tsd_read_text_version(ThreadSafeData* tsd, const char* owner, unsigned long* generation) {
+    DataPartition* partition = find_partition(tsd, owner);
+    if (!partition) return NULL;
+
+    size_t length;
+    profiled_mutex_lock(&partition->mutex);
+    char* text = read_text_unlocked(partition, &length);
+    if (generation) *generation = partition->generation;
+    profiled_mutex_unlock(&partition->mutex);
+    release_partition(partition);
+    return text;
+}
+
+unsigned long tsd_text_generation(ThreadSafeData* tsd, const char* owner) {
+    DataPartition* partition = find_partition(tsd, owner);
+    if (!partition) return 0;
+
+    profiled_mutex_lock(&partition->mutex);
+    unsigned long generation = partition->generation;
+    profiled_mutex_unlock(&partition->mutex);
+    release_partition(partition);
+    return generation;
+}
+
+bool tsd_read_text_encoded(ThreadSafeData* tsd, const char* owner, ContentEncoding encoding,
+                           char** data, size_t* length, unsigned long* generation) {
+    if (encoding <= ENCODING_IDENTITY || encoding >= ENCODING_COUNT) return false;
+    DataPartition* partition = find_partition(tsd, owner);
+    if (!partition) return false;
+
+    // Held while compressing, so each generation is compressed only once;
+    // writers only need partition->mutex and are never blocked by it
+    profiled_mutex_lock(&partition->cache_mutex);
+    EncodedText* cached = &partition->encoded_text[encoding];
+
+    profiled_mutex_lock(&partition->mutex);
+    unsigned long current = partition->generation;
+    char* text = NULL;
+    size_t text_length = 0;
+    if (cached->generation != current) {
+        text = read_text_unlocked(partition, &text_length);
     }
-    
-    FILE* file = fopen(tsd->data_filename, "a");  // Changed from "w" to "a" for append
-    if (!file) {
-        pthread_mutex_unlock(&tsd->mutex);
+    profiled_mutex_unlock(&partition->mutex);
+
+    bool grew = false;
+    if (cached->generation != current) {
+        atomic_fetch_sub(&tsd->cached_bytes, cached->length);
+        free(cached->data);
+        cached->data = NULL;
+        cached->length = 0;
+
+        char* encoded;
+        size_t encoded_length;
+        if (text && text_length >= COMPRESSION_MIN_SIZE &&
+            compression_encode(encoding, text, text_length, &encoded, &encoded_length)) {
+            if (encoded_length < text_length) {
+                cached->data = encoded;
+                cached->length = encoded_length;
+                atomic_fetch_add(&tsd->cached_bytes, encoded_length);
+                grew = true;
+            } else {
+                free(encoded);
+            }
+        }
+        cached->generation = current;
+        free(text);
+    }
+
+    bool found = false;
+    if (cached->data && !data) {
+        if (generation) *generation = cached->generation;
+        found = true;
+    } else if (cached->data) {
+        *data = (char*)malloc(cached->length);
+        if (*data) {
+            memcpy(*data, cached->data, cached->length);
+            *length = cached->length;
+            if (generation) *generation = cached->generation;
+            found = true;
+        }
+    }
+
+    profiled_mutex_unlock(&partition->cache_mutex);
+    release_partition(partition);
+    if (grew) trim_caches(tsd);
+    return found;
+}
+
+bool tsd_write_text(ThreadSafeData* tsd, const char* owner, const char* text) {
+    return tsd_write_text_batch(tsd, owner, &text, 1);
+}
+
+bool tsd_write_text_batch(ThreadSafeData* tsd, const char* owner,
+                          const char* const* records, size_t count) {
+    if (count == 0) return true;
+    DataPartition* partition = find_partition(tsd, owner);
+    if (!partition) return false;
+
+    // Joined up front so the whole batch is one write under one lock
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += strlen(records[i]) + 1;
+    }
+    char* joined = (char*)malloc(total);
+    if (!joined) {
+        release_partition(partition);
         return false;
     }
-    
-    bool success = (fwrite(text, 1, strlen(text), file) == strlen(text));
-    if (success) {
-        fwrite("\n", 1, 1, file);  // Add a newline after each entry
+
+    char* out = joined;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(records[i]);
+        memcpy(out, records[i], length);
+        out[length] = '\n';
+        out += length + 1;
     }
-    fclose(file);
-    
-    pthread_mutex_unlock(&tsd->mutex);
+
+    profiled_mutex_lock(&partition->mutex);
+
+    bool success = false;
+    FILE* file = fopen(partition->filename, "a");
+    if (file) {
+        success = (fwrite(joined, 1, total, file) == total);
+        if (fclose(file) != 0) success = false;
+        partition->generation = atomic_fetch_add(&tsd->generation_clock, 1);
+    }
+
+    profiled_mutex_unlock(&partition->mutex);
+    release_partition(partition);
+    free(joined);
     return success;
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#include "timer_wheel.h"
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void list_init(TimerEntry* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static bool list_empty(const TimerEntry* head) {
+    return head->next == head;
+}
+
+static void list_append(TimerEntry* head, TimerEntry* entry) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static void list_unlink(TimerEntry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+void timer_wheel_init(TimerWheel* wheel, unsigned tick_ms, uint64_t now_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = 0;
+    wheel->origin_ms = now_ms;
+    wheel->tick_ms = tick_ms ? tick_ms : 1;
+    wheel->count = 0;
+}
+
+void timer_entry_init(TimerEntry* entry, void* data) {
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->expires = 0;
+    entry->data = data;
+}
+
+bool timer_entry_pending(const TimerEntry* entry) {
+    return entry->next != NULL;
+}
+
+// Files entry by how far away it is: level n holds deadlines less than
+// 64^(n+1) ticks ahead, indexed by the matching six bits of the deadline.
+static void insert_entry(TimerWheel* wheel, TimerEntry* entry) {
+    uint64_t delta = entry->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+        level++;
+    }
+    size_t slot = (entry->expires >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], entry);
+}
+
+void timer_wheel_schedule(TimerWheel* wheel, TimerEntry* entry, uint64_t deadline_ms) {
+    if (timer_entry_pending(entry)) {
+        list_unlink(entry);
+        wheel->count--;
+    }
+
+    uint64_t ticks = deadline_ms > wheel->origin_ms
+        ? (deadline_ms - wheel->origin_ms + wheel->tick_ms - 1) / wheel->tick_ms
+        : 0;
+    if (ticks <= wheel->now) ticks = wheel->now + 1;
+    if (ticks - wheel->now > MAX_DELTA) ticks = wheel->now + MAX_DELTA;
+
+    entry->expires = ticks;
+    insert_entry(wheel, entry);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel* wheel, TimerEntry* entry) {
+    if (timer_entry_pending(entry)) {
+        list_unlink(entry);
+        wheel->count--;
+    }
+}
+
+// Re-files every entry of an upper-level slot now that time has reached it.
+static void cascade(TimerWheel* wheel, int level, size_t slot) {
+    TimerEntry* head = &wheel->slots[level][slot];
+    while (!list_empty(head)) {
+        TimerEntry* entry = head->next;
+        list_unlink(entry);
+        insert_entry(wheel, entry);
+    }
+}
+
+size_t timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms, TimerCallback callback, void* arg) {
+    uint64_t target = now_ms > wheel->origin_ms ? (now_ms - wheel->origin_ms) / wheel->tick_ms : 0;
+    size_t fired = 0;
+
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+        wheel->now++;
+
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            uint64_t lower_mask = (1ULL << (level * TIMER_WHEEL_SLOT_BITS)) - 1;
+            if ((wheel->now & lower_mask) == 0) {
+                cascade(wheel, level, (wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK);
+            }
+        }
+
+        // Detach the due slot first so callbacks can schedule and cancel freely
+        TimerEntry due;
+        list_init(&due);
+        TimerEntry* head = &wheel->slots[0][wheel->now & SLOT_MASK];
+        if (list_empty(head)) continue;
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        list_init(head);
+
+        while (!list_empty(&due)) {
+            TimerEntry* entry = due.next;
+            list_unlink(entry);
+            wheel->count--;
+            fired++;
+            callback(entry, arg);
+        }
+    }
+
+    return fired;
+}
+
+long timer_wheel_next_timeout(const TimerWheel* wheel, uint64_t now_ms) {
+    if (wheel->count == 0) return -1;
+
+    // The nearest occupied level-0 slot, or else the next cascade
+    uint64_t ticks = TIMER_WHEEL_SLOTS - (wheel->now & SLOT_MASK);
+    for (uint64_t i = 1; i < TIMER_WHEEL_SLOTS; i++) {
+        if (!list_empty(&wheel->slots[0][(wheel->now + i) & SLOT_MASK])) {
+            ticks = i;
+            break;
+        }
+    }
+
+    uint64_t due_ms = wheel->origin_ms + (wheel->now + ticks) * wheel->tick_ms;
+    return due_ms > now_ms ? (long)(due_ms - now_ms) : 0;
+}
@@ -0,0 +1,225 @@
+#include "trace.h"
+#include "profiled_mutex.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct {
+    uint64_t request;
+    const char* name;             // A string literal
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t cpu_ns;
+    int tid;
+} TraceSpan;
+
+// Written only by its owning thread. head counts every span ever recorded;
+// readers copy the ring and then drop whatever head shows was overwritten
+// meanwhile.
+typedef struct TraceBuffer {
+    TraceSpan spans[TRACE_BUFFER_SPANS];
+    atomic_ullong head;
+    atomic_bool owned;
+    int tid;
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+static atomic_uint sample_every;
+static atomic_ullong requests_seen;
+static atomic_ullong next_id;
+
+// Every buffer ever allocated, newest first; buffers are never freed
+static TraceBuffer* buffers = NULL;
+static ProfiledMutex buffers_mutex;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+static __thread TraceBuffer* local_buffer;
+
+// Hands the exiting thread's buffer, and the spans in it, to the next thread
+static void release_buffer(void* arg) {
+    atomic_store(&((TraceBuffer*)arg)->owned, false);
+}
+
+LOCK_STATS_DEFINE(trace_lock_stats, "trace.buffers");
+
+static void init_trace(void) {
+    profiled_mutex_init(&buffers_mutex, &trace_lock_stats);
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static TraceBuffer* claim_buffer(void) {
+    pthread_once(&init_once, init_trace);
+
+    profiled_mutex_lock(&buffers_mutex);
+    TraceBuffer* buffer = buffers;
+    while (buffer && atomic_load(&buffer->owned)) buffer = buffer->next;
+    if (!buffer) {
+        buffer = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+        if (buffer) {
+            buffer->next = buffers;
+            buffers = buffer;
+        }
+    }
+    if (buffer) {
+        atomic_store(&buffer->owned, true);
+        buffer->tid = (int)syscall(SYS_gettid);
+    }
+    profiled_mutex_unlock(&buffers_mutex);
+
+    if (buffer) pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+void trace_configure(unsigned every) {
+    atomic_store(&sample_every, every);
+}
+
+uint64_t trace_sample(void) {
+    unsigned every = atomic_load_explicit(&sample_every, memory_order_relaxed);
+    if (every == 0) return 0;
+    if (atomic_fetch_add_explicit(&requests_seen, 1, memory_order_relaxed) % every != 0) return 0;
+    return atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed) + 1;
+}
+
+uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void trace_span(uint64_t request, const char* name, uint64_t start_ns, uint64_t end_ns,
+                uint64_t cpu_ns) {
+    TraceBuffer* buffer = local_buffer;
+    if (!buffer) {
+        buffer = local_buffer = claim_buffer();
+        if (!buffer) return;
+    }
+
+    unsigned long long head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    TraceSpan* span = &buffer->spans[head % TRACE_BUFFER_SPANS];
+    span->request = request;
+    span->name = name;
+    span->start_ns = start_ns;
+    span->end_ns = end_ns;
+    span->cpu_ns = cpu_ns;
+    span->tid = buffer->tid;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+typedef struct {
+    const TraceSpan* span;
+    bool begin;
+} TraceEvent;
+
+static uint64_t event_ns(const TraceEvent* event) {
+    return event->begin ? event->span->start_ns : event->span->end_ns;
+}
+
+// Viewers nest async spans by the order of their events, so spans that
+// share a timestamp must open outermost first and close innermost first
+static int compare_events(const void* a, const void* b) {
+    const TraceEvent* x = (const TraceEvent*)a;
+    const TraceEvent* y = (const TraceEvent*)b;
+    uint64_t x_ns = event_ns(x);
+    uint64_t y_ns = event_ns(y);
+    if (x_ns != y_ns) return x_ns < y_ns ? -1 : 1;
+    if (x->span == y->span) return x->begin ? -1 : 1;
+    if (x->begin != y->begin) return x->begin ? 1 : -1;
+    uint64_t x_length = x->span->end_ns - x->span->start_ns;
+    uint64_t y_length = y->span->end_ns - y->span->start_ns;
+    if (x_length == y_length) return 0;
+    return (x_length > y_length) == x->begin ? -1 : 1;
+}
+
+// Appends the spans buffer still holds to spans, which has room for them
+static size_t copy_buffer(TraceBuffer* buffer, TraceSpan* spans) {
+    unsigned long long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    unsigned long long from = head > TRACE_BUFFER_SPANS ? head - TRACE_BUFFER_SPANS : 0;
+    for (unsigned long long i = from; i < head; i++) {
+        spans[i - from] = buffer->spans[i % TRACE_BUFFER_SPANS];
+    }
+
+    // The owner may have lapped the copy, and may be writing the slot after head
+    unsigned long long now = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    unsigned long long valid = now + 1 > TRACE_BUFFER_SPANS ? now + 1 - TRACE_BUFFER_SPANS : 0;
+    if (valid <= from) return (size_t)(head - from);
+    if (valid >= head) return 0;
+    memmove(spans, spans + (valid - from), (size_t)(head - valid) * sizeof(TraceSpan));
+    return (size_t)(head - valid);
+}
+
+// Timestamps are microseconds, as the format expects
+static void write_event(FILE* out, const TraceEvent* event, bool first, int pid) {
+    const TraceSpan* span = event->span;
+    fprintf(out,
+            "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%s\",\"id\":\"0x%llx\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+            first ? "" : ",\n", span->name, event->begin ? "b" : "e",
+            (unsigned long long)span->request, (double)event_ns(event) / 1000.0, pid, span->tid);
+    if (event->begin && span->cpu_ns) {
+        fprintf(out, ",\"args\":{\"cpu_us\":%.3f}", (double)span->cpu_ns / 1000.0);
+    }
+    fputc('}', out);
+}
+
+char* trace_json(void) {
+    // Copied under the lock, formatted after it, so new threads are not held up
+    pthread_once(&init_once, init_trace);
+    profiled_mutex_lock(&buffers_mutex);
+    size_t capacity = 0;
+    for (TraceBuffer* buffer = buffers; buffer; buffer = buffer->next) {
+        capacity += TRACE_BUFFER_SPANS;
+    }
+    TraceSpan* spans = (TraceSpan*)malloc((capacity ? capacity : 1) * sizeof(TraceSpan));
+    size_t count = 0;
+    if (spans) {
+        for (TraceBuffer* buffer = buffers; buffer; buffer = buffer->next) {
+            count += copy_buffer(buffer, spans + count);
+        }
+    }
+    profiled_mutex_unlock(&buffers_mutex);
+    if (!spans) return NULL;
+
+    TraceEvent* events = (TraceEvent*)malloc((count ? 2 * count : 1) * sizeof(TraceEvent));
+    if (!events) {
+        free(spans);
+        return NULL;
+    }
+    size_t event_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (spans[i].end_ns < spans[i].start_ns) continue;
+        events[event_count++] = (TraceEvent){&spans[i], true};
+        events[event_count++] = (TraceEvent){&spans[i], false};
+    }
+    qsort(events, event_count, sizeof(TraceEvent), compare_events);
+
+    char* result = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&result, &size);
+    if (out) {
+        int pid = (int)getpid();
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+        for (size_t i = 0; i < event_count; i++) {
+            write_event(out, &events[i], i == 0, pid);
+        }
+        fputs("]}\n", out);
+        if (fclose(out) != 0) {
+            free(result);
+            result = NULL;
+        }
+    }
+    free(events);
+    free(spans);
+    return result;
+}
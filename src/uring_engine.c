@@ -0,0 +1,582 @@
+#include "uring_engine.h"
+#include "timer_wheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_IO_URING
+
+#include <liburing.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define URING_QUEUE_DEPTH 512
+#define URING_BUFFER_COUNT 256      // Must be a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_TICK_MS 10
+
+// Completion type, kept in the low bits of user_data next to the pointer
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_NOTIFY,
+    URING_OP_CANCEL,
+};
+#define URING_OP_MASK 7ULL
+
+typedef struct UringConnection {
+    Connection conn;
+    struct UringConnection* prev;
+    struct UringConnection* next;
+    struct msghdr msg;
+    struct iovec iov[CONNECTION_MAX_IOVECS];
+    int responses_in_send;   // Batch slots covered by the send in flight
+    TimerEntry timer;        // Read deadline, or write deadline while sending
+    uint64_t deadline_ms;
+    uint64_t send_started_ms;
+    bool recv_armed;
+    bool send_in_flight;
+    bool peer_closed;        // No more input will arrive
+    bool final_sent;
+    bool shutting_down;
+} UringConnection;
+
+struct UringWorker {
+    UringEngine* engine;
+    ConnectionHandler* handler;
+    int listen_fd;
+    struct io_uring ring;
+    struct io_uring_buf_ring* buffers;
+    char* buffer_memory;
+    ResponseNotifier notifier;
+    uint64_t notify_value;
+    UringConnection* connections;
+    TimerWheel timers;
+    uint64_t now_ms;         // Clock reading for the current batch of completions
+    bool draining;           // No longer accepting; exits once connections are gone
+    pthread_t thread;
+};
+
+static void connection_progress(UringWorker* worker, UringConnection* uc);
+
+bool uring_engine_available(void) {
+    return true;
+}
+
+static uint64_t encode_data(void* ptr, unsigned op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static struct io_uring_sqe* get_sqe(UringWorker* worker) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&worker->ring);
+    if (!sqe) {
+        // Submission queue full: hand what is queued to the kernel and retry
+        io_uring_submit(&worker->ring);
+        sqe = io_uring_get_sqe(&worker->ring);
+    }
+    return sqe;
+}
+
+static bool arm_accept(UringWorker* worker) {
+    struct io_uring_sqe* sqe = get_sqe(worker);
+    if (!sqe) return false;
+    io_uring_prep_multishot_accept(sqe, worker->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, encode_data(NULL, URING_OP_ACCEPT));
+    return true;
+}
+
+static bool arm_notify(UringWorker* worker) {
+    struct io_uring_sqe* sqe = get_sqe(worker);
+    if (!sqe) return false;
+    io_uring_prep_read(sqe, worker->notifier.event_fd, &worker->notify_value,
+                       sizeof(worker->notify_value), 0);
+    io_uring_sqe_set_data64(sqe, encode_data(NULL, URING_OP_NOTIFY));
+    return true;
+}
+
+static bool arm_recv(UringWorker* worker, UringConnection* uc) {
+    struct io_uring_sqe* sqe = get_sqe(worker);
+    if (!sqe) return false;
+    io_uring_prep_recv_multishot(sqe, uc->conn.fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, encode_data(uc, URING_OP_RECV));
+    uc->recv_armed = true;
+    return true;
+}
+
+static bool submit_send(UringWorker* worker, UringConnection* uc) {
+    struct io_uring_sqe* sqe = get_sqe(worker);
+    if (!sqe) return false;
+    io_uring_prep_sendmsg(sqe, uc->conn.fd, &uc->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, encode_data(uc, URING_OP_SEND));
+    if (!uc->send_in_flight) uc->send_started_ms = worker->now_ms;
+    uc->send_in_flight = true;
+    return true;
+}
+
+static void try_send(UringWorker* worker, UringConnection* uc) {
+    if (uc->send_in_flight) return;
+
+    int iovcnt = connection_ready_responses(&uc->conn, uc->iov, CONNECTION_MAX_IOVECS);
+    if (iovcnt == 0) {
+        if (!uc->conn.final_response || uc->final_sent || uc->conn.failed ||
+            connection_has_outstanding(&uc->conn)) {
+            return;
+        }
+        uc->iov[0].iov_base = (void*)uc->conn.final_response;
+        uc->iov[0].iov_len = strlen(uc->conn.final_response);
+        uc->final_sent = true;
+        iovcnt = 1;
+    } else {
+        uc->responses_in_send = iovcnt;
+    }
+
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = (size_t)iovcnt;
+    if (!submit_send(worker, uc)) {
+        connection_responses_sent(&uc->conn, uc->responses_in_send);
+        uc->responses_in_send = 0;
+        uc->conn.failed = true;
+    }
+}
+
+static void close_connection(UringWorker* worker, UringConnection* uc) {
+    if (uc->prev) uc->prev->next = uc->next;
+    else worker->connections = uc->next;
+    if (uc->next) uc->next->prev = uc->prev;
+
+    timer_wheel_cancel(&worker->timers, &uc->timer);
+    connection_destroy(&uc->conn);
+    close(uc->conn.fd);
+    free(uc);
+}
+
+static void shutdown_connection(UringConnection* uc) {
+    if (!uc->shutting_down) {
+        shutdown(uc->conn.fd, SHUT_RDWR);
+        uc->shutting_down = true;
+    }
+}
+
+// Closes the connection once nothing more will be read or sent on it.
+// Returns true if it was freed.
+static bool maybe_close(UringWorker* worker, UringConnection* uc) {
+    Connection* conn = &uc->conn;
+    bool finished = !conn->keep_alive || conn->failed || uc->peer_closed;
+    if (!finished || uc->send_in_flight || connection_has_outstanding(conn)) return false;
+    if (conn->final_response && !uc->final_sent && !conn->failed) return false;
+
+    if (uc->recv_armed) {
+        // The multishot receive ends with EOF; the connection goes with it
+        shutdown_connection(uc);
+        return false;
+    }
+    close_connection(worker, uc);
+    return true;
+}
+
+// Keeps the connection's single timer on whichever deadline applies now.
+static void update_timer(UringWorker* worker, UringConnection* uc) {
+    uint64_t deadline = 0;
+    if (uc->send_in_flight) {
+        deadline = uc->send_started_ms + worker->handler->timeouts.write_ms;
+    } else if (uc->conn.keep_alive && !uc->conn.failed && !uc->peer_closed) {
+        deadline = connection_read_deadline(worker->handler, &uc->conn, worker->now_ms);
+    }
+
+    if (deadline == 0) {
+        timer_wheel_cancel(&worker->timers, &uc->timer);
+    } else if (deadline != uc->deadline_ms || !timer_entry_pending(&uc->timer)) {
+        timer_wheel_schedule(&worker->timers, &uc->timer, deadline);
+    }
+    uc->deadline_ms = deadline;
+}
+
+static void connection_progress(UringWorker* worker, UringConnection* uc) {
+    connection_handler_dispatch(worker->handler, &uc->conn);
+    try_send(worker, uc);
+    if (!maybe_close(worker, uc)) update_timer(worker, uc);
+}
+
+// Stops this ring accepting and moves idle connections onto the drain
+// deadline. The listening socket may live on in another process, so the
+// accept is cancelled rather than the socket shut down.
+static void start_drain(UringWorker* worker) {
+    worker->draining = true;
+
+    struct io_uring_sqe* sqe = get_sqe(worker);
+    if (sqe) {
+        io_uring_prep_cancel64(sqe, encode_data(NULL, URING_OP_ACCEPT), 0);
+        io_uring_sqe_set_data64(sqe, encode_data(NULL, URING_OP_CANCEL));
+    }
+
+    UringConnection* uc = worker->connections;
+    while (uc) {
+        UringConnection* next = uc->next;
+        connection_progress(worker, uc);
+        uc = next;
+    }
+}
+
+static void handle_timer(TimerEntry* entry, void* arg) {
+    UringWorker* worker = (UringWorker*)arg;
+    UringConnection* uc = (UringConnection*)entry->data;
+
+    if (uc->send_in_flight) {
+        // The pending send fails once the socket is shut down
+        fprintf(stderr, "Write timeout\n");
+        uc->conn.failed = true;
+        shutdown_connection(uc);
+        return;
+    }
+    connection_expire(&uc->conn);
+    connection_progress(worker, uc);
+}
+
+static void handle_accept(UringWorker* worker, struct io_uring_cqe* cqe) {
+    bool stopping = atomic_load(&worker->engine->stopping);
+
+    RateLimitEntry* rate_entry = NULL;
+    bool admitted = true;
+    if (cqe->res >= 0 && worker->handler->rate_limiter) {
+        // The multishot accept shares one completion for many sockets, so
+        // the peer address is looked up per connection instead
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        uint32_t addr = getpeername(cqe->res, (struct sockaddr*)&peer, &peer_len) == 0
+                            ? peer.sin_addr.s_addr : 0;
+        admitted = connection_handler_admit(worker->handler, cqe->res, addr, worker->now_ms,
+                                            &rate_entry);
+    }
+
+    if (cqe->res >= 0 && admitted) {
+        UringConnection* uc = (UringConnection*)calloc(1, sizeof(UringConnection));
+        if (!uc || !connection_init(&uc->conn, cqe->res)) {
+            fprintf(stderr, "Failed to allocate connection\n");
+            free(uc);
+            rate_limiter_disconnect(rate_entry);
+            close(cqe->res);
+        } else {
+            uc->conn.rate_entry = rate_entry;
+            uc->conn.batch.notifier = &worker->notifier;
+            timer_entry_init(&uc->timer, uc);
+            uc->next = worker->connections;
+            if (uc->next) uc->next->prev = uc;
+            worker->connections = uc;
+            if (arm_recv(worker, uc)) update_timer(worker, uc);
+            else close_connection(worker, uc);
+        }
+    } else if (cqe->res < 0 && !stopping && !worker->draining) {
+        fprintf(stderr, "Accept error: %s\n", strerror(-cqe->res));
+    }
+
+    // The kernel ends a multishot accept on errors; the listening socket
+    // going away means shutdown, anything else is worth re-arming for
+    bool listener_gone = cqe->res == -EBADF || cqe->res == -EINVAL;
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !stopping && !worker->draining && !listener_gone) {
+        arm_accept(worker);
+    }
+}
+
+static void handle_recv(UringWorker* worker, UringConnection* uc, struct io_uring_cqe* cqe) {
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        char* data = worker->buffer_memory + (size_t)bid * URING_BUFFER_SIZE;
+        size_t remaining = (size_t)cqe->res;
+        char* from = data;
+
+        while (remaining > 0 && uc->conn.keep_alive && !uc->conn.failed) {
+            size_t available;
+            char* space = connection_reserve(&uc->conn, &available);
+            if (!space) break;
+            size_t chunk = remaining < available ? remaining : available;
+            memcpy(space, from, chunk);
+            connection_received(&uc->conn, chunk);
+            from += chunk;
+            remaining -= chunk;
+        }
+
+        // Hand the buffer straight back to the kernel
+        io_uring_buf_ring_add(worker->buffers, data, URING_BUFFER_SIZE, bid,
+                              io_uring_buf_ring_mask(URING_BUFFER_COUNT), 0);
+        io_uring_buf_ring_advance(worker->buffers, 1);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uc->recv_armed = false;
+        bool reading = uc->conn.keep_alive && !uc->conn.failed && !uc->shutting_down;
+        if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+            if (cqe->res < 0) fprintf(stderr, "Receive error: %s\n", strerror(-cqe->res));
+            uc->peer_closed = true;
+        } else if (reading && !arm_recv(worker, uc)) {
+            // Out of buffers or ended by the kernel; rearm unless closing
+            uc->peer_closed = true;
+        }
+    }
+
+    connection_progress(worker, uc);
+}
+
+static void handle_send(UringWorker* worker, UringConnection* uc, struct io_uring_cqe* cqe) {
+    if (cqe->res < 0) {
+        fprintf(stderr, "Send failed: %s\n", strerror(-cqe->res));
+        uc->conn.failed = true;
+    } else {
+        // Skip fully sent buffers and advance into a partially sent one
+        size_t sent = (size_t)cqe->res;
+        while (uc->msg.msg_iovlen > 0 && sent >= uc->msg.msg_iov->iov_len) {
+            sent -= uc->msg.msg_iov->iov_len;
+            uc->msg.msg_iov++;
+            uc->msg.msg_iovlen--;
+        }
+        if (uc->msg.msg_iovlen > 0) {
+            uc->msg.msg_iov->iov_base = (char*)uc->msg.msg_iov->iov_base + sent;
+            uc->msg.msg_iov->iov_len -= sent;
+            // Still in flight, so the write deadline keeps running
+            if (!uc->conn.failed && submit_send(worker, uc)) return;
+            uc->conn.failed = true;
+        }
+    }
+
+    uc->send_in_flight = false;
+    connection_responses_sent(&uc->conn, uc->responses_in_send);
+    uc->responses_in_send = 0;
+    connection_progress(worker, uc);
+}
+
+static void handle_notify(UringWorker* worker) {
+    // Re-arm first so completions that land during the scan wake us again
+    response_notifier_clear(&worker->notifier);
+    if (!atomic_load(&worker->engine->stopping)) arm_notify(worker);
+
+    UringConnection* uc = worker->connections;
+    while (uc) {
+        UringConnection* next = uc->next;
+        if (!uc->send_in_flight && connection_has_outstanding(&uc->conn)) {
+            connection_progress(worker, uc);
+        }
+        uc = next;
+    }
+}
+
+static void handle_completion(UringWorker* worker, struct io_uring_cqe* cqe) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    UringConnection* uc = (UringConnection*)(uintptr_t)(data & ~URING_OP_MASK);
+
+    switch (data & URING_OP_MASK) {
+        case URING_OP_ACCEPT:
+            handle_accept(worker, cqe);
+            break;
+        case URING_OP_RECV:
+            handle_recv(worker, uc, cqe);
+            break;
+        case URING_OP_SEND:
+            handle_send(worker, uc, cqe);
+            break;
+        case URING_OP_NOTIFY:
+            handle_notify(worker);
+            break;
+        case URING_OP_CANCEL:
+            break;
+    }
+}
+
+static void* uring_worker_thread(void* arg) {
+    UringWorker* worker = (UringWorker*)arg;
+
+    if (!arm_accept(worker) || !arm_notify(worker)) {
+        fprintf(stderr, "Failed to arm io_uring worker\n");
+        return NULL;
+    }
+
+    while (!atomic_load(&worker->engine->stopping)) {
+        // Sleep no longer than the nearest deadline
+        int ret;
+        long timeout = timer_wheel_next_timeout(&worker->timers, worker->now_ms);
+        if (timeout >= 0) {
+            struct __kernel_timespec ts = {
+                .tv_sec = timeout / 1000,
+                .tv_nsec = (timeout % 1000) * 1000000L,
+            };
+            struct io_uring_cqe* first;
+            ret = io_uring_submit_and_wait_timeout(&worker->ring, &first, 1, &ts, NULL);
+        } else {
+            ret = io_uring_submit_and_wait(&worker->ring, 1);
+        }
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY && ret != -ETIME) {
+            fprintf(stderr, "io_uring wait failed: %s\n", strerror(-ret));
+            break;
+        }
+        worker->now_ms = timer_now_ms();
+
+        unsigned head;
+        unsigned seen = 0;
+        struct io_uring_cqe* cqe;
+        io_uring_for_each_cqe(&worker->ring, head, cqe) {
+            handle_completion(worker, cqe);
+            seen++;
+        }
+        io_uring_cq_advance(&worker->ring, seen);
+
+        timer_wheel_advance(&worker->timers, worker->now_ms, handle_timer, worker);
+
+        if (!worker->draining && connection_handler_draining(worker->handler)) {
+            start_drain(worker);
+        }
+        if (worker->draining && !worker->connections) break;
+    }
+
+    while (worker->connections) {
+        close_connection(worker, worker->connections);
+    }
+    return NULL;
+}
+
+static bool uring_worker_init(UringWorker* worker, UringEngine* engine,
+                              ConnectionHandler* handler, int listen_fd) {
+    worker->engine = engine;
+    worker->handler = handler;
+    worker->listen_fd = listen_fd;
+    worker->connections = NULL;
+    worker->draining = false;
+    worker->now_ms = timer_now_ms();
+    timer_wheel_init(&worker->timers, URING_TICK_MS, worker->now_ms);
+
+    int ret = io_uring_queue_init(URING_QUEUE_DEPTH, &worker->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring setup failed: %s\n", strerror(-ret));
+        return false;
+    }
+
+    worker->buffer_memory = (char*)malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    worker->buffers = worker->buffer_memory
+        ? io_uring_setup_buf_ring(&worker->ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP, 0, &ret)
+        : NULL;
+    if (!worker->buffers) {
+        fprintf(stderr, "io_uring buffer ring setup failed: %s\n", strerror(-ret));
+        free(worker->buffer_memory);
+        io_uring_queue_exit(&worker->ring);
+        return false;
+    }
+
+    int mask = io_uring_buf_ring_mask(URING_BUFFER_COUNT);
+    for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+        io_uring_buf_ring_add(worker->buffers, worker->buffer_memory + (size_t)i * URING_BUFFER_SIZE,
+                              URING_BUFFER_SIZE, (unsigned short)i, mask, i);
+    }
+    io_uring_buf_ring_advance(worker->buffers, URING_BUFFER_COUNT);
+
+    if (response_notifier_init(&worker->notifier) != 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        io_uring_free_buf_ring(&worker->ring, worker->buffers, URING_BUFFER_COUNT, URING_BUFFER_GROUP);
+        free(worker->buffer_memory);
+        io_uring_queue_exit(&worker->ring);
+        return false;
+    }
+
+    return true;
+}
+
+static void uring_worker_cleanup(UringWorker* worker) {
+    io_uring_free_buf_ring(&worker->ring, worker->buffers, URING_BUFFER_COUNT, URING_BUFFER_GROUP);
+    io_uring_queue_exit(&worker->ring);
+    free(worker->buffer_memory);
+}
+
+bool uring_engine_start(UringEngine* engine, ConnectionHandler* handler,
+                        int listen_fd, unsigned threads) {
+    engine->count = 0;
+    atomic_init(&engine->stopping, false);
+    engine->workers = (UringWorker*)calloc(threads, sizeof(UringWorker));
+    if (!engine->workers) return false;
+
+    for (unsigned i = 0; i < threads; i++) {
+        UringWorker* worker = &engine->workers[i];
+        if (!uring_worker_init(worker, engine, handler, listen_fd)) break;
+        if (pthread_create(&worker->thread, NULL, uring_worker_thread, worker) != 0) {
+            perror("Failed to create io_uring thread");
+            uring_worker_cleanup(worker);
+            response_notifier_destroy(&worker->notifier);
+            break;
+        }
+        engine->count++;
+    }
+
+    if (engine->count < threads) {
+        uring_engine_stop(engine);
+        uring_engine_destroy(engine);
+        return false;
+    }
+    return true;
+}
+
+static void wake_and_join(UringEngine* engine) {
+    for (unsigned i = 0; i < engine->count; i++) {
+        uint64_t one = 1;
+        ssize_t written = write(engine->workers[i].notifier.event_fd, &one, sizeof(one));
+        (void)written;
+    }
+
+    for (unsigned i = 0; i < engine->count; i++) {
+        pthread_join(engine->workers[i].thread, NULL);
+        uring_worker_cleanup(&engine->workers[i]);
+    }
+}
+
+void uring_engine_stop(UringEngine* engine) {
+    atomic_store(&engine->stopping, true);
+    wake_and_join(engine);
+}
+
+void uring_engine_drain(UringEngine* engine) {
+    wake_and_join(engine);
+}
+
+void uring_engine_destroy(UringEngine* engine) {
+    // Processors signal these descriptors, so they outlive the I/O threads
+    for (unsigned i = 0; i < engine->count; i++) {
+        response_notifier_destroy(&engine->workers[i].notifier);
+    }
+    free(engine->workers);
+    engine->workers = NULL;
+    engine->count = 0;
+}
+
+#else // !HAVE_IO_URING
+
+bool uring_engine_available(void) {
+    return false;
+}
+
+bool uring_engine_start(UringEngine* engine, ConnectionHandler* handler,
+                        int listen_fd, unsigned threads) {
+    (void)handler;
+    (void)listen_fd;
+    (void)threads;
+    engine->workers = NULL;
+    engine->count = 0;
+    fprintf(stderr, "Server was built without io_uring support (make IO_URING=1)\n");
+    return false;
+}
+
+void uring_engine_stop(UringEngine* engine) {
+    (void)engine;
+}
+
+void uring_engine_drain(UringEngine* engine) {
+    (void)engine;
+}
+
+void uring_engine_destroy(UringEngine* engine) {
+    (void)engine;
+}
+
+#endif // HAVE_IO_URING
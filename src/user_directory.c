@@ -0,0 +1,368 @@
+#include "user_directory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define INITIAL_BUCKETS 64
+// Longer fields in a journal record mean it is damaged
+#define JOURNAL_FIELD_MAX 65536
+
+// Journal record: this header, then the username and the password hash,
+// neither NUL-terminated. crc covers both strings.
+typedef struct {
+    uint32_t username_length;
+    uint32_t hash_length;
+    uint32_t crc;
+} JournalRecord;
+
+static uint64_t hash_username(const char* username) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)username; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static UserRecord* find_added(const UserDirectory* directory, const char* username) {
+    if (!directory->buckets) return NULL;
+    size_t bucket = hash_username(username) & (directory->bucket_count - 1);
+    for (UserRecord* record = directory->buckets[bucket]; record; record = record->next) {
+        if (strcmp(record->username, username) == 0) return record;
+    }
+    return NULL;
+}
+
+static bool grow_buckets(UserDirectory* directory) {
+    size_t count = directory->bucket_count ? directory->bucket_count * 2 : INITIAL_BUCKETS;
+    UserRecord** buckets = (UserRecord**)calloc(count, sizeof(UserRecord*));
+    if (!buckets) return false;
+
+    for (size_t i = 0; i < directory->bucket_count; i++) {
+        UserRecord* record = directory->buckets[i];
+        while (record) {
+            UserRecord* next = record->next;
+            size_t bucket = hash_username(record->username) & (count - 1);
+            record->next = buckets[bucket];
+            buckets[bucket] = record;
+            record = next;
+        }
+    }
+    free(directory->buckets);
+    directory->buckets = buckets;
+    directory->bucket_count = count;
+    return true;
+}
+
+static bool insert_added(UserDirectory* directory, const char* username, size_t username_length,
+                         const char* password_hash, size_t hash_length) {
+    if (directory->added >= directory->bucket_count && !grow_buckets(directory)) return false;
+
+    UserRecord* record = (UserRecord*)malloc(sizeof(UserRecord));
+    char* strings = (char*)malloc(username_length + hash_length + 2);
+    if (!record || !strings) {
+        free(record);
+        free(strings);
+        return false;
+    }
+    memcpy(strings, username, username_length);
+    strings[username_length] = '\0';
+    memcpy(strings + username_length + 1, password_hash, hash_length);
+    strings[username_length + 1 + hash_length] = '\0';
+    record->username = strings;
+    record->password_hash = strings + username_length + 1;
+
+    size_t bucket = hash_username(record->username) & (directory->bucket_count - 1);
+    record->next = directory->buckets[bucket];
+    directory->buckets[bucket] = record;
+    directory->added++;
+    return true;
+}
+
+static void free_added(UserDirectory* directory) {
+    for (size_t i = 0; i < directory->bucket_count; i++) {
+        UserRecord* record = directory->buckets[i];
+        while (record) {
+            UserRecord* next = record->next;
+            free(record->username);  // The hash shares its allocation
+            free(record);
+            record = next;
+        }
+    }
+    free(directory->buckets);
+    directory->buckets = NULL;
+    directory->bucket_count = 0;
+    directory->added = 0;
+}
+
+// Applies journal records from journal_offset to the end, skipping users
+// already known. A damaged tail, left by a crash mid-append, is cut off.
+// Called with the journal locked.
+static bool replay_journal(UserDirectory* directory) {
+    struct stat st;
+    if (fstat(directory->journal_fd, &st) != 0) return false;
+    if (st.st_size < directory->journal_offset) {
+        // Emptied by someone else's checkpoint; their snapshot holds it all
+        directory->journal_offset = 0;
+    }
+    size_t length = (size_t)(st.st_size - directory->journal_offset);
+    if (length == 0) return true;
+
+    char* buffer = (char*)malloc(length);
+    if (!buffer) return false;
+    ssize_t n = pread(directory->journal_fd, buffer, length, directory->journal_offset);
+    if (n != (ssize_t)length) {
+        free(buffer);
+        return false;
+    }
+
+    size_t position = 0;
+    char username[JOURNAL_FIELD_MAX + 1];
+    while (length - position >= sizeof(JournalRecord)) {
+        JournalRecord header;
+        memcpy(&header, buffer + position, sizeof(header));
+        if (header.username_length == 0 || header.username_length > JOURNAL_FIELD_MAX ||
+            header.hash_length > JOURNAL_FIELD_MAX ||
+            length - position - sizeof(header) <
+                (size_t)header.username_length + header.hash_length) {
+            break;
+        }
+        const char* strings = buffer + position + sizeof(header);
+        size_t strings_length = (size_t)header.username_length + header.hash_length;
+        if ((uint32_t)crc32(0, (const Bytef*)strings, (uInt)strings_length) != header.crc) break;
+
+        memcpy(username, strings, header.username_length);
+        username[header.username_length] = '\0';
+        if (!user_directory_find(directory, username) &&
+            !insert_added(directory, strings, header.username_length,
+                          strings + header.username_length, header.hash_length)) {
+            free(buffer);
+            return false;
+        }
+        position += sizeof(header) + strings_length;
+    }
+    free(buffer);
+
+    directory->journal_offset += (off_t)position;
+    if (position < length) {
+        fprintf(stderr, "Discarding %zu damaged bytes at the end of %s\n",
+                length - position, directory->journal_path);
+        if (ftruncate(directory->journal_fd, directory->journal_offset) != 0) return false;
+    }
+    return true;
+}
+
+bool user_directory_open(UserDirectory* directory, const char* snapshot_path,
+                         const char* journal_path) {
+    memset(directory, 0, sizeof(*directory));
+    directory->journal_fd = -1;
+    directory->snapshot_path = strdup(snapshot_path);
+    directory->journal_path = strdup(journal_path);
+    if (!directory->snapshot_path || !directory->journal_path) {
+        user_directory_close(directory);
+        return false;
+    }
+
+    if (snapshot_open(&directory->snapshot, snapshot_path) == SNAPSHOT_INVALID) {
+        user_directory_close(directory);
+        return false;
+    }
+
+    directory->journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (directory->journal_fd < 0) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", journal_path, strerror(errno));
+        user_directory_close(directory);
+        return false;
+    }
+
+    flock(directory->journal_fd, LOCK_EX);
+    bool replayed = replay_journal(directory);
+    flock(directory->journal_fd, LOCK_UN);
+    if (!replayed) {
+        fprintf(stderr, "Failed to replay journal %s\n", journal_path);
+        user_directory_close(directory);
+        return false;
+    }
+    return true;
+}
+
+void user_directory_close(UserDirectory* directory) {
+    snapshot_close(&directory->snapshot);
+    free_added(directory);
+    if (directory->journal_fd >= 0) {
+        close(directory->journal_fd);
+        directory->journal_fd = -1;
+    }
+    free(directory->snapshot_path);
+    free(directory->journal_path);
+    directory->snapshot_path = NULL;
+    directory->journal_path = NULL;
+}
+
+bool user_directory_empty(const UserDirectory* directory) {
+    return !directory->snapshot.map && directory->added == 0;
+}
+
+size_t user_directory_count(const UserDirectory* directory) {
+    return directory->snapshot.count + directory->added;
+}
+
+const char* user_directory_find(const UserDirectory* directory, const char* username) {
+    long index = snapshot_find(&directory->snapshot, username);
+    if (index >= 0) return snapshot_user(&directory->snapshot, (size_t)index).password_hash;
+    UserRecord* record = find_added(directory, username);
+    return record ? record->password_hash : NULL;
+}
+
+static bool append_journal(UserDirectory* directory, const char* username,
+                           const char* password_hash) {
+    JournalRecord header;
+    header.username_length = (uint32_t)strlen(username);
+    header.hash_length = (uint32_t)strlen(password_hash);
+
+    size_t length = sizeof(header) + header.username_length + header.hash_length;
+    char* record = (char*)malloc(length);
+    if (!record) return false;
+    memcpy(record + sizeof(header), username, header.username_length);
+    memcpy(record + sizeof(header) + header.username_length, password_hash, header.hash_length);
+    header.crc = (uint32_t)crc32(0, (const Bytef*)(record + sizeof(header)),
+                                 header.username_length + header.hash_length);
+    memcpy(record, &header, sizeof(header));
+
+    // One write per record; a short one is cut back off so later records
+    // are not stranded behind it
+    flock(directory->journal_fd, LOCK_EX);
+    off_t end = lseek(directory->journal_fd, 0, SEEK_END);
+    bool written = end >= 0 && write(directory->journal_fd, record, length) == (ssize_t)length;
+    if (!written && end >= 0 && ftruncate(directory->journal_fd, end) != 0) {
+        fprintf(stderr, "Failed to repair journal %s\n", directory->journal_path);
+    }
+    if (written && end == directory->journal_offset) {
+        directory->journal_offset = end + (off_t)length;
+    }
+    flock(directory->journal_fd, LOCK_UN);
+
+    free(record);
+    return written;
+}
+
+UserAddResult user_directory_add(UserDirectory* directory, const char* username,
+                                 const char* password_hash) {
+    if (user_directory_find(directory, username)) return USER_EXISTS;
+    if (strlen(username) > JOURNAL_FIELD_MAX || strlen(password_hash) > JOURNAL_FIELD_MAX) {
+        return USER_ADD_FAILED;
+    }
+
+    if (!append_journal(directory, username, password_hash)) {
+        fprintf(stderr, "Failed to append to journal %s: %s\n",
+                directory->journal_path, strerror(errno));
+        return USER_ADD_FAILED;
+    }
+    if (!insert_added(directory, username, strlen(username),
+                      password_hash, strlen(password_hash))) {
+        return USER_ADD_FAILED;
+    }
+
+    size_t threshold = directory->snapshot.count / 4;
+    if (threshold < USER_DIRECTORY_CHECKPOINT_MIN) threshold = USER_DIRECTORY_CHECKPOINT_MIN;
+    if (directory->added >= threshold) {
+        // The user is journaled either way; a failed checkpoint is retried later
+        user_directory_checkpoint(directory);
+    }
+    return USER_ADDED;
+}
+
+static int compare_records(const void* a, const void* b) {
+    const UserRecord* left = *(const UserRecord* const*)a;
+    const UserRecord* right = *(const UserRecord* const*)b;
+    return strcmp(left->username, right->username);
+}
+
+// Merges the snapshot with the added users into one sorted list. The
+// strings stay where they are, so the result lives only as long as both.
+static SnapshotUser* merge_users(const UserDirectory* directory, size_t* count) {
+    size_t added = directory->added;
+    UserRecord** records = (UserRecord**)malloc((added ? added : 1) * sizeof(UserRecord*));
+    SnapshotUser* users = (SnapshotUser*)malloc((directory->snapshot.count + added + 1) *
+                                                sizeof(SnapshotUser));
+    if (!records || !users) {
+        free(records);
+        free(users);
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < directory->bucket_count; i++) {
+        for (UserRecord* record = directory->buckets[i]; record; record = record->next) {
+            records[n++] = record;
+        }
+    }
+    qsort(records, added, sizeof(UserRecord*), compare_records);
+
+    // Added users are never in the snapshot, so there are no ties
+    size_t from_snapshot = 0, from_added = 0;
+    n = 0;
+    while (from_snapshot < directory->snapshot.count || from_added < added) {
+        if (from_added == added ||
+            (from_snapshot < directory->snapshot.count &&
+             strcmp(snapshot_user(&directory->snapshot, from_snapshot).username,
+                    records[from_added]->username) < 0)) {
+            users[n++] = snapshot_user(&directory->snapshot, from_snapshot++);
+        } else {
+            SnapshotUser user = {records[from_added]->username, records[from_added]->password_hash};
+            users[n++] = user;
+            from_added++;
+        }
+    }
+
+    free(records);
+    *count = n;
+    return users;
+}
+
+bool user_directory_checkpoint(UserDirectory* directory) {
+    flock(directory->journal_fd, LOCK_EX);
+
+    bool success = false;
+    size_t count = 0;
+    SnapshotUser* users = replay_journal(directory) ? merge_users(directory, &count) : NULL;
+    if (users && snapshot_write(directory->snapshot_path, users, count)) {
+        Snapshot fresh;
+        if (snapshot_open(&fresh, directory->snapshot_path) == SNAPSHOT_OK) {
+            snapshot_close(&directory->snapshot);
+            directory->snapshot = fresh;
+            free_added(directory);
+            success = ftruncate(directory->journal_fd, 0) == 0;
+            directory->journal_offset = 0;
+        }
+    }
+    free(users);
+
+    flock(directory->journal_fd, LOCK_UN);
+    if (!success) {
+        fprintf(stderr, "Checkpoint of %s failed\n", directory->snapshot_path);
+    }
+    return success;
+}
+
+void user_directory_for_each(const UserDirectory* directory,
+                             bool (*visit)(const char* username, const char* password_hash,
+                                           void* ctx),
+                             void* ctx) {
+    for (size_t i = 0; i < directory->snapshot.count; i++) {
+        SnapshotUser user = snapshot_user(&directory->snapshot, i);
+        if (!visit(user.username, user.password_hash, ctx)) return;
+    }
+    for (size_t i = 0; i < directory->bucket_count; i++) {
+        for (UserRecord* record = directory->buckets[i]; record; record = record->next) {
+            if (!visit(record->username, record->password_hash, ctx)) return;
+        }
+    }
+}